@@ -0,0 +1,86 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+struct arena_block {
+    struct arena_block *next;
+    size_t size;                    /* Usable bytes behind the header */
+};
+
+static struct arena_block *free_blocks = NULL;
+static int free_block_count = 0;
+
+/* Memory for size bytes until the next arena_reset(), or NULL if there is none */
+void *arena_alloc(struct arena *arena, size_t size) {
+    struct arena_block *block = arena->blocks;
+    char *p;
+
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if (block && block->size - arena->used >= size) {
+        p = (char *)(block + 1) + arena->used;
+        arena->used += size;
+        return p;
+    }
+
+    if (size > ARENA_BLOCK_SIZE) {
+        /* Too big to share; it goes behind the newest block, which keeps filling */
+        block = malloc(sizeof(*block) + size);
+        if (block == NULL) {
+            return NULL;
+        }
+        block->size = size;
+        if (arena->blocks) {
+            block->next = arena->blocks->next;
+            arena->blocks->next = block;
+        } else {
+            block->next = NULL;
+            arena->blocks = block;
+            arena->used = size;
+        }
+        return block + 1;
+    }
+
+    if (free_blocks) {
+        block = free_blocks;
+        free_blocks = block->next;
+        free_block_count--;
+    } else {
+        block = malloc(sizeof(*block) + ARENA_BLOCK_SIZE);
+        if (block == NULL) {
+            return NULL;
+        }
+        block->size = ARENA_BLOCK_SIZE;
+    }
+    block->next = arena->blocks;
+    arena->blocks = block;
+    arena->used = size;
+    return block + 1;
+}
+
+/* A NUL-terminated copy of length bytes */
+char *arena_strndup(struct arena *arena, const char *s, size_t length) {
+    char *copy = arena_alloc(arena, length + 1);
+
+    if (copy) {
+        memcpy(copy, s, length);
+        copy[length] = '\0';
+    }
+    return copy;
+}
+
+void arena_reset(struct arena *arena) {
+    while (arena->blocks) {
+        struct arena_block *block = arena->blocks;
+
+        arena->blocks = block->next;
+        if (block->size == ARENA_BLOCK_SIZE && free_block_count < ARENA_FREE_BLOCKS) {
+            block->next = free_blocks;
+            free_blocks = block;
+            free_block_count++;
+        } else {
+            free(block);
+        }
+    }
+    arena->used = 0;
+}
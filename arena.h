@@ -0,0 +1,30 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+/*
+ * Scratch memory for one request. Allocations are carved off the front of
+ * fixed-size blocks and never freed one at a time; arena_reset() hands all
+ * of an arena's blocks back at once, leaving it empty. Spare blocks wait on
+ * a free list shared by every arena in the process, so a steady load
+ * doesn't call malloc(). Not thread-safe: arenas belong to one event loop.
+ */
+#ifndef ARENA_BLOCK_SIZE
+#define ARENA_BLOCK_SIZE 1024       /* Larger allocations get a block of their own */
+#endif
+#define ARENA_FREE_BLOCKS 64        /* Spare blocks kept; the rest go back to free() */
+#define ARENA_ALIGN 8
+
+struct arena_block;
+
+struct arena {
+    struct arena_block *blocks;     /* Newest first; allocations come from its unused tail */
+    size_t used;                    /* Bytes of the newest block handed out */
+};
+
+void *arena_alloc(struct arena *arena, size_t size);
+char *arena_strndup(struct arena *arena, const char *s, size_t length);
+void arena_reset(struct arena *arena);
+
+#endif
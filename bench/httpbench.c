@@ -0,0 +1,405 @@
+/* HTTP load generator for httpd2.
+ *
+ * Closed loop by default: a fixed number of connections are kept busy, each
+ * sending a request as soon as the previous response has been read. With -r
+ * it runs open loop instead, starting that many requests per second on a
+ * fixed schedule whether or not earlier ones have been answered. A request
+ * that finds every connection busy waits for one, and its latency counts
+ * from when it was due, so a server that stalls can't hide the queue it
+ * caused. With -k connections are reused (HTTP/1.1 keep-alive); without it
+ * every request pays for its own TCP handshake and teardown. -P sends a
+ * form POST with the given body instead of a GET, and -H adds a header line,
+ * such as "Accept-Encoding: gzip". -i connects every client first and
+ * leaves them idle for that many seconds before the first requests, which
+ * all go out just after a second boundary, as the server's once-a-second
+ * idle sweep comes round; errors from connections it closed are expected
+ * there. -S counts the system calls the server
+ * process with that pid makes during the run, to compare its backends by.
+ *
+ * Reports requests per second and the p50, p99 and p99.9 latencies, and the
+ * server's system calls per request with -S, as a line of text or, with -j,
+ * as one JSON object.
+ */
+#define _GNU_SOURCE     /* ppoll() */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "../metrics.h"
+#include "syscount.h"
+
+#define BUFFER_SIZE 65536
+#define MAX_CLIENTS 1024
+
+struct client {
+    int fd;
+    int busy;               /* A request is out and its response not yet read */
+    double due;             /* When the request was meant to start */
+    size_t received;        /* Bytes of the current response read so far */
+    long expected;          /* Header plus body length once headers are in, else -1 */
+    int closing;            /* Server announced it will close after this response */
+    char headers[1024];
+};
+
+static struct sockaddr_in server_addr;
+static char request[2048];
+static size_t request_len;
+static int keep_alive = 0;
+static struct histogram latency;    /* Microseconds */
+
+/* poll() with a timeout in seconds, or forever when it is negative; ppoll() keeps an open loop's schedule finer than a millisecond */
+int poll_for(struct pollfd *fds, int count, double timeout) {
+#ifdef __linux__
+    struct timespec ts;
+
+    if (timeout < 0) {
+        return ppoll(fds, count, NULL, NULL);
+    }
+    ts.tv_sec = (time_t)timeout;
+    ts.tv_nsec = (long)((timeout - ts.tv_sec) * 1e9);
+    return ppoll(fds, count, &ts, NULL);
+#else
+    return poll(fds, count, timeout < 0 ? -1 : (int)(timeout * 1000) + 1);
+#endif
+}
+
+double now_seconds() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+void sleep_until(double when) {
+    double left = when - now_seconds();
+
+    if (left > 0) {
+        usleep((useconds_t)(left * 1e6));
+    }
+}
+
+/* Open a fresh connection */
+int client_connect(struct client *c) {
+    int one = 1;
+
+    c->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (c->fd == -1) {
+        perror("socket failed");
+        return -1;
+    }
+    setsockopt(c->fd, IPPROTO_TCP, 1 /* TCP_NODELAY */, &one, sizeof(one));
+    if (connect(c->fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1) {
+        perror("connect failed");
+        close(c->fd);
+        c->fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+int client_send(struct client *c) {
+    c->received = 0;
+    c->expected = -1;
+    if (write(c->fd, request, request_len) != (ssize_t)request_len) {
+        return -1;
+    }
+    return 0;
+}
+
+/* Send the request that was due at the given time, connecting first if need be */
+int client_start(struct client *c, double due) {
+    if (c->fd == -1 && client_connect(c) == -1) {
+        return -1;
+    }
+    if (client_send(c) == -1) {
+        close(c->fd);
+        c->fd = -1;
+        return -1;
+    }
+    c->due = due;
+    c->busy = 1;
+    return 0;
+}
+
+/* Consume response bytes; returns 1 when the response is complete, -1 on error */
+int client_read(struct client *c) {
+    char buffer[BUFFER_SIZE];
+    ssize_t n = read(c->fd, buffer, sizeof(buffer));
+
+    if (n <= 0) {
+        return -1;
+    }
+
+    if (c->expected == -1) {
+        size_t copy = c->received + n < sizeof(c->headers) - 1 ? (size_t)n : sizeof(c->headers) - 1 - c->received;
+        char *end, *length;
+
+        memcpy(c->headers + c->received, buffer, copy);
+        c->headers[c->received + copy] = '\0';
+        end = strstr(c->headers, "\r\n\r\n");
+        if (end) {
+            length = strstr(c->headers, "Content-Length:");
+            if (length == NULL) {
+                return -1;
+            }
+            c->expected = (end + 4 - c->headers) + atol(length + 15);
+            c->closing = strstr(c->headers, "Connection: close") != NULL;
+        }
+    }
+
+    c->received += n;
+    return c->expected != -1 && (long)c->received >= c->expected;
+}
+
+void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [-k] [-j] [-c connections] [-n requests] [-r requests/sec] [-P post body] [-H header] [-i idle seconds] [-S server pid] [-p port] [host] [path]\n", program);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    static struct client clients[MAX_CLIENTS];
+    static struct pollfd pollfds[MAX_CLIENTS];
+    static struct client *polled[MAX_CLIENTS];
+    const char *host = "127.0.0.1";
+    const char *path = "/about";
+    const char *post_body = NULL;
+    const char *extra_header = NULL;
+    char header_line[512];
+    const char *method;
+    int port = 8080;
+    int connections = 16;
+    int json = 0;
+    int idle = 0;               /* Seconds connections sit idle before their first request */
+    double rate = 0;            /* Requests per second for an open loop; 0 for closed */
+    long requests = 100000;
+    long sent = 0, completed = 0, errors = 0;
+    pid_t server_pid = 0;
+    struct syscount syscalls;
+    unsigned long syscalls_before = 0, syscalls_used = 0;
+    double start, elapsed;
+    int i, opt, length;
+
+    while ((opt = getopt(argc, argv, "kjc:n:r:P:H:i:S:p:")) != -1) {
+        switch (opt) {
+        case 'k':
+            keep_alive = 1;
+            break;
+        case 'j':
+            json = 1;
+            break;
+        case 'c':
+            connections = atoi(optarg);
+            break;
+        case 'n':
+            requests = atol(optarg);
+            break;
+        case 'r':
+            rate = atof(optarg);
+            break;
+        case 'P':
+            post_body = optarg;
+            break;
+        case 'H':
+            extra_header = optarg;
+            break;
+        case 'i':
+            idle = atoi(optarg);
+            break;
+        case 'S':
+            server_pid = atoi(optarg);
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind < argc) {
+        host = argv[optind++];
+    }
+    if (optind < argc) {
+        path = argv[optind++];
+    }
+    if (connections < 1 || connections > MAX_CLIENTS) {
+        fprintf(stderr, "Connections must be between 1 and %d\n", MAX_CLIENTS);
+        exit(EXIT_FAILURE);
+    }
+    if (rate < 0 || requests < 1) {
+        usage(argv[0]);
+    }
+    if (connections > requests) {
+        connections = requests;
+    }
+
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &server_addr.sin_addr) != 1) {
+        fprintf(stderr, "Invalid address: %s\n", host);
+        exit(EXIT_FAILURE);
+    }
+
+    method = post_body ? "POST" : "GET";
+    header_line[0] = '\0';
+    if (extra_header) {
+        snprintf(header_line, sizeof(header_line), "%s\r\n", extra_header);
+    }
+    if (post_body) {
+        length = snprintf(request, sizeof(request), "POST %s HTTP/1.1\r\nHost: %s\r\nConnection: %s\r\n%s"
+                          "Content-Type: application/x-www-form-urlencoded\r\nContent-Length: %d\r\n\r\n%s",
+                          path, host, keep_alive ? "keep-alive" : "close", header_line, (int)strlen(post_body), post_body);
+    } else {
+        length = snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: %s\r\n%s\r\n",
+                          path, host, keep_alive ? "keep-alive" : "close", header_line);
+    }
+    if (length < 0 || length >= (int)sizeof(request)) {
+        fprintf(stderr, "Request too long\n");
+        exit(EXIT_FAILURE);
+    }
+    request_len = length;
+
+    for (i = 0; i < connections; i++) {
+        clients[i].fd = -1;
+    }
+
+    if (idle > 0) {
+        /*
+         * Connect a third of the way into a second, so the server's one-second
+         * waits end a third of the way in too, and send just after the second
+         * boundary: the requests wake it in the same pass that sweeps them.
+         */
+        double connected = (double)(long)now_seconds() + 1.3;
+
+        sleep_until(connected);
+        for (i = 0; i < connections; i++) {
+            client_connect(&clients[i]);
+        }
+        sleep_until(connected - 0.3 + idle + 0.05);
+    }
+
+    if (server_pid) {
+        if (syscount_open(&syscalls, server_pid) == -1) {
+            exit(EXIT_FAILURE);
+        }
+        syscalls_before = syscount_read(&syscalls);
+    }
+
+    start = now_seconds();
+    while (completed + errors < requests) {
+        double now = now_seconds();
+        double timeout = -1;
+        int count = 0;
+
+        /* Start whatever is due on the idle connections; a closed loop has everything due at once */
+        for (i = 0; i < connections && sent < requests; i++) {
+            struct client *c = &clients[i];
+            double due = rate > 0 ? start + sent / rate : now;
+
+            if (c->busy) {
+                continue;
+            }
+            if (due > now) {
+                break;
+            }
+            if (client_start(c, due) == -1) {
+                errors++;
+            }
+            sent++;
+        }
+
+        /* Wake up for the next scheduled request, unless it is already late and waiting for a connection */
+        if (rate > 0 && sent < requests && start + sent / rate > now) {
+            timeout = start + sent / rate - now;
+        }
+
+        for (i = 0; i < connections; i++) {
+            if (clients[i].busy) {
+                pollfds[count].fd = clients[i].fd;
+                pollfds[count].events = POLLIN;
+                polled[count++] = &clients[i];
+            }
+        }
+        if (poll_for(pollfds, count, timeout) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll failed");
+            exit(EXIT_FAILURE);
+        }
+
+        for (i = 0; i < count; i++) {
+            struct client *c = polled[i];
+            int done;
+
+            if (pollfds[i].revents == 0) {
+                continue;
+            }
+
+            done = client_read(c);
+            if (done == 0) {
+                continue;
+            }
+            if (done == 1) {
+                histogram_record(&latency, (unsigned long)((now_seconds() - c->due) * 1e6));
+                completed++;
+            } else {
+                errors++;
+            }
+
+            c->busy = 0;
+            if (!keep_alive || done == -1 || c->closing) {
+                close(c->fd);
+                c->fd = -1;
+            }
+        }
+    }
+    elapsed = now_seconds() - start;
+    if (server_pid) {
+        syscalls_used = syscount_read(&syscalls) - syscalls_before;
+        syscount_close(&syscalls);
+    }
+
+    for (i = 0; i < connections; i++) {
+        if (clients[i].fd != -1) {
+            close(clients[i].fd);
+        }
+    }
+
+    if (json) {
+        printf("{\"bench\":\"http\",\"method\":\"%s\",\"path\":\"%s\",\"header\":\"%s\",\"keep_alive\":%s,\"mode\":\"%s\",\"rate\":%.0f,"
+               "\"connections\":%d,\"requests\":%ld,\"errors\":%ld,\"seconds\":%.3f,\"requests_per_sec\":%.0f,"
+               "\"p50_us\":%lu,\"p99_us\":%lu,\"p999_us\":%lu",
+               method, path, extra_header ? extra_header : "", keep_alive ? "true" : "false", rate > 0 ? "open" : "closed", rate,
+               connections, completed, errors, elapsed, completed / elapsed,
+               histogram_quantile(&latency, 0.5), histogram_quantile(&latency, 0.99), histogram_quantile(&latency, 0.999));
+        if (server_pid) {
+            printf(",\"server_syscalls_per_request\":%.2f", completed ? (double)syscalls_used / completed : 0.0);
+        }
+        printf("}\n");
+    } else {
+        printf("%s %s %s", keep_alive ? "keep-alive" : "close", method, path);
+        if (extra_header) {
+            printf(" (%s)", extra_header);
+        }
+        if (rate > 0) {
+            printf(" at %.0f/s", rate);
+        }
+        printf(": %ld requests, %ld errors, %d connections, %.3f s, %.0f requests/sec, p50 %.3f ms, p99 %.3f ms, p99.9 %.3f ms",
+               completed, errors, connections, elapsed, completed / elapsed,
+               histogram_quantile(&latency, 0.5) / 1e3, histogram_quantile(&latency, 0.99) / 1e3,
+               histogram_quantile(&latency, 0.999) / 1e3);
+        if (server_pid) {
+            printf(", %.2f server syscalls/request", completed ? (double)syscalls_used / completed : 0.0);
+        }
+        printf("\n");
+    }
+    return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,38 @@
+#!/bin/sh
+# Regression check for connections that wake up as they are swept.
+#
+# Starts httpd2 (built with AddressSanitizer by "make idle-check") in a
+# scratch directory, opens a batch of keep-alive connections and leaves
+# them idle for exactly KEEPALIVE_TIMEOUT seconds, so their requests arrive
+# in the same event loop pass as the sweep that closes them. Each round the
+# server must survive, and answer a fresh request afterwards.
+#
+# Usage: bench/idle_sweep.sh [httpd2 binary] [rounds]
+
+HTTPD=${1:-bench/httpd2-asan}
+ROUNDS=${2:-3}
+IDLE=5
+ROOT=$(pwd)
+DIR=$(mktemp -d)
+FAILED=0
+
+trap 'kill $SERVER 2>/dev/null; rm -rf "$DIR"' EXIT INT TERM
+
+(cd "$DIR" && exec "$ROOT/$HTTPD" --access-log off) 2> "$DIR/stderr" > /dev/null &
+SERVER=$!
+sleep 0.5
+
+for round in $(seq "$ROUNDS"); do
+    # Errors are expected: some of the connections are closed before their request is read
+    bench/httpbench -k -c 50 -n 50 -i "$IDLE" 127.0.0.1 /about > /dev/null 2>&1
+    if ! kill -0 "$SERVER" 2>/dev/null || ! bench/httpbench -c 1 -n 1 127.0.0.1 /about > /dev/null; then
+        echo "round $round: httpd2 did not survive idle connections waking as they were swept"
+        FAILED=1
+        break
+    fi
+done
+cat "$DIR/stderr" >&2
+if [ "$FAILED" = 0 ]; then
+    echo "idle sweep: $ROUNDS rounds, server survived"
+fi
+exit $FAILED
@@ -0,0 +1,172 @@
+/* Throughput and fuzz harness for the HTTP request parser.
+ *
+ * Throughput parses a small corpus of realistic requests, first handed over
+ * whole and then as it would arrive in small TCP segments, and reports parsed
+ * requests per second. The fuzz pass mutates the corpus at random, feeds it
+ * in random-sized pieces and checks that every slice the parser hands back
+ * stays inside the bytes it was given.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "../http_parser.h"
+
+#define BUFFER_SIZE 4096
+#define MAX_HEADER_SIZE 2048
+#define MAX_BODY_SIZE 2047
+
+static const char *corpus[] = {
+    "GET / HTTP/1.1\r\nHost: localhost:8080\r\n\r\n",
+    "GET /about?name=bob HTTP/1.1\r\nHost: localhost:8080\r\nUser-Agent: Mozilla/5.0 (X11; Linux x86_64) "
+    "AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0 Safari/537.36\r\nAccept: text/html,application/xhtml+xml,"
+    "application/xml;q=0.9,*/*;q=0.8\r\nAccept-Language: en-GB,en;q=0.5\r\nAccept-Encoding: gzip, deflate\r\n"
+    "Connection: keep-alive\r\nCookie: session=0123456789abcdef; theme=dark\r\nCache-Control: max-age=0\r\n\r\n",
+    "POST /submit HTTP/1.1\r\nHost: localhost\r\nContent-Type: application/x-www-form-urlencoded\r\n"
+    "Content-Length: 13\r\n\r\nname=Jane+Doe",
+    "POST /submit HTTP/1.1\r\nHost: localhost\r\nTransfer-Encoding: chunked\r\n\r\n"
+    "5\r\nname=\r\n8;ext=1\r\nJane+Doe\r\n0\r\nX-Trailer: 1\r\n\r\n",
+    "GET /dynamic HTTP/1.0\r\n\r\n"
+};
+
+#define CORPUS_SIZE (sizeof(corpus) / sizeof(corpus[0]))
+
+double now_seconds() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+void check_slice(struct http_slice slice, size_t length, const char *what) {
+    if (slice.offset + slice.length > length) {
+        fprintf(stderr, "%s slice %u+%u runs past %lu bytes\n", what, slice.offset, slice.length, (unsigned long)length);
+        abort();
+    }
+}
+
+/* Everything a completed request refers to must lie inside what was parsed */
+void check_request(const struct http_request *req, size_t length) {
+    int i;
+
+    if (req->consumed > length || req->body_start + req->body_len > req->consumed) {
+        fprintf(stderr, "request claims %lu bytes of %lu\n", (unsigned long)req->consumed, (unsigned long)length);
+        abort();
+    }
+    check_slice(req->method, length, "method");
+    check_slice(req->path, length, "path");
+    check_slice(req->query, length, "query");
+    for (i = 0; i < req->header_count; i++) {
+        check_slice(req->headers[i].name, length, "header name");
+        check_slice(req->headers[i].value, length, "header value");
+    }
+}
+
+/* Feed one request to the parser in pieces of at most step bytes; step 0 means all at once */
+int parse_in_steps(char *buffer, size_t length, size_t step, struct http_request *req) {
+    size_t available = step ? 0 : length;
+    int result;
+
+    http_request_init(req, MAX_HEADER_SIZE, MAX_BODY_SIZE);
+    while (1) {
+        if (step) {
+            available += step;
+            if (available > length) {
+                available = length;
+            }
+        }
+        result = http_parse(req, buffer, available);
+        if (result != HTTP_PARSE_INCOMPLETE || available == length) {
+            return result;
+        }
+    }
+}
+
+void throughput(const char *label, size_t step, long iterations) {
+    char buffer[BUFFER_SIZE];
+    struct http_request req;
+    double start, elapsed;
+    long parsed = 0;
+    long i;
+
+    start = now_seconds();
+    for (i = 0; i < iterations; i++) {
+        const char *request = corpus[i % CORPUS_SIZE];
+        size_t length = strlen(request);
+
+        /* Chunked bodies are joined in place, so every pass needs a fresh copy */
+        memcpy(buffer, request, length);
+        if (parse_in_steps(buffer, length, step, &req) != HTTP_PARSE_COMPLETE) {
+            fprintf(stderr, "corpus request %lu failed to parse\n", (unsigned long)(i % CORPUS_SIZE));
+            exit(EXIT_FAILURE);
+        }
+        parsed++;
+    }
+    elapsed = now_seconds() - start;
+
+    printf("%s: %ld requests in %.3f s, %.0f requests/sec\n", label, parsed, elapsed, parsed / elapsed);
+}
+
+void fuzz(long iterations) {
+    char buffer[BUFFER_SIZE];
+    struct http_request req;
+    long accepted = 0, rejected = 0, incomplete = 0;
+    long i;
+
+    for (i = 0; i < iterations; i++) {
+        const char *request = corpus[rand() % CORPUS_SIZE];
+        size_t length = strlen(request);
+        int mutations = 1 + rand() % 4;
+        int result;
+
+        memcpy(buffer, request, length);
+        while (mutations--) {
+            size_t at = rand() % length;
+            switch (rand() % 4) {
+            case 0:     /* Overwrite a byte */
+                buffer[at] = (char)rand();
+                break;
+            case 1:     /* Truncate */
+                length = at + 1;
+                break;
+            case 2:     /* Repeat a run, growing the request */
+                if (length + 64 < sizeof(buffer)) {
+                    memmove(buffer + at + 64, buffer + at, length - at);
+                    length += 64;
+                }
+                break;
+            default:    /* Swap in a digit or delimiter the parser cares about */
+                buffer[at] = "0123456789abcdefABCDEF\r\n:; ?/."[rand() % 31];
+                break;
+            }
+        }
+
+        result = parse_in_steps(buffer, length, 1 + rand() % 16, &req);
+        if (result == HTTP_PARSE_COMPLETE) {
+            check_request(&req, length);
+            accepted++;
+        } else if (result == HTTP_PARSE_ERROR) {
+            if (req.status < 400 || req.status > 599) {
+                fprintf(stderr, "rejected with status %d\n", req.status);
+                abort();
+            }
+            rejected++;
+        } else {
+            incomplete++;
+        }
+    }
+
+    printf("fuzz: %ld mutated requests, %ld parsed, %ld rejected, %ld incomplete\n",
+           iterations, accepted, rejected, incomplete);
+}
+
+int main(int argc, char *argv[]) {
+    long iterations = argc > 1 ? atol(argv[1]) : 2000000;
+
+    srand(getpid());
+    throughput("whole", 0, iterations);
+    throughput("segmented (64 byte steps)", 64, iterations);
+    fuzz(iterations / 4);
+    return 0;
+}
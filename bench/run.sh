@@ -0,0 +1,77 @@
+#!/bin/sh
+# The whole benchmark suite, one JSON object per line on stdout, so that
+# runs on two commits can be lined up and compared.
+#
+# httpd2 serves a scratch directory holding a small file (kept in its file
+# cache), a large one (sent from disk, whole and as a 64 KB range) and an
+# HTML page, fetched plain and gzip-encoded; it always listens on 8080. Each HTTP case runs closed loop
+# with and without keep-alive, and the constant page runs open loop at a
+# fixed rate too. tftpd gets a spare port and a scratch directory of its
+# own, and is driven by concurrent RRQ and WRQ clients on a clean link, then
+# with delay and loss. Every case runs once against each backend, the
+# default epoll loop and --io-uring, and reports the server's system calls
+# per request (or per TFTP block) alongside, tagged with the backend.
+#
+# Usage: bench/run.sh [requests per HTTP case] [tftp port]
+
+REQUESTS=${1:-50000}
+PORT=${2:-16969}
+ROOT=$(pwd)
+DIR=$(mktemp -d)
+
+HTTPD=
+TFTPD=
+trap 'kill $HTTPD $TFTPD 2>/dev/null; rm -rf "$DIR"' EXIT INT TERM
+
+mkdir "$DIR/www" "$DIR/tftp"
+head -c 4096 /dev/urandom > "$DIR/www/small.bin"
+head -c 1048576 /dev/urandom > "$DIR/www/large.bin"
+yes '<p>The quick brown fox jumps over the lazy dog.</p>' | head -c 65536 > "$DIR/www/page.html"
+head -c 1000000 /dev/urandom > "$DIR/tftp/payload"
+
+# Every case against the servers currently running, one JSON line each
+run_cases() {
+    for keep in -k ""; do
+        for path in / /about "/about?name=bench+user" /dynamic /small.bin /page.html; do
+            bench/httpbench -j -S "$HTTPD" $keep -c 50 -n "$REQUESTS" 127.0.0.1 "$path"
+        done
+        bench/httpbench -j -S "$HTTPD" $keep -c 50 -n "$REQUESTS" -P "name=bench&email=bench%40example.com" 127.0.0.1 /submit
+        bench/httpbench -j -S "$HTTPD" $keep -c 50 -n "$REQUESTS" -H "Accept-Encoding: gzip" 127.0.0.1 /page.html
+        bench/httpbench -j -S "$HTTPD" $keep -c 50 -n "$REQUESTS" -H "Range: bytes=524288-589823" 127.0.0.1 /large.bin
+        # A megabyte per request; fewer of them
+        bench/httpbench -j -S "$HTTPD" $keep -c 16 -n $((REQUESTS / 50)) 127.0.0.1 /large.bin
+    done
+    for rate in 5000 20000; do
+        bench/httpbench -j -S "$HTTPD" -k -c 50 -n $((rate * 2)) -r "$rate" 127.0.0.1 /
+    done
+
+    for window in 1 8; do
+        bench/tftpbench -j -S "$TFTPD" -c 8 -n 4 -w "$window" -p "$PORT" payload
+        bench/tftpbench -j -S "$TFTPD" -c 8 -n 4 -w "$window" -W 1000000 -p "$PORT" upload
+    done
+    bench/tftpbench -j -S "$TFTPD" -c 8 -n 4 -w 8 -b 1428 -p "$PORT" payload
+    bench/tftpbench -j -S "$TFTPD" -c 8 -n 4 -w 8 -b 1428 -W 1000000 -p "$PORT" upload
+    for loss in 1 5; do
+        bench/tftpbench -j -S "$TFTPD" -c 4 -n 2 -w 8 -d 1 -l "$loss" -p "$PORT" payload
+        bench/tftpbench -j -S "$TFTPD" -c 4 -n 2 -w 8 -d 1 -l "$loss" -W 1000000 -p "$PORT" upload
+    done
+}
+
+for backend in epoll io_uring; do
+    OPTIONS=
+    if [ "$backend" = io_uring ]; then
+        OPTIONS=--io-uring
+    fi
+    (cd "$DIR/www" && exec "$ROOT/httpd2" --access-log off $OPTIONS) > /dev/null &
+    HTTPD=$!
+    ./tftpd --access-log off $OPTIONS "$PORT" "$DIR/tftp" > /dev/null &
+    TFTPD=$!
+    sleep 0.3
+
+    run_cases | sed "s/^{/{\"backend\":\"$backend\",/"
+
+    kill $HTTPD $TFTPD
+    wait $HTTPD $TFTPD 2>/dev/null
+    HTTPD=
+    TFTPD=
+done
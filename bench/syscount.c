@@ -0,0 +1,100 @@
+#define _GNU_SOURCE     /* syscall() */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "syscount.h"
+
+static const char *tracepoint_paths[] = {
+    "/sys/kernel/tracing/events/raw_syscalls/sys_enter/id",
+    "/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id",
+};
+
+/* The tracepoint's id, which perf takes as the counter's config; -1 if tracefs isn't there */
+long tracepoint_id() {
+    unsigned i;
+
+    for (i = 0; i < sizeof(tracepoint_paths) / sizeof(tracepoint_paths[0]); i++) {
+        FILE *f = fopen(tracepoint_paths[i], "r");
+        long id;
+
+        if (f == NULL) {
+            continue;
+        }
+        if (fscanf(f, "%ld", &id) != 1) {
+            id = -1;
+        }
+        fclose(f);
+        return id;
+    }
+    return -1;
+}
+
+/* Start counting pid's system calls; prints why and returns -1 if it can't */
+int syscount_open(struct syscount *sc, pid_t pid) {
+    struct perf_event_attr attr;
+    char path[64];
+    struct dirent *entry;
+    DIR *tasks;
+    long id = tracepoint_id();
+
+    sc->count = 0;
+    if (id == -1) {
+        fprintf(stderr, "No raw_syscalls:sys_enter tracepoint; is tracefs mounted?\n");
+        return -1;
+    }
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_TRACEPOINT;
+    attr.size = sizeof(attr);
+    attr.config = id;
+
+    snprintf(path, sizeof(path), "/proc/%d/task", (int)pid);
+    tasks = opendir(path);
+    if (tasks == NULL) {
+        perror("opendir failed");
+        return -1;
+    }
+    while ((entry = readdir(tasks)) != NULL && sc->count < SYSCOUNT_MAX_THREADS) {
+        int fd;
+
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        fd = (int)syscall(__NR_perf_event_open, &attr, atoi(entry->d_name), -1, -1, 0);
+        if (fd == -1) {
+            perror("perf_event_open failed");
+            closedir(tasks);
+            syscount_close(sc);
+            return -1;
+        }
+        sc->fds[sc->count++] = fd;
+    }
+    closedir(tasks);
+    return 0;
+}
+
+/* System calls made by all the counted threads so far */
+unsigned long syscount_read(const struct syscount *sc) {
+    unsigned long total = 0;
+    int i;
+
+    for (i = 0; i < sc->count; i++) {
+        uint64_t value;
+
+        if (read(sc->fds[i], &value, sizeof(value)) == sizeof(value)) {
+            total += value;
+        }
+    }
+    return total;
+}
+
+void syscount_close(struct syscount *sc) {
+    while (sc->count > 0) {
+        close(sc->fds[--sc->count]);
+    }
+}
@@ -0,0 +1,23 @@
+#ifndef SYSCOUNT_H
+#define SYSCOUNT_H
+
+/*
+ * Counts the system calls another process makes, through the kernel's
+ * raw_syscalls:sys_enter tracepoint: one perf counter per thread the
+ * process has when counting starts. Needs tracefs (or debugfs) mounted and
+ * perf_event_paranoid low enough, or root; Linux only.
+ */
+#include <sys/types.h>
+
+#define SYSCOUNT_MAX_THREADS 64
+
+struct syscount {
+    int fds[SYSCOUNT_MAX_THREADS];
+    int count;
+};
+
+int syscount_open(struct syscount *sc, pid_t pid);
+unsigned long syscount_read(const struct syscount *sc);
+void syscount_close(struct syscount *sc);
+
+#endif
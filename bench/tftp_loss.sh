@@ -0,0 +1,26 @@
+#!/bin/sh
+# Goodput of tftpd under injected packet loss.
+#
+# Starts tftpd on a spare port with a scratch directory, then downloads the
+# same file lock-step and with an 8 block window at 0%, 1%, 5% and 10% loss.
+# Loss is applied by the client to DATA arriving and ACKs leaving, so every
+# lost packet has to be recovered by the server's retransmission timer.
+#
+# Usage: bench/tftp_loss.sh [file size in bytes] [port]
+
+SIZE=${1:-1000000}
+PORT=${2:-16969}
+DIR=$(mktemp -d)
+
+trap 'kill $SERVER 2>/dev/null; rm -rf "$DIR"' EXIT INT TERM
+
+head -c "$SIZE" /dev/urandom > "$DIR/payload"
+./tftpd "$PORT" "$DIR" > /dev/null &
+SERVER=$!
+sleep 0.2
+
+for loss in 0 1 5 10; do
+    for window in 1 8; do
+        bench/tftpbench -w "$window" -l "$loss" -p "$PORT" payload || echo "loss $loss%, windowsize $window: failed"
+    done
+done
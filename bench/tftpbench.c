@@ -0,0 +1,541 @@
+/* Loopback TFTP benchmark for tftpd.
+ *
+ * Fetches one file with an RRQ, optionally asking for an RFC 7440 window,
+ * and reports goodput. Loopback has next to no round-trip time, so -d holds
+ * back every ACK for the given number of milliseconds to stand in for a real
+ * link; with lock-step transfers that delay is paid once per block, with a
+ * window of N it is paid once per N blocks. -b asks for RFC 2348 blocks
+ * larger than 512 bytes, which cuts the packet and syscall count instead.
+ * -W uploads that many generated bytes with a WRQ instead, sending a window
+ * of blocks per ACK, and -d then holds back every window. -c runs that many
+ * clients at once, one process each, to show whether the server serves
+ * clients side by side or one after another, and -n has each client make
+ * that many transfers back to back. -l drops that percentage of packets in
+ * both directions to exercise the server's retransmission. -S counts the
+ * system calls the server process with that pid makes during the run.
+ *
+ * One line sums up the run: transfers, failures, goodput, the p50, p99 and
+ * p99.9 transfer times and, with -S, the server's system calls per DATA
+ * block; -j prints it as a JSON object instead.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "../metrics.h"
+#include "syscount.h"
+
+#define TFTP_DATA_SIZE 512
+#define TFTP_OPCODE_RRQ 1
+#define TFTP_OPCODE_WRQ 2
+#define TFTP_OPCODE_DATA 3
+#define TFTP_OPCODE_ACK 4
+#define TFTP_OPCODE_ERROR 5
+#define TFTP_OPCODE_OACK 6
+#define TFTP_MAX_BLKSIZE 65464
+#define PACKET_SIZE (4 + TFTP_MAX_BLKSIZE)
+
+/* How long to wait for the next packet before re-acknowledging or resending */
+#define RETRY_MS 1000
+#define MAX_RETRIES 5
+
+/* What one transfer came to; clients pass these up a pipe to the parent */
+struct result {
+    int ok;
+    int blksize;                /* As accepted by the server */
+    int windowsize;
+    unsigned long bytes;
+    double seconds;
+};
+
+static int sock;
+static struct sockaddr_in server_base;  /* Where requests go */
+static struct sockaddr_in server_addr;  /* Where the current transfer's packets go */
+static int delay_ms = 0;
+static double loss_percent = 0;
+static int windowsize = 0;
+static int blksize = 0;
+static long upload_size = -1;           /* Bytes to upload with a WRQ; -1 to download */
+
+/* Loss injection: true for the share of packets that should vanish */
+int lost() {
+    return loss_percent > 0 && rand() < loss_percent / 100 * RAND_MAX;
+}
+
+double now_seconds() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+void send_packet(const unsigned char *packet, size_t length) {
+    if (lost()) {
+        return;
+    }
+    sendto(sock, packet, length, 0, (struct sockaddr *)&server_addr, sizeof(server_addr));
+}
+
+void send_ack(unsigned block) {
+    unsigned char ack[4];
+
+    if (delay_ms) {
+        usleep(delay_ms * 1000);
+    }
+    ack[0] = 0;
+    ack[1] = TFTP_OPCODE_ACK;
+    ack[2] = (block >> 8) & 0xFF;
+    ack[3] = block & 0xFF;
+    send_packet(ack, sizeof(ack));
+}
+
+/* opcode, filename, mode, then whichever options were asked for */
+size_t build_request(unsigned char *packet, int opcode, const char *filename) {
+    size_t length = 2;
+
+    packet[0] = 0;
+    packet[1] = opcode;
+    length += sprintf((char *)packet + length, "%s", filename) + 1;
+    length += sprintf((char *)packet + length, "octet") + 1;
+    if (blksize) {
+        length += sprintf((char *)packet + length, "blksize") + 1;
+        length += sprintf((char *)packet + length, "%d", blksize) + 1;
+    }
+    if (windowsize) {
+        length += sprintf((char *)packet + length, "windowsize") + 1;
+        length += sprintf((char *)packet + length, "%d", windowsize) + 1;
+    }
+    if (opcode == TFTP_OPCODE_WRQ) {
+        length += sprintf((char *)packet + length, "tsize") + 1;
+        length += sprintf((char *)packet + length, "%ld", upload_size) + 1;
+    }
+    return length;
+}
+
+/*
+ * Wait for the next packet that survives loss injection; 0 on timeout. The
+ * first one fixes the port the server answers from for the rest of the
+ * transfer.
+ */
+ssize_t receive_packet(unsigned char *packet, int *peer_known) {
+    while (1) {
+        struct pollfd pfd;
+        struct sockaddr_in from;
+        socklen_t from_len = sizeof(from);
+        ssize_t n;
+        int ready;
+
+        pfd.fd = sock;
+        pfd.events = POLLIN;
+        ready = poll(&pfd, 1, RETRY_MS);
+        if (ready == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll failed");
+            exit(EXIT_FAILURE);
+        }
+        if (ready == 0) {
+            return 0;
+        }
+
+        n = recvfrom(sock, packet, PACKET_SIZE, 0, (struct sockaddr *)&from, &from_len);
+        if (n < 4 || lost()) {
+            continue;
+        }
+        if (!*peer_known) {
+            server_addr = from;
+            *peer_known = 1;
+        }
+        return n;
+    }
+}
+
+int server_error(const unsigned char *packet, ssize_t n) {
+    fprintf(stderr, "Server error %d: %.*s\n", (packet[2] << 8) | packet[3], (int)(n - 4), packet + 4);
+    return -1;
+}
+
+/* Take the options the server accepted from an OACK */
+void parse_oack(const unsigned char *packet, ssize_t n, struct result *result) {
+    const char *field = (const char *)packet + 2;
+
+    while (field < (const char *)packet + n) {
+        const char *value = field + strlen(field) + 1;
+        if (strcmp(field, "windowsize") == 0) {
+            result->windowsize = atoi(value);
+        } else if (strcmp(field, "blksize") == 0) {
+            result->blksize = atoi(value);
+        }
+        field = value + strlen(value) + 1;
+    }
+}
+
+int download(const char *filename, struct result *result) {
+    static unsigned char packet[PACKET_SIZE];
+    size_t request_len = build_request(packet, TFTP_OPCODE_RRQ, filename);
+    unsigned block = 0;         /* Last in-order block, 16 bits like the wire */
+    int in_window = 0;          /* Blocks taken since the last ACK */
+    int retries = 0;
+    int peer_known = 0;
+
+    if (sendto(sock, packet, request_len, 0, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1) {
+        perror("sendto failed");
+        return -1;
+    }
+
+    while (1) {
+        ssize_t n = receive_packet(packet, &peer_known);
+        int opcode;
+
+        if (n == 0) {
+            if (++retries > MAX_RETRIES) {
+                fprintf(stderr, "Timed out after %lu bytes\n", result->bytes);
+                return -1;
+            }
+            if (!peer_known) {
+                /* The request or the first answer was lost; ask again */
+                request_len = build_request(packet, TFTP_OPCODE_RRQ, filename);
+                sendto(sock, packet, request_len, 0, (struct sockaddr *)&server_addr, sizeof(server_addr));
+                continue;
+            }
+            /* Tell the server where the stream broke off so it resends from there */
+            send_ack(block);
+            in_window = 0;
+            continue;
+        }
+        retries = 0;
+
+        opcode = (packet[0] << 8) | packet[1];
+        if (opcode == TFTP_OPCODE_ERROR) {
+            return server_error(packet, n);
+        }
+        if (opcode == TFTP_OPCODE_OACK) {
+            parse_oack(packet, n, result);
+            send_ack(0);
+            continue;
+        }
+        if (opcode != TFTP_OPCODE_DATA) {
+            continue;
+        }
+
+        if (((packet[2] << 8) | packet[3]) != ((block + 1) & 0xFFFF)) {
+            /*
+             * A gap, or a block we already have because our ACK was lost:
+             * acknowledge what arrived in order so the server rewinds. The
+             * server ignores the repeats, so answering each one is safe.
+             */
+            send_ack(block);
+            in_window = 0;
+            continue;
+        }
+
+        block = (block + 1) & 0xFFFF;
+        result->bytes += n - 4;
+        if (++in_window == result->windowsize || n < 4 + result->blksize) {
+            send_ack(block);
+            in_window = 0;
+        }
+        if (n < 4 + result->blksize) {
+            return 0;
+        }
+    }
+}
+
+/* Send blocks first..last of the upload; the payload is a repeating pattern */
+void send_blocks(unsigned long first, unsigned long last, const struct result *result) {
+    static unsigned char packet[PACKET_SIZE];
+    unsigned long total = upload_size / result->blksize + 1;
+    unsigned long block;
+    size_t i;
+
+    if (delay_ms) {
+        usleep(delay_ms * 1000);
+    }
+    for (i = 0; i < (size_t)result->blksize; i++) {
+        packet[4 + i] = (unsigned char)(i * 31);
+    }
+    packet[0] = 0;
+    packet[1] = TFTP_OPCODE_DATA;
+    for (block = first; block <= last; block++) {
+        size_t length = block < total ? (size_t)result->blksize : upload_size - (total - 1) * result->blksize;
+
+        packet[2] = (block >> 8) & 0xFF;
+        packet[3] = block & 0xFF;
+        send_packet(packet, 4 + length);
+    }
+}
+
+/*
+ * Upload with a WRQ, a window of blocks at a time. Each ACK moves the start
+ * of the window up to the block it names and sends the next window from
+ * there, so an ACK for the middle of a window (the server saw a gap) resends
+ * from the gap, and a timeout resends the whole window.
+ */
+int upload(const char *filename, struct result *result) {
+    static unsigned char packet[PACKET_SIZE];
+    size_t request_len = build_request(packet, TFTP_OPCODE_WRQ, filename);
+    unsigned long total = 0;    /* Blocks in the upload, once the block size is settled */
+    unsigned long acked = 0;    /* Blocks the server has acknowledged */
+    unsigned long sent = 0;     /* Highest block sent so far */
+    int retries = 0;
+    int peer_known = 0;
+
+    if (sendto(sock, packet, request_len, 0, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1) {
+        perror("sendto failed");
+        return -1;
+    }
+
+    while (1) {
+        ssize_t n = receive_packet(packet, &peer_known);
+        unsigned long block;
+        int opcode;
+
+        if (n == 0) {
+            if (++retries > MAX_RETRIES) {
+                fprintf(stderr, "Timed out after %lu blocks\n", acked);
+                return -1;
+            }
+            if (total == 0) {
+                request_len = build_request(packet, TFTP_OPCODE_WRQ, filename);
+                sendto(sock, packet, request_len, 0, (struct sockaddr *)&server_addr, sizeof(server_addr));
+            } else {
+                send_blocks(acked + 1, sent, result);
+            }
+            continue;
+        }
+
+        opcode = (packet[0] << 8) | packet[1];
+        if (opcode == TFTP_OPCODE_ERROR) {
+            return server_error(packet, n);
+        }
+        if (opcode == TFTP_OPCODE_OACK) {
+            if (total == 0) {
+                parse_oack(packet, n, result);
+            }
+            block = 0;
+        } else if (opcode == TFTP_OPCODE_ACK) {
+            /* Widen the 16-bit block number; anything beyond what was sent is stale */
+            block = acked + ((((packet[2] << 8) | packet[3]) - acked) & 0xFFFF);
+            if (block > sent) {
+                continue;
+            }
+        } else {
+            continue;
+        }
+        retries = 0;
+
+        if (total == 0) {
+            total = upload_size / result->blksize + 1;
+        }
+        acked = block;
+        if (acked == total) {
+            result->bytes = upload_size;
+            return 0;
+        }
+        sent = acked + result->windowsize < total ? acked + result->windowsize : total;
+        send_blocks(acked + 1, sent, result);
+    }
+}
+
+/* One client's share of the run, each transfer's result written to report */
+void run_client(int client, int clients, int transfers, const char *filename, int report) {
+    int rcvbuf = 4 * 1024 * 1024;
+    char name[512];
+    int i;
+
+    srand(getpid());
+
+    /* Clients uploading side by side each get a file of their own */
+    if (upload_size >= 0 && clients > 1) {
+        snprintf(name, sizeof(name), "%s.%d", filename, client);
+    } else {
+        snprintf(name, sizeof(name), "%s", filename);
+    }
+
+    for (i = 0; i < transfers; i++) {
+        struct result result;
+        double start = now_seconds();
+
+        /*
+         * A fresh port (TID) per transfer, as RFC 1350 has it; the server
+         * would take a new request from the port of a transfer it is still
+         * dallying on for a repeat of the old one.
+         */
+        sock = socket(AF_INET, SOCK_DGRAM, 0);
+        if (sock == -1) {
+            perror("socket failed");
+            exit(EXIT_FAILURE);
+        }
+        /* A whole window of large blocks has to fit in the receive queue or it is dropped */
+        setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+        memset(&result, 0, sizeof(result));
+        result.blksize = TFTP_DATA_SIZE;
+        result.windowsize = 1;
+        server_addr = server_base;
+        result.ok = (upload_size >= 0 ? upload(name, &result) : download(name, &result)) == 0;
+        result.seconds = now_seconds() - start;
+        close(sock);
+        if (write(report, &result, sizeof(result)) != sizeof(result)) {
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [-w windowsize] [-b blksize] [-d delay ms] [-l loss %%] [-c clients] [-n transfers per client] "
+            "[-W upload bytes] [-j] [-S server pid] [-p port] [host] file\n", program);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    static struct histogram durations;      /* Microseconds */
+    const char *host = "127.0.0.1";
+    const char *filename;
+    struct result result;
+    int port = 69;
+    int clients = 1;
+    int transfers = 1;
+    int json = 0;
+    int completed = 0, failed;
+    unsigned long bytes = 0;
+    unsigned long blocks = 0;           /* DATA packets in the completed transfers */
+    pid_t server_pid = 0;
+    struct syscount syscalls;
+    unsigned long syscalls_before = 0, syscalls_used = 0;
+    int accepted_blksize = 0, accepted_window = 0;
+    int report[2];
+    double start, elapsed;
+    int i, opt, status;
+
+    while ((opt = getopt(argc, argv, "w:b:d:c:n:l:W:jS:p:")) != -1) {
+        switch (opt) {
+        case 'w':
+            windowsize = atoi(optarg);
+            break;
+        case 'b':
+            blksize = atoi(optarg);
+            break;
+        case 'd':
+            delay_ms = atoi(optarg);
+            break;
+        case 'l':
+            loss_percent = atof(optarg);
+            break;
+        case 'c':
+            clients = atoi(optarg);
+            break;
+        case 'n':
+            transfers = atoi(optarg);
+            break;
+        case 'W':
+            upload_size = atol(optarg);
+            break;
+        case 'j':
+            json = 1;
+            break;
+        case 'S':
+            server_pid = atoi(optarg);
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (argc - optind == 2) {
+        host = argv[optind++];
+    }
+    if (argc - optind != 1 || clients < 1 || transfers < 1) {
+        usage(argv[0]);
+    }
+    filename = argv[optind];
+
+    memset(&server_base, 0, sizeof(server_base));
+    server_base.sin_family = AF_INET;
+    server_base.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &server_base.sin_addr) != 1) {
+        fprintf(stderr, "Invalid address: %s\n", host);
+        exit(EXIT_FAILURE);
+    }
+
+    /* Each client is a child process reporting back over a pipe; the parent only adds up */
+    if (pipe(report) == -1) {
+        perror("pipe failed");
+        exit(EXIT_FAILURE);
+    }
+    if (server_pid) {
+        if (syscount_open(&syscalls, server_pid) == -1) {
+            exit(EXIT_FAILURE);
+        }
+        syscalls_before = syscount_read(&syscalls);
+    }
+    start = now_seconds();
+    for (i = 0; i < clients; i++) {
+        pid_t pid = fork();
+        if (pid == -1) {
+            perror("fork failed");
+            exit(EXIT_FAILURE);
+        }
+        if (pid == 0) {
+            close(report[0]);
+            run_client(i, clients, transfers, filename, report[1]);
+            exit(EXIT_SUCCESS);
+        }
+    }
+    close(report[1]);
+
+    while (read(report[0], &result, sizeof(result)) == sizeof(result)) {
+        if (!result.ok) {
+            continue;
+        }
+        completed++;
+        bytes += result.bytes;
+        blocks += result.bytes / result.blksize + 1;
+        accepted_blksize = result.blksize;
+        accepted_window = result.windowsize;
+        histogram_record(&durations, (unsigned long)(result.seconds * 1e6));
+    }
+    while (wait(&status) > 0) {
+    }
+    elapsed = now_seconds() - start;
+    if (server_pid) {
+        syscalls_used = syscount_read(&syscalls) - syscalls_before;
+        syscount_close(&syscalls);
+    }
+    /* Transfers a client never got to report are failures too */
+    failed = clients * transfers - completed;
+
+    if (json) {
+        printf("{\"bench\":\"tftp\",\"op\":\"%s\",\"file\":\"%s\",\"blksize\":%d,\"windowsize\":%d,\"delay_ms\":%d,"
+               "\"loss_percent\":%.1f,\"clients\":%d,\"transfers\":%d,\"failed\":%d,\"bytes\":%lu,\"seconds\":%.3f,"
+               "\"kb_per_sec\":%.1f,\"p50_us\":%lu,\"p99_us\":%lu,\"p999_us\":%lu",
+               upload_size >= 0 ? "WRQ" : "RRQ", filename, accepted_blksize, accepted_window, delay_ms,
+               loss_percent, clients, completed, failed, bytes, elapsed, bytes / elapsed / 1024,
+               histogram_quantile(&durations, 0.5), histogram_quantile(&durations, 0.99), histogram_quantile(&durations, 0.999));
+        if (server_pid) {
+            printf(",\"server_syscalls_per_block\":%.3f", blocks ? (double)syscalls_used / blocks : 0.0);
+        }
+        printf("}\n");
+    } else {
+        printf("%s blksize %d, windowsize %d, delay %d ms, loss %.1f%%, %d clients: %d transfers, %d failed, %lu bytes, "
+               "%.3f s, %.1f KB/s, p50 %.3f ms, p99 %.3f ms, p99.9 %.3f ms",
+               upload_size >= 0 ? "WRQ" : "RRQ", accepted_blksize, accepted_window, delay_ms, loss_percent, clients,
+               completed, failed, bytes, elapsed, bytes / elapsed / 1024,
+               histogram_quantile(&durations, 0.5) / 1e3, histogram_quantile(&durations, 0.99) / 1e3,
+               histogram_quantile(&durations, 0.999) / 1e3);
+        if (server_pid) {
+            printf(", %.3f server syscalls/block", blocks ? (double)syscalls_used / blocks : 0.0);
+        }
+        printf("\n");
+    }
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
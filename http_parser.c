@@ -0,0 +1,430 @@
+#include <string.h>
+#include <strings.h>
+
+#include "http_parser.h"
+
+/* Parser states, in the order a request moves through them */
+#define PARSE_REQUEST_LINE 0
+#define PARSE_HEADERS 1
+#define PARSE_BODY 2
+#define PARSE_CHUNK_SIZE 3
+#define PARSE_CHUNK_DATA 4
+#define PARSE_CHUNK_END 5
+#define PARSE_TRAILERS 6
+#define PARSE_DONE 7
+
+/* Longest chunk-size line we are prepared to wait for */
+#define MAX_CHUNK_LINE 64
+
+void http_request_init(struct http_request *req, size_t max_header_size, size_t max_body_size) {
+    memset(req, 0, sizeof(*req));
+    req->state = PARSE_REQUEST_LINE;
+    req->max_header_size = max_header_size;
+    req->max_body_size = max_body_size;
+}
+
+static int is_token_char(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+           (c != '\0' && strchr("!#$%&'*+-.^_`|~", c) != NULL);
+}
+
+/* Length of a line starting at pos without its "\r\n" or "\n", or -1 if the line isn't complete yet */
+static long line_length(const char *buffer, size_t pos, size_t length, size_t *next) {
+    const char *eol = memchr(buffer + pos, '\n', length - pos);
+    size_t line_len;
+
+    if (eol == NULL) {
+        return -1;
+    }
+    *next = eol + 1 - buffer;
+    line_len = eol - (buffer + pos);
+    if (line_len > 0 && eol[-1] == '\r') {
+        line_len--;
+    }
+    return (long)line_len;
+}
+
+static int parse_error(struct http_request *req, int status) {
+    req->status = status;
+    return HTTP_PARSE_ERROR;
+}
+
+/* METHOD SP request-target SP HTTP/1.x */
+static int parse_request_line(struct http_request *req, const char *buffer, size_t start, size_t line_len) {
+    size_t pos = start;
+    size_t end = start + line_len;
+    size_t i;
+
+    while (pos < end && is_token_char(buffer[pos])) {
+        pos++;
+    }
+    if (pos == start || pos - start > HTTP_MAX_METHOD || pos == end || buffer[pos] != ' ') {
+        return parse_error(req, 400);
+    }
+    req->method.offset = start;
+    req->method.length = pos - start;
+
+    req->target.offset = ++pos;
+    while (pos < end && buffer[pos] != ' ') {
+        if ((unsigned char)buffer[pos] <= ' ' || buffer[pos] == 0x7f) {
+            return parse_error(req, 400);
+        }
+        pos++;
+    }
+    req->target.length = pos - req->target.offset;
+    if (req->target.length == 0 || buffer[req->target.offset] != '/') {
+        return parse_error(req, 400);
+    }
+
+    if (end - pos != 9 || strncmp(buffer + pos, " HTTP/1.", 8) != 0 ||
+        buffer[pos + 8] < '0' || buffer[pos + 8] > '9') {
+        return parse_error(req, 400);
+    }
+    req->minor_version = buffer[pos + 8] - '0';
+
+    /* Split off the query string */
+    req->path = req->target;
+    req->query.offset = req->target.offset + req->target.length;
+    req->query.length = 0;
+    for (i = req->target.offset; i < req->target.offset + req->target.length; i++) {
+        if (buffer[i] == '?') {
+            req->path.length = i - req->target.offset;
+            req->query.offset = i + 1;
+            req->query.length = req->target.offset + req->target.length - (i + 1);
+            break;
+        }
+    }
+
+    /* Files are served relative to the working directory, so never let a path climb out of it */
+    end = req->path.offset + req->path.length;
+    for (i = req->path.offset; i < end; i++) {
+        if (buffer[i] == '/' && i + 2 < end && buffer[i + 1] == '.' && buffer[i + 2] == '.' &&
+            (i + 3 == end || buffer[i + 3] == '/')) {
+            return parse_error(req, 400);
+        }
+    }
+
+    return HTTP_PARSE_COMPLETE;
+}
+
+/* name ":" OWS value OWS */
+static int parse_header_line(struct http_request *req, const char *buffer, size_t start, size_t line_len) {
+    struct http_header *header;
+    size_t pos = start;
+    size_t end = start + line_len;
+
+    if (req->header_count == HTTP_MAX_HEADERS) {
+        return parse_error(req, 431);
+    }
+    header = &req->headers[req->header_count];
+
+    /* Obsolete line folding (a line starting with whitespace) is rejected along with other junk */
+    while (pos < end && is_token_char(buffer[pos])) {
+        pos++;
+    }
+    if (pos == start || pos == end || buffer[pos] != ':') {
+        return parse_error(req, 400);
+    }
+    header->name.offset = start;
+    header->name.length = pos - start;
+
+    pos++;
+    while (pos < end && (buffer[pos] == ' ' || buffer[pos] == '\t')) {
+        pos++;
+    }
+    while (end > pos && (buffer[end - 1] == ' ' || buffer[end - 1] == '\t')) {
+        end--;
+    }
+    header->value.offset = pos;
+    header->value.length = end - pos;
+
+    req->header_count++;
+    return HTTP_PARSE_COMPLETE;
+}
+
+static int slice_equals(const char *buffer, struct http_slice slice, const char *str) {
+    return slice.length == strlen(str) && strncasecmp(buffer + slice.offset, str, slice.length) == 0;
+}
+
+/* Work out how the body is framed once all headers are in */
+static int parse_framing(struct http_request *req, const char *buffer) {
+    int i;
+    int have_length = 0;
+
+    for (i = 0; i < req->header_count; i++) {
+        struct http_header *header = &req->headers[i];
+
+        if (slice_equals(buffer, header->name, "Transfer-Encoding")) {
+            if (!slice_equals(buffer, header->value, "chunked")) {
+                return parse_error(req, 501);
+            }
+            req->chunked = 1;
+        } else if (slice_equals(buffer, header->name, "Content-Length")) {
+            size_t value = 0;
+            unsigned j;
+
+            if (header->value.length == 0) {
+                return parse_error(req, 400);
+            }
+            for (j = 0; j < header->value.length; j++) {
+                char c = buffer[header->value.offset + j];
+                if (c < '0' || c > '9') {
+                    return parse_error(req, 400);
+                }
+                if (value > (req->max_body_size + 9) / 10) {
+                    return parse_error(req, 413);
+                }
+                value = value * 10 + (c - '0');
+            }
+            if (have_length && value != req->content_length) {
+                return parse_error(req, 400);
+            }
+            have_length = 1;
+            req->content_length = value;
+        }
+    }
+
+    /* A length next to chunked framing is a smuggling attempt or a broken proxy */
+    if (req->chunked && have_length) {
+        return parse_error(req, 400);
+    }
+    if (req->content_length > req->max_body_size) {
+        return parse_error(req, 413);
+    }
+    return HTTP_PARSE_COMPLETE;
+}
+
+/* Value of a hex digit, or -1 */
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    } else if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    } else if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+static int parse_chunk_size(struct http_request *req, const char *buffer, size_t start, size_t line_len) {
+    size_t size = 0;
+    size_t pos = start;
+    size_t end = start + line_len;
+
+    if (pos == end) {
+        return parse_error(req, 400);
+    }
+    while (pos < end && buffer[pos] != ';' && buffer[pos] != ' ' && buffer[pos] != '\t') {
+        int digit = hex_value(buffer[pos]);
+
+        if (digit == -1) {
+            return parse_error(req, 400);
+        }
+        if (size > req->max_body_size) {
+            return parse_error(req, 413);
+        }
+        size = size * 16 + digit;
+        pos++;
+    }
+    if (pos == start) {
+        return parse_error(req, 400);
+    }
+    /* Chunk extensions after ';' are ignored */
+    if (req->body_len + size > req->max_body_size) {
+        return parse_error(req, 413);
+    }
+    req->chunk_remaining = size;
+    return HTTP_PARSE_COMPLETE;
+}
+
+/*
+ * Advance the parser over buffer[0..length). Call again with the same buffer,
+ * grown, after more bytes arrive; work already done is not repeated. Nothing
+ * is copied out: the request fields are slices of the buffer, and chunked
+ * bodies are joined up in place behind the chunk headers they replace.
+ */
+int http_parse(struct http_request *req, char *buffer, size_t length) {
+    while (1) {
+        size_t next;
+        long line_len;
+
+        switch (req->state) {
+        case PARSE_REQUEST_LINE:
+        case PARSE_HEADERS:
+            line_len = line_length(buffer, req->pos, length, &next);
+            if (line_len == -1) {
+                if (length > req->max_header_size) {
+                    return parse_error(req, req->state == PARSE_REQUEST_LINE ? 414 : 431);
+                }
+                return HTTP_PARSE_INCOMPLETE;
+            }
+            if (next > req->max_header_size) {
+                return parse_error(req, req->state == PARSE_REQUEST_LINE ? 414 : 431);
+            }
+
+            if (req->state == PARSE_REQUEST_LINE) {
+                /* Tolerate blank lines before a request, as RFC 7230 section 3.5 suggests */
+                if (line_len == 0) {
+                    req->pos = next;
+                    continue;
+                }
+                if (parse_request_line(req, buffer, req->pos, line_len) == HTTP_PARSE_ERROR) {
+                    return HTTP_PARSE_ERROR;
+                }
+                req->state = PARSE_HEADERS;
+            } else if (line_len == 0) {
+                req->header_len = next;
+                req->body_start = next;
+                if (parse_framing(req, buffer) == HTTP_PARSE_ERROR) {
+                    return HTTP_PARSE_ERROR;
+                }
+                req->state = req->chunked ? PARSE_CHUNK_SIZE : PARSE_BODY;
+            } else if (parse_header_line(req, buffer, req->pos, line_len) == HTTP_PARSE_ERROR) {
+                return HTTP_PARSE_ERROR;
+            }
+            req->pos = next;
+            break;
+
+        case PARSE_BODY:
+            if (length < req->body_start + req->content_length) {
+                return HTTP_PARSE_INCOMPLETE;
+            }
+            req->body_len = req->content_length;
+            req->pos = req->body_start + req->content_length;
+            req->state = PARSE_DONE;
+            break;
+
+        case PARSE_CHUNK_SIZE:
+            line_len = line_length(buffer, req->pos, length, &next);
+            if (line_len == -1) {
+                return length - req->pos > MAX_CHUNK_LINE ? parse_error(req, 400) : HTTP_PARSE_INCOMPLETE;
+            }
+            if (parse_chunk_size(req, buffer, req->pos, line_len) == HTTP_PARSE_ERROR) {
+                return HTTP_PARSE_ERROR;
+            }
+            req->pos = next;
+            req->state = req->chunk_remaining ? PARSE_CHUNK_DATA : PARSE_TRAILERS;
+            break;
+
+        case PARSE_CHUNK_DATA: {
+            size_t available = length - req->pos;
+            if (available > req->chunk_remaining) {
+                available = req->chunk_remaining;
+            }
+            memmove(buffer + req->body_start + req->body_len, buffer + req->pos, available);
+            req->body_len += available;
+            req->pos += available;
+            req->chunk_remaining -= available;
+            if (req->chunk_remaining) {
+                return HTTP_PARSE_INCOMPLETE;
+            }
+            req->state = PARSE_CHUNK_END;
+            break;
+        }
+
+        case PARSE_CHUNK_END:
+            line_len = line_length(buffer, req->pos, length, &next);
+            if (line_len == -1) {
+                return length - req->pos > 1 ? parse_error(req, 400) : HTTP_PARSE_INCOMPLETE;
+            }
+            if (line_len != 0) {
+                return parse_error(req, 400);
+            }
+            req->pos = next;
+            req->state = PARSE_CHUNK_SIZE;
+            break;
+
+        case PARSE_TRAILERS:
+            /* Trailer fields are read and dropped */
+            line_len = line_length(buffer, req->pos, length, &next);
+            if (line_len == -1) {
+                return length - req->pos > req->max_header_size ? parse_error(req, 431) : HTTP_PARSE_INCOMPLETE;
+            }
+            req->pos = next;
+            if (line_len == 0) {
+                req->state = PARSE_DONE;
+            }
+            break;
+
+        case PARSE_DONE:
+        default:
+            req->consumed = req->pos;
+            return HTTP_PARSE_COMPLETE;
+        }
+    }
+}
+
+/* Value of the first header with this name, or NULL */
+const char *http_find_header(const struct http_request *req, const char *buffer, const char *name, size_t *value_len) {
+    int i;
+
+    for (i = 0; i < req->header_count; i++) {
+        if (slice_equals(buffer, req->headers[i].name, name)) {
+            *value_len = req->headers[i].value.length;
+            return buffer + req->headers[i].value.offset;
+        }
+    }
+    return NULL;
+}
+
+/* Undo form URL encoding in place: '+' is a space and %XX a byte; a '%' without two hex digits stays. Returns the new length */
+size_t http_url_decode(char *data, size_t length) {
+    size_t in = 0;
+    size_t out = 0;
+
+    while (in < length) {
+        char c = data[in++];
+
+        if (c == '+') {
+            c = ' ';
+        } else if (c == '%' && in + 1 < length && hex_value(data[in]) != -1 && hex_value(data[in + 1]) != -1) {
+            c = (char)(hex_value(data[in]) * 16 + hex_value(data[in + 1]));
+            in += 2;
+        }
+        data[out++] = c;
+    }
+    return out;
+}
+
+/* Most pairs a query string or form body of length bytes can hold, to size the array for http_parse_params() */
+int http_count_params(const char *data, size_t length) {
+    const char *end = data + length;
+    int count = 1;
+
+    while ((data = memchr(data, '&', end - data)) != NULL) {
+        data++;
+        count++;
+    }
+    return count;
+}
+
+/*
+ * Split a query string or form body into name=value pairs and decode them
+ * where they lie. Names and values are left NUL-terminated as well, so
+ * data[length] must be writable. Empty pairs are skipped and a name without
+ * '=' gets an empty value. Returns how many pairs were stored.
+ */
+int http_parse_params(char *data, size_t length, struct http_param *params, int max_params) {
+    char *end = data + length;
+    int count = 0;
+
+    while (data < end && count < max_params) {
+        char *amp = memchr(data, '&', end - data);
+        char *pair_end = amp ? amp : end;
+        char *eq = memchr(data, '=', pair_end - data);
+        struct http_param *param = &params[count];
+
+        if (pair_end > data) {
+            param->name = data;
+            param->name_len = http_url_decode(data, (eq ? eq : pair_end) - data);
+            param->value = eq ? eq + 1 : pair_end;
+            param->value_len = eq ? http_url_decode(eq + 1, pair_end - eq - 1) : 0;
+            /* Decoding only shrinks, so the '=' and '&' (or data[length]) are still there to overwrite */
+            param->name[param->name_len] = '\0';
+            param->value[param->value_len] = '\0';
+            count++;
+        }
+        data = pair_end + 1;
+    }
+    return count;
+}
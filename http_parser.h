@@ -0,0 +1,66 @@
+#ifndef HTTP_PARSER_H
+#define HTTP_PARSER_H
+
+#include <stddef.h>
+
+#define HTTP_MAX_HEADERS 32
+#define HTTP_MAX_METHOD 15
+
+/* Return values of http_parse() */
+#define HTTP_PARSE_INCOMPLETE 0
+#define HTTP_PARSE_COMPLETE 1
+#define HTTP_PARSE_ERROR -1
+
+/* A run of bytes inside the request buffer */
+struct http_slice {
+    unsigned int offset;
+    unsigned int length;
+};
+
+struct http_header {
+    struct http_slice name;
+    struct http_slice value;
+};
+
+/* Parser state for one request; everything points back into the caller's buffer */
+struct http_request {
+    int state;
+    size_t pos;                     /* Next byte of the buffer to look at */
+    size_t max_header_size;         /* Request line plus headers */
+    size_t max_body_size;           /* Decoded body */
+
+    struct http_slice method;
+    struct http_slice target;       /* Path and query string as sent */
+    struct http_slice path;
+    struct http_slice query;        /* Empty when there is no '?' */
+    int minor_version;              /* HTTP/1.x */
+    struct http_header headers[HTTP_MAX_HEADERS];
+    int header_count;
+    size_t header_len;              /* Request line and headers, including the blank line */
+
+    int chunked;
+    size_t content_length;
+    size_t body_start;
+    size_t body_len;                /* Decoded bytes at body_start; chunked bodies are joined in place */
+    size_t chunk_remaining;
+    size_t consumed;                /* Bytes the request occupied on the wire, once complete */
+
+    int status;                     /* HTTP status to answer with after HTTP_PARSE_ERROR */
+};
+
+/* One name=value pair of a query string or form body, decoded in place in the request buffer */
+struct http_param {
+    char *name;
+    size_t name_len;
+    char *value;
+    size_t value_len;
+};
+
+void http_request_init(struct http_request *req, size_t max_header_size, size_t max_body_size);
+int http_parse(struct http_request *req, char *buffer, size_t length);
+const char *http_find_header(const struct http_request *req, const char *buffer, const char *name, size_t *value_len);
+size_t http_url_decode(char *data, size_t length);
+int http_count_params(const char *data, size_t length);
+int http_parse_params(char *data, size_t length, struct http_param *params, int max_params);
+
+#endif
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE     /* sched_setaffinity() and CPU_SET() */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,159 +7,2791 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <time.h>
+#include <sys/time.h>
 
 #include <sys/errno.h>
 #include <dirent.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <sys/socket.h>
+#include <signal.h>
+#include <strings.h>
+
+#include "arena.h"
+#include "http_parser.h"
+#include "log.h"
+#include "metrics.h"
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef HAVE_URING
+#include "uring.h"
+#include <netinet/tcp.h>
+#endif
+
+#if defined(__linux__) && !defined(NO_EPOLL)
+#define USE_EPOLL
+#include <sys/epoll.h>
+#else
+#include <poll.h>
+#endif
+
+#if defined(__linux__) && !defined(NO_SENDFILE)
+#define USE_SENDFILE
+#include <sys/sendfile.h>
+#endif
+
+#include <sys/wait.h>
+#ifdef __linux__
+#define USE_WRITEV
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/uio.h>
+#endif
 
 #define PORT 8080
 #define BUFFER_SIZE 1024
+#define REQUEST_BUFFER_SIZE (4 * BUFFER_SIZE)
+#define MAX_HEADER_SIZE (2 * BUFFER_SIZE)          /* Request line and headers */
+#define MAX_BODY_SIZE (2 * BUFFER_SIZE - 1)         /* Decoded request body; both fit in one buffer */
+#define MAX_CONNECTIONS 4096
+#define MAX_EVENTS 256
+#define MAX_WORKERS 256
+#define SNAPSHOT_SLOTS 4              /* Published time snapshots kept before a slot is reused */
+#define KEEPALIVE_TIMEOUT 5           /* Seconds a connection may sit without progress */
+#define KEEPALIVE_MAX_REQUESTS 100    /* Requests served before the connection is closed */
+#define FILE_CACHE_MAX_BYTES (8L * 1024 * 1024)     /* Total file bytes kept in memory */
+#define FILE_CACHE_MAX_FILE_SIZE (256L * 1024)      /* Larger files are always sent from disk */
+#define GZIP_MAX_FILE_SIZE (1024L * 1024)           /* Larger files are sent uncompressed */
+#define GZIP_MIN_FILE_SIZE 256                      /* Smaller ones don't gain enough to be worth it */
+#define FILE_CACHE_BUCKETS 256
+#define MAX_RANGES 16               /* More in one request and the whole file is sent instead */
+#define ROUTE_BUCKETS 64
+
+#ifdef HAVE_URING
+#define URING_ENTRIES 256                           /* Submission queue; the completion queue is four times it */
+#define URING_RECV_BUFFERS 512                      /* Provided buffers the multishot receives of every connection fill */
+#define URING_RECV_BUFFER_SIZE (2 * BUFFER_SIZE)
+#define URING_STREAM_BUFFERS 32                     /* Registered buffers large files are read into on their way out */
+#define URING_STREAM_BUFFER_SIZE (64 * 1024)
+#define URING_SPILL_MAX (4 * REQUEST_BUFFER_SIZE)   /* Received bytes held behind a full in[] before receiving pauses */
+
+/* What a completion is for, in the low bits of its user_data; the rest is the connection */
+#define URING_ACCEPT 0
+#define URING_REGISTER 1            /* Accepted socket going into the registered files */
+#define URING_RECV 2
+#define URING_SEND 3
+#define URING_READ 4                /* File chunk on its way to a linked send */
+#define URING_DONE 5                /* Nothing to do but count it */
+#define URING_SLOT 6                /* A registered file has closed; the rest is its index */
+#define URING_TAG_MASK 7
+#endif
+
+/* Representations of a file that the cache keeps apart */
+#define VARIANT_IDENTITY 0
+#define VARIANT_GZIP_FILE 1         /* A sibling .gz, sent as the gzip encoding of the file beside it */
+#define VARIANT_GZIP 2              /* Compressed here, or the file as it is where that didn't pay */
+
+/* A small file held in memory together with its response header */
+struct cache_entry {
+    char *path;
+    int variant;
+    char *body;
+    size_t size;
+    char header[320];               /* Content-Type through Last-Modified, built once */
+    size_t header_len;
+    const struct mime_type *type;
+    int encoded;                    /* Body is gzip; ranges aren't offered on it */
+    int vary;                       /* Other encodings of the same URL exist */
+    char etag[48];
+    char last_modified[32];
+    ino_t ino;                      /* What the file looked like when it was read */
+    off_t st_size;
+    time_t mtime;
+    time_t checked;                 /* Last time the file was stat()ed for changes */
+    int refs;                       /* One for the cache itself, one per connection sending it */
+    unsigned long hash;
+    struct cache_entry *hash_next;
+    struct cache_entry *lru_prev;   /* Towards the most recently used entry */
+    struct cache_entry *lru_next;
+};
+
+/* Bytes first to last of a representation, both included as in Content-Range */
+struct byte_range {
+    off_t first;
+    off_t last;
+};
+
+/* Per-connection state machine */
+enum connection_state {
+    CONN_READING_HEADERS,
+    CONN_READING_BODY,
+    CONN_WRITING,
+    CONN_CLOSING
+};
+
+struct connection {
+    int fd;
+    int state;
+    int slot;                       /* Index in connections[] */
+    int watched;                    /* Events currently registered with the poller */
+    char in[REQUEST_BUFFER_SIZE];   /* Request bytes received so far */
+    size_t in_len;
+    struct http_request request;    /* Parse state for the request at the front of in[] */
+    char out[2 * BUFFER_SIZE];      /* Response bytes waiting to be written */
+    size_t out_len;
+    size_t out_sent;
+    int file_fd;                    /* File still being streamed after out[], or -1 */
+    off_t file_offset;              /* Next file byte to send */
+    off_t file_remaining;           /* File bytes still owed to the client */
+    int use_sendfile;               /* Kernel can copy file_fd straight to the socket */
+    const char *body;               /* Bytes sent in place after out[]: a cached file or a static route */
+    struct cache_entry *cache_entry;  /* Holds body alive while it is a cached file */
+    struct arena arena;             /* Scratch memory for the current request, emptied when it is done */
+    const char *logged_query;       /* Query as received, kept for the access log when it has been decoded in place */
+    struct byte_range *ranges;      /* Asked for by a Range header, in request order; in the arena */
+    int range_count;                /* More than one makes the body multipart/byteranges */
+    int range_next;                 /* Next part to start; range_count for the closing delimiter */
+    const char *range_type;         /* Content-Type of each part */
+    off_t range_total;              /* Size of the whole representation */
+    char range_boundary[32];
+    unsigned long range_bytes;      /* What follows the first part: later parts and the closing delimiter */
+    int keep_alive;                 /* Whether to read another request after this response */
+    int eof;                        /* Peer has finished sending */
+    int requests_served;
+    time_t last_active;
+    char remote[INET_ADDRSTRLEN];   /* Client address, formatted once for the access log */
+    int remote_port;
+    unsigned long started_us;       /* When the first byte of the current request arrived */
+    int status;                     /* Status code of the response being written */
+    int route;                      /* Index in routes[] that produced it; ROUTE_COUNT for none */
+    unsigned long response_bytes;   /* Its size, header included */
+#ifdef HAVE_URING
+    int file_index;                 /* Socket's slot in the ring's registered files */
+    int uring_ops;                  /* Submissions not yet completed; the memory stays until they are */
+    int uring_sending;              /* A send, or a file read and its send, is in flight */
+    int closed;                     /* close_connection() has run and is waiting out uring_ops */
+    int recv_armed;                 /* The multishot receive hasn't posted its last completion */
+    int recv_paused;                /* Cancelled until the spill drains, leaving the rest in the socket */
+    int fin;                        /* End of file received, but perhaps behind requests not yet parsed */
+    char *spill;                    /* Bytes received after in[] filled up, oldest first */
+    size_t spill_len;
+    int stream_index;               /* Registered buffer the file is read into, or -1 to use out[] */
+    size_t stream_len;              /* Bytes of the last chunk read into it */
+    size_t stream_sent;
+    struct iovec iov[2];            /* Header and in-memory body for a vectored send */
+#endif
+};
+
+static struct connection *connections[MAX_CONNECTIONS];
+static int connection_count = 0;
+static time_t now;                  /* Refreshed once per event loop pass */
+
+static struct cache_entry *cache_buckets[FILE_CACHE_BUCKETS];
+static struct cache_entry *cache_lru_head = NULL;
+static struct cache_entry *cache_lru_tail = NULL;
+static long cache_bytes = 0;
+struct cache_counters {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long not_modified;
+    unsigned long invalidations;
+    unsigned long evictions;
+    unsigned long compressions;     /* Files gzip-compressed into the cache */
+};
+static struct cache_counters *cache_stats;      /* This worker's, in its metrics slot */
+static volatile sig_atomic_t cache_stats_requested = 0;
+
+/* Everything that only changes once a second, rendered once and shared by every response in that second */
+struct time_snapshot {
+    time_t second;
+    char date_header[48];           /* "Date: ...\r\n" */
+    size_t date_header_len;
+    char dynamic_head[256];         /* The /dynamic page up to its random number */
+    size_t dynamic_head_len;
+};
+
+static struct time_snapshot snapshots[SNAPSHOT_SLOTS];
+static struct time_snapshot *current_snapshot = NULL;
+static int next_snapshot_slot = 0;
+
+static const char dynamic_tail[] = "</p></body></html>";
+
+const char *find_header(const struct connection *conn, const char *name, size_t *value_len);
+#ifdef USE_EPOLL
+static int epoll_fd = -1;           /* Stays -1 while io_uring drives the sockets */
+#endif
+static int use_uring = 0;           /* --io-uring, until the kernel turns it down */
+
+/* Constant pages; init_routes() serializes their complete responses once at startup */
+static const char home_page[] =
+    "<html><body><h1>Home Page</h1>"
+    "<form action=\"/submit\" method=\"POST\">"
+    "Name: <input type=\"text\" name=\"name\"><br>"
+    "<input type=\"submit\" value=\"Submit\">"
+    "</form></body></html>";
+static const char about_page[] = "<html><body><h1>About Page</h1></body></html>";
+static const char contact_page[] = "<html><body><h1>Contact Page</h1></body></html>";
+
+/*
+ * Return the snapshot for the current second, rendering it on the first call
+ * in a new second. A snapshot is never modified once published; readers pick
+ * up a whole one through a single pointer load, and a slot is only reused
+ * SNAPSHOT_SLOTS seconds later.
+ */
+const struct time_snapshot *get_time_snapshot() {
+    struct time_snapshot *snapshot;
+    struct tm *t;
+
+#ifdef __GNUC__
+    snapshot = __atomic_load_n(&current_snapshot, __ATOMIC_ACQUIRE);
+#else
+    snapshot = current_snapshot;
+#endif
+    if (snapshot && snapshot->second == now) {
+        return snapshot;
+    }
+
+    snapshot = &snapshots[next_snapshot_slot];
+    next_snapshot_slot = (next_snapshot_slot + 1) % SNAPSHOT_SLOTS;
+    snapshot->second = now;
+
+    snapshot->date_header_len = strftime(snapshot->date_header, sizeof(snapshot->date_header),
+                                         "Date: %a, %d %b %Y %H:%M:%S GMT\r\n", gmtime(&now));
+
+    t = localtime(&now);
+    snprintf(snapshot->dynamic_head, sizeof(snapshot->dynamic_head),
+             "<html><body><h1>Dynamic Content</h1>"
+             "<p>Current Date and Time: %02d-%02d-%04d %02d:%02d:%02d</p>"
+             "<p>Random Number: ",
+             t->tm_mday, t->tm_mon + 1, t->tm_year + 1900,
+             t->tm_hour, t->tm_min, t->tm_sec);
+    snapshot->dynamic_head_len = strlen(snapshot->dynamic_head);
+
+#ifdef __GNUC__
+    __atomic_store_n(&current_snapshot, snapshot, __ATOMIC_RELEASE);
+#else
+    current_snapshot = snapshot;
+#endif
+    return snapshot;
+}
+
+void out_append(struct connection *conn, const char *data, size_t length) {
+    if (conn->out_len + length <= sizeof(conn->out)) {
+        memcpy(conn->out + conn->out_len, data, length);
+        conn->out_len += length;
+    }
+}
+
+/* Status line plus the shared Date header */
+void out_start(struct connection *conn, const char *status_line, size_t status_line_len) {
+    const struct time_snapshot *snapshot = get_time_snapshot();
+
+    conn->out_len = 0;
+    out_append(conn, status_line, status_line_len);
+    out_append(conn, snapshot->date_header, snapshot->date_header_len);
+}
+
+unsigned long hash_string(const char *str) {
+    unsigned long hash = 5381;
+    while (*str) {
+        hash = hash * 33 + (unsigned char)*str++;
+    }
+    return hash;
+}
+
+/* Validators derived from the file's identity, so any change to it yields new ones */
+void format_validators(const struct stat *file_stat, char *etag, size_t etag_size, char *last_modified, size_t last_modified_size) {
+    snprintf(etag, etag_size, "\"%lx-%lx-%lx\"",
+             (unsigned long)file_stat->st_ino, (unsigned long)file_stat->st_size, (unsigned long)file_stat->st_mtime);
+    strftime(last_modified, last_modified_size, "%a, %d %b %Y %H:%M:%S GMT", gmtime(&file_stat->st_mtime));
+}
+
+/* If-None-Match wins over If-Modified-Since; dates are compared as the exact string we sent */
+int request_not_modified(const struct connection *conn, const char *etag, const char *last_modified) {
+    const char *value;
+    size_t value_len;
+
+    value = find_header(conn, "If-None-Match", &value_len);
+    if (value) {
+        size_t etag_len = strlen(etag);
+        const char *end = value + value_len;
+
+        while (value < end) {
+            while (value < end && (*value == ' ' || *value == ',')) {
+                value++;
+            }
+            if (end - value >= 2 && strncmp(value, "W/", 2) == 0) {
+                value += 2;
+            }
+            if (*value == '*' || ((size_t)(end - value) >= etag_len && strncmp(value, etag, etag_len) == 0)) {
+                return 1;
+            }
+            while (value < end && *value != ',') {
+                value++;
+            }
+        }
+        return 0;
+    }
+
+    value = find_header(conn, "If-Modified-Since", &value_len);
+    return value && value_len == strlen(last_modified) && strncmp(value, last_modified, value_len) == 0;
+}
+
+static const char vary_header[] = "Vary: Accept-Encoding\r\n";
+
+void queue_not_modified(struct connection *conn, const char *etag, const char *last_modified, int vary) {
+    snprintf(conn->out, sizeof(conn->out), "HTTP/1.1 304 Not Modified\r\n%sETag: %s\r\nLast-Modified: %s\r\n%sConnection: %s\r\n\r\n",
+             get_time_snapshot()->date_header, etag, last_modified, vary ? vary_header : "", conn->keep_alive ? "keep-alive" : "close");
+    conn->out_len = strlen(conn->out);
+    cache_stats->not_modified++;
+}
+
+/* Content types by file extension; the compressible ones are offered gzip-encoded */
+struct mime_type {
+    const char *extension;
+    const char *type;
+    int compressible;
+};
+
+static const struct mime_type mime_types[] = {
+    { "html", "text/html", 1 },
+    { "htm", "text/html", 1 },
+    { "css", "text/css", 1 },
+    { "js", "application/javascript", 1 },
+    { "mjs", "application/javascript", 1 },
+    { "json", "application/json", 1 },
+    { "map", "application/json", 1 },
+    { "xml", "application/xml", 1 },
+    { "txt", "text/plain", 1 },
+    { "log", "text/plain", 1 },
+    { "md", "text/markdown", 1 },
+    { "csv", "text/csv", 1 },
+    { "svg", "image/svg+xml", 1 },
+    { "ico", "image/x-icon", 1 },
+    { "wasm", "application/wasm", 1 },
+    { "png", "image/png", 0 },
+    { "jpg", "image/jpeg", 0 },
+    { "jpeg", "image/jpeg", 0 },
+    { "gif", "image/gif", 0 },
+    { "webp", "image/webp", 0 },
+    { "woff", "font/woff", 0 },
+    { "woff2", "font/woff2", 0 },
+    { "pdf", "application/pdf", 0 },
+    { "zip", "application/zip", 0 },
+    { "gz", "application/gzip", 0 },
+    { "mp4", "video/mp4", 0 }
+};
+
+static const struct mime_type unknown_mime_type = { "", "application/octet-stream", 0 };
+
+const struct mime_type *mime_type_for(const char *path) {
+    const char *dot = strrchr(path, '.');
+    unsigned i;
+
+    if (dot == NULL || strchr(dot, '/')) {
+        return &unknown_mime_type;
+    }
+    for (i = 0; i < sizeof(mime_types) / sizeof(mime_types[0]); i++) {
+        if (strcasecmp(dot + 1, mime_types[i].extension) == 0) {
+            return &mime_types[i];
+        }
+    }
+    return &unknown_mime_type;
+}
+
+/* A q-value of zero ("0", "0.0", "0.000") refuses the coding it follows */
+int qvalue_is_zero(const char *value, const char *end) {
+    if (value == end || *value++ != '0') {
+        return 0;
+    }
+    if (value < end && *value == '.') {
+        value++;
+        while (value < end && *value == '0') {
+            value++;
+        }
+    }
+    return value == end || *value == ' ' || *value == '\t' || *value == ',' || *value == ';';
+}
+
+/* Whether Accept-Encoding lets us send gzip: named, or covered by "*", and not refused with q=0 */
+int request_accepts_gzip(const struct connection *conn) {
+    size_t value_len;
+    const char *value = find_header(conn, "Accept-Encoding", &value_len);
+    const char *end;
+    int gzip = -1;
+    int any = -1;
+
+    if (value == NULL) {
+        return 0;
+    }
+    end = value + value_len;
+    while (value < end) {
+        const char *coding;
+        size_t coding_len;
+        int accepted = 1;
+
+        while (value < end && (*value == ' ' || *value == '\t' || *value == ',')) {
+            value++;
+        }
+        coding = value;
+        while (value < end && *value != ',' && *value != ';' && *value != ' ' && *value != '\t') {
+            value++;
+        }
+        coding_len = value - coding;
+
+        /* Parameters up to the next coding; only q matters */
+        while (value < end && *value != ',') {
+            if (*value == ';') {
+                value++;
+                while (value < end && (*value == ' ' || *value == '\t')) {
+                    value++;
+                }
+                if (end - value >= 2 && (value[0] == 'q' || value[0] == 'Q') && value[1] == '=') {
+                    accepted = !qvalue_is_zero(value + 2, end);
+                }
+                continue;
+            }
+            value++;
+        }
+
+        if ((coding_len == 4 && strncasecmp(coding, "gzip", 4) == 0) ||
+            (coding_len == 6 && strncasecmp(coding, "x-gzip", 6) == 0)) {
+            gzip = accepted;
+        } else if (coding_len == 1 && *coding == '*') {
+            any = accepted;
+        }
+    }
+    return gzip != -1 ? gzip : any == 1;
+}
+
+/* A byte position from a Range header; anything past total reads as total + 1. Returns -1 if there are no digits */
+off_t parse_byte_pos(const char **cursor, const char *end, off_t total) {
+    const char *p = *cursor;
+    off_t value = 0;
+
+    if (p == end || *p < '0' || *p > '9') {
+        return -1;
+    }
+    while (p < end && *p >= '0' && *p <= '9') {
+        value = value > total ? total + 1 : value * 10 + (*p - '0');
+        p++;
+    }
+    *cursor = p;
+    return value;
+}
+
+/*
+ * Pick the byte ranges a GET asks for out of a representation of total
+ * bytes into conn->ranges. Returns how many can be satisfied, 0 when none
+ * can (416), or -1 when the whole representation should go out as usual:
+ * no Range, an If-Range naming another version, a header we can't parse,
+ * or ranges that are too many or add up to more than the file.
+ */
+int request_ranges(struct connection *conn, const char *etag, const char *last_modified, off_t total) {
+    const char *value, *end, *if_range;
+    size_t value_len, if_range_len;
+    off_t sum = 0;
+    int specs = 0;
+    int count = 0;
+
+    conn->range_count = 0;
+    value = find_header(conn, "Range", &value_len);
+    if (value == NULL || strcmp(conn->in + conn->request.method.offset, "GET") != 0) {
+        return -1;
+    }
+    conn->ranges = arena_alloc(&conn->arena, MAX_RANGES * sizeof(*conn->ranges));
+    if (conn->ranges == NULL) {
+        return -1;
+    }
+
+    /* If-Range holds the validator the client's partial copy came with; only exact matches resume */
+    if_range = find_header(conn, "If-Range", &if_range_len);
+    if (if_range && !(if_range_len == strlen(etag) && strncmp(if_range, etag, if_range_len) == 0) &&
+        !(if_range_len == strlen(last_modified) && strncmp(if_range, last_modified, if_range_len) == 0)) {
+        return -1;
+    }
+
+    end = value + value_len;
+    if (value_len < 6 || strncasecmp(value, "bytes=", 6) != 0) {
+        return -1;
+    }
+    value += 6;
+    while (value < end) {
+        off_t first, last;
+
+        while (value < end && (*value == ' ' || *value == '\t' || *value == ',')) {
+            value++;
+        }
+        if (value == end) {
+            break;
+        }
+
+        if (*value == '-') {
+            /* The final so many bytes, all of them if there are fewer; "-0" is none */
+            off_t suffix;
+
+            value++;
+            suffix = parse_byte_pos(&value, end, total);
+            if (suffix == -1) {
+                return -1;
+            }
+            first = suffix == 0 ? total : suffix < total ? total - suffix : 0;
+            last = total - 1;
+        } else {
+            first = parse_byte_pos(&value, end, total);
+            if (first == -1 || value == end || *value++ != '-') {
+                return -1;
+            }
+            last = total;
+            if (value < end && *value >= '0' && *value <= '9') {
+                last = parse_byte_pos(&value, end, total);
+                if (last < first) {
+                    return -1;
+                }
+            }
+        }
+        while (value < end && (*value == ' ' || *value == '\t')) {
+            value++;
+        }
+        if (value < end && *value != ',') {
+            return -1;
+        }
+        specs++;
+
+        if (first >= total) {
+            continue;       /* Unsatisfiable; the others may still be served */
+        }
+        if (last >= total) {
+            last = total - 1;
+        }
+        sum += last - first + 1;
+        if (count == MAX_RANGES || sum > total) {
+            return -1;
+        }
+        conn->ranges[count].first = first;
+        conn->ranges[count].last = last;
+        count++;
+    }
+
+    if (specs == 0) {
+        return -1;
+    }
+    conn->range_count = count;
+    return count;
+}
+
+void queue_range_not_satisfiable(struct connection *conn, off_t total) {
+    snprintf(conn->out, sizeof(conn->out), "HTTP/1.1 416 Range Not Satisfiable\r\n%sContent-Range: bytes */%ld\r\nContent-Length: 0\r\nConnection: %s\r\n\r\n",
+             get_time_snapshot()->date_header, (long)total, conn->keep_alive ? "keep-alive" : "close");
+    conn->out_len = strlen(conn->out);
+}
+
+/* The header ahead of multipart/byteranges part i; returns its length */
+int format_range_part(const struct connection *conn, int i, char *buffer, size_t size) {
+    const struct byte_range *range = &conn->ranges[i];
+
+    return snprintf(buffer, size, "\r\n--%s\r\nContent-Type: %s\r\nContent-Range: bytes %ld-%ld/%ld\r\n\r\n",
+                    conn->range_boundary, conn->range_type, (long)range->first, (long)range->last, (long)conn->range_total);
+}
+
+/*
+ * Queue the header of a 206 for the ranges request_ranges() found, and aim
+ * file_offset and file_remaining at the first; the caller points the body
+ * at the representation, cached or on disk, as it would for a 200. A single
+ * range carries its own Content-Range. Several go as multipart/byteranges,
+ * the first part header here and the rest from range_part_next().
+ */
+void queue_partial_content(struct connection *conn, const struct mime_type *type, int vary,
+                           const char *etag, const char *last_modified, off_t total) {
+    const struct byte_range *range = &conn->ranges[0];
+    char part[256];
+    int part_len;
+    int i;
+
+    conn->file_offset = range->first;
+    conn->file_remaining = range->last - range->first + 1;
+    if (conn->range_count == 1) {
+        snprintf(conn->out, sizeof(conn->out), "HTTP/1.1 206 Partial Content\r\n%sContent-Type: %s\r\n%sAccept-Ranges: bytes\r\nContent-Range: bytes %ld-%ld/%ld\r\nContent-Length: %ld\r\nETag: %s\r\nLast-Modified: %s\r\nConnection: %s\r\n\r\n",
+                 get_time_snapshot()->date_header, type->type, vary ? vary_header : "", (long)range->first, (long)range->last,
+                 (long)total, (long)conn->file_remaining, etag, last_modified, conn->keep_alive ? "keep-alive" : "close");
+        conn->out_len = strlen(conn->out);
+        return;
+    }
+
+    /* The validator names this version of the file; its bytes are unlikely to contain the hash of it */
+    snprintf(conn->range_boundary, sizeof(conn->range_boundary), "httpd2-%lx", hash_string(etag));
+    conn->range_type = type->type;
+    conn->range_total = total;
+    conn->range_next = 1;
+    conn->range_bytes = snprintf(part, sizeof(part), "\r\n--%s--\r\n", conn->range_boundary);
+    for (i = 1; i < conn->range_count; i++) {
+        conn->range_bytes += format_range_part(conn, i, part, sizeof(part)) + (conn->ranges[i].last - conn->ranges[i].first + 1);
+    }
+    part_len = format_range_part(conn, 0, part, sizeof(part));
+
+    snprintf(conn->out, sizeof(conn->out), "HTTP/1.1 206 Partial Content\r\n%sContent-Type: multipart/byteranges; boundary=%s\r\n%sAccept-Ranges: bytes\r\nContent-Length: %lu\r\nETag: %s\r\nLast-Modified: %s\r\nConnection: %s\r\n\r\n",
+             get_time_snapshot()->date_header, conn->range_boundary, vary ? vary_header : "",
+             part_len + (unsigned long)conn->file_remaining + conn->range_bytes, etag, last_modified, conn->keep_alive ? "keep-alive" : "close");
+    conn->out_len = strlen(conn->out);
+    out_append(conn, part, part_len);
+}
+
+/*
+ * Once a multipart/byteranges part has gone, queue the next part header and
+ * aim the body at its bytes, or queue the closing delimiter after the last.
+ * Returns 0 when there is nothing more, including after a single range.
+ */
+int range_part_next(struct connection *conn) {
+    const struct byte_range *range;
+
+    if (conn->range_count < 2 || conn->range_next > conn->range_count) {
+        return 0;
+    }
+    conn->out_sent = 0;
+    if (conn->range_next == conn->range_count) {
+        conn->out_len = snprintf(conn->out, sizeof(conn->out), "\r\n--%s--\r\n", conn->range_boundary);
+        conn->range_next++;
+        return 1;
+    }
+
+    range = &conn->ranges[conn->range_next];
+    conn->out_len = format_range_part(conn, conn->range_next, conn->out, sizeof(conn->out));
+    conn->range_next++;
+    conn->file_offset = range->first;
+    conn->file_remaining = range->last - range->first + 1;
+    /* Reads on the ring say where they start, so only read() needs the file position */
+    if (conn->file_fd != -1 && !conn->use_sendfile && !use_uring && lseek(conn->file_fd, range->first, SEEK_SET) == -1) {
+        conn->state = CONN_CLOSING;
+        return 0;
+    }
+    return 1;
+}
+
+void cache_entry_release(struct cache_entry *entry) {
+    if (--entry->refs == 0) {
+        free(entry->path);
+        free(entry->body);
+        free(entry);
+    }
+}
+
+/* Drop an entry from the cache; connections still sending it keep it alive until they finish */
+void file_cache_remove(struct cache_entry *entry) {
+    struct cache_entry **link = &cache_buckets[entry->hash % FILE_CACHE_BUCKETS];
+
+    while (*link != entry) {
+        link = &(*link)->hash_next;
+    }
+    *link = entry->hash_next;
+
+    if (entry->lru_prev) {
+        entry->lru_prev->lru_next = entry->lru_next;
+    } else {
+        cache_lru_head = entry->lru_next;
+    }
+    if (entry->lru_next) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        cache_lru_tail = entry->lru_prev;
+    }
+
+    cache_bytes -= entry->size;
+    cache_entry_release(entry);
+}
+
+void file_cache_touch(struct cache_entry *entry) {
+    if (entry == cache_lru_head) {
+        return;
+    }
+    entry->lru_prev->lru_next = entry->lru_next;
+    if (entry->lru_next) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        cache_lru_tail = entry->lru_prev;
+    }
+    entry->lru_prev = NULL;
+    entry->lru_next = cache_lru_head;
+    cache_lru_head->lru_prev = entry;
+    cache_lru_head = entry;
+}
+
+int gzip_sibling_exists(const char *path) {
+    char gz_path[BUFFER_SIZE + 4];
+    struct stat file_stat;
+
+    snprintf(gz_path, sizeof(gz_path), "%s.gz", path);
+    return stat(gz_path, &file_stat) == 0 && S_ISREG(file_stat.st_mode);
+}
+
+/*
+ * Find a cached representation of a file, re-checking it against the disk
+ * at most once a second. A file compressed here also goes once a sibling
+ * .gz turns up, so that the sibling takes over.
+ */
+struct cache_entry *file_cache_find(const char *path, int variant) {
+    unsigned long hash = hash_string(path);
+    struct cache_entry *entry = cache_buckets[hash % FILE_CACHE_BUCKETS];
+
+    while (entry && (entry->hash != hash || entry->variant != variant || strcmp(entry->path, path) != 0)) {
+        entry = entry->hash_next;
+    }
+    if (entry == NULL) {
+        return NULL;
+    }
+
+    if (entry->checked != now) {
+        struct stat file_stat;
+        if (stat(path, &file_stat) == -1 || file_stat.st_ino != entry->ino ||
+            file_stat.st_size != entry->st_size || file_stat.st_mtime != entry->mtime ||
+            (variant == VARIANT_GZIP && gzip_sibling_exists(path))) {
+            file_cache_remove(entry);
+            cache_stats->invalidations++;
+            return NULL;
+        }
+        entry->checked = now;
+    }
+
+    file_cache_touch(entry);
+    return entry;
+}
+
+#ifdef HAVE_ZLIB
+/* Replace a cache entry's body with its gzip encoding if that is smaller; returns whether it did */
+int gzip_cache_entry(struct cache_entry *entry) {
+    z_stream stream;
+    size_t bound;
+    char *out;
+    char *shrunk;
+    size_t out_len;
+    int status;
+
+    if (entry->size < GZIP_MIN_FILE_SIZE) {
+        return 0;
+    }
+    memset(&stream, 0, sizeof(stream));
+    /* 16 more window bits ask for a gzip wrapper rather than zlib's own */
+    if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return 0;
+    }
+    bound = deflateBound(&stream, entry->size);
+    out = malloc(bound);
+    if (out == NULL) {
+        deflateEnd(&stream);
+        return 0;
+    }
+    stream.next_in = (Bytef *)entry->body;
+    stream.avail_in = entry->size;
+    stream.next_out = (Bytef *)out;
+    stream.avail_out = bound;
+    status = deflate(&stream, Z_FINISH);
+    out_len = stream.total_out;
+    deflateEnd(&stream);
+
+    if (status != Z_STREAM_END || out_len >= entry->size) {
+        free(out);
+        return 0;
+    }
+    shrunk = realloc(out, out_len);
+    free(entry->body);
+    entry->body = shrunk ? shrunk : out;
+    entry->size = out_len;
+    cache_stats->compressions++;
+    return 1;
+}
+#endif
+
+/* Read a whole file into a new cache entry, evicting least recently used entries to make room */
+struct cache_entry *file_cache_insert(const char *path, int variant, const struct mime_type *type,
+                                      int file_fd, const struct stat *file_stat) {
+    struct cache_entry *entry;
+    size_t size = file_stat->st_size;
+    size_t total = 0;
+    int encoded = variant == VARIANT_GZIP_FILE;
+
+    entry = malloc(sizeof(*entry));
+    if (entry == NULL) {
+        return NULL;
+    }
+    entry->path = malloc(strlen(path) + 1);
+    entry->body = malloc(size > 0 ? size : 1);
+    if (entry->path == NULL || entry->body == NULL) {
+        free(entry->path);
+        free(entry->body);
+        free(entry);
+        return NULL;
+    }
+    strcpy(entry->path, path);
+
+    while (total < size) {
+        ssize_t bytes_read = read(file_fd, entry->body + total, size - total);
+        if (bytes_read <= 0) {
+            /* Changed while we were reading it; don't cache a torn copy */
+            free(entry->path);
+            free(entry->body);
+            free(entry);
+            return NULL;
+        }
+        total += bytes_read;
+    }
+
+    entry->variant = variant;
+    entry->size = size;
+#ifdef HAVE_ZLIB
+    if (variant == VARIANT_GZIP) {
+        encoded = gzip_cache_entry(entry);
+    }
+#endif
+    entry->ino = file_stat->st_ino;
+    entry->st_size = file_stat->st_size;
+    entry->mtime = file_stat->st_mtime;
+    entry->checked = now;
+    entry->refs = 1;
+    entry->type = type;
+    entry->encoded = encoded;
+    entry->vary = type->compressible;
+    format_validators(file_stat, entry->etag, sizeof(entry->etag), entry->last_modified, sizeof(entry->last_modified));
+    if (encoded && variant == VARIANT_GZIP) {
+        /* The compressed bytes need a tag of their own; a sibling .gz already has one from its own inode */
+        size_t etag_len = strlen(entry->etag);
+        snprintf(entry->etag + etag_len - 1, sizeof(entry->etag) - etag_len + 1, "-gzip\"");
+    }
+    snprintf(entry->header, sizeof(entry->header),
+             "Content-Type: %s\r\n%s%s%sContent-Length: %lu\r\nETag: %s\r\nLast-Modified: %s\r\n",
+             type->type, encoded ? "Content-Encoding: gzip\r\n" : "", entry->vary ? vary_header : "",
+             encoded ? "" : "Accept-Ranges: bytes\r\n",
+             (unsigned long)entry->size, entry->etag, entry->last_modified);
+    entry->header_len = strlen(entry->header);
+
+    while (cache_lru_tail && cache_bytes + (long)entry->size > FILE_CACHE_MAX_BYTES) {
+        file_cache_remove(cache_lru_tail);
+        cache_stats->evictions++;
+    }
+
+    entry->hash = hash_string(path);
+    entry->hash_next = cache_buckets[entry->hash % FILE_CACHE_BUCKETS];
+    cache_buckets[entry->hash % FILE_CACHE_BUCKETS] = entry;
+    entry->lru_prev = NULL;
+    entry->lru_next = cache_lru_head;
+    if (cache_lru_head) {
+        cache_lru_head->lru_prev = entry;
+    } else {
+        cache_lru_tail = entry;
+    }
+    cache_lru_head = entry;
+    cache_bytes += entry->size;
+
+    return entry;
+}
+
+void print_cache_stats() {
+    int entries = 0;
+    struct cache_entry *entry;
+
+    for (entry = cache_lru_head; entry; entry = entry->lru_next) {
+        entries++;
+    }
+    log_msg(LOG_INFO, "File cache: %d entries, %ld/%ld bytes, %lu hits, %lu misses, %lu not modified, %lu invalidations, %lu evictions, %lu compressions",
+            entries, cache_bytes, FILE_CACHE_MAX_BYTES, cache_stats->hits, cache_stats->misses,
+            cache_stats->not_modified, cache_stats->invalidations, cache_stats->evictions, cache_stats->compressions);
+}
+
+void request_cache_stats(int sig) {
+    (void)sig;
+    cache_stats_requested = 1;
+}
+
+/* Queue a cached representation, or the ranges asked of it; the 200 header was put together when it was read */
+void serve_cache_entry(struct connection *conn, struct cache_entry *entry) {
+    int ranges = -1;
+
+    if (request_not_modified(conn, entry->etag, entry->last_modified)) {
+        queue_not_modified(conn, entry->etag, entry->last_modified, entry->vary);
+        return;
+    }
+
+    if (!entry->encoded) {
+        ranges = request_ranges(conn, entry->etag, entry->last_modified, entry->size);
+    }
+    if (ranges == 0) {
+        queue_range_not_satisfiable(conn, entry->size);
+        return;
+    }
+    if (ranges > 0) {
+        queue_partial_content(conn, entry->type, entry->vary, entry->etag, entry->last_modified, entry->size);
+    } else {
+        out_start(conn, "HTTP/1.1 200 OK\r\n", 17);
+        out_append(conn, entry->header, entry->header_len);
+        if (conn->keep_alive) {
+            out_append(conn, "Connection: keep-alive\r\n\r\n", 26);
+        } else {
+            out_append(conn, "Connection: close\r\n\r\n", 21);
+        }
+        conn->file_offset = 0;
+        conn->file_remaining = entry->size;
+    }
+    entry->refs++;
+    conn->cache_entry = entry;
+    conn->body = entry->body;
+}
+
+/*
+ * Queue a representation that wasn't in the cache: small files are read
+ * into it, the rest are streamed from file_fd as the socket drains. Returns
+ * -1 if the file can't be opened.
+ */
+int serve_file_variant(const char *filepath, int variant, const struct mime_type *type, struct connection *conn) {
+    struct stat file_stat;
+    struct cache_entry *entry;
+    char etag[48];
+    char last_modified[32];
+    ssize_t bytes_read;
+    size_t chunk;
+    int file_fd;
+    int encoded;
+    int ranges;
+
+    file_fd = open(filepath, O_RDONLY);
+    if (file_fd == -1) {
+        /* A missing sibling .gz is the usual case, not worth a message */
+        if (variant == VARIANT_IDENTITY) {
+            perror("Error opening file");
+        }
+        return -1;  /*  File not found or error */
+    }
+
+    if (fstat(file_fd, &file_stat) == -1) {
+        perror("Error getting file size");
+        close(file_fd);
+        return -1;
+    }
+
+    if (!S_ISREG(file_stat.st_mode)) {
+        close(file_fd);
+        return -1;
+    }
+
+    if (file_stat.st_size <= (variant == VARIANT_GZIP ? GZIP_MAX_FILE_SIZE : FILE_CACHE_MAX_FILE_SIZE)) {
+        entry = file_cache_insert(filepath, variant, type, file_fd, &file_stat);
+        if (entry) {
+            close(file_fd);
+            serve_cache_entry(conn, entry);
+            return 0;
+        }
+    }
+    /* A GZIP variant too big to compress here goes as it is */
+    encoded = variant == VARIANT_GZIP_FILE;
+
+    format_validators(&file_stat, etag, sizeof(etag), last_modified, sizeof(last_modified));
+    if (request_not_modified(conn, etag, last_modified)) {
+        close(file_fd);
+        queue_not_modified(conn, etag, last_modified, type->compressible);
+        return 0;
+    }
+
+    ranges = encoded ? -1 : request_ranges(conn, etag, last_modified, file_stat.st_size);
+    if (ranges == 0) {
+        close(file_fd);
+        queue_range_not_satisfiable(conn, file_stat.st_size);
+        return 0;
+    }
+
+    /* Create the HTTP header */
+
+    if (ranges > 0) {
+        queue_partial_content(conn, type, type->compressible, etag, last_modified, file_stat.st_size);
+    } else {
+        snprintf(conn->out, sizeof(conn->out), "HTTP/1.1 200 OK\r\n%sContent-Type: %s\r\n%s%s%sContent-Length: %ld\r\nETag: %s\r\nLast-Modified: %s\r\nConnection: %s\r\n\r\n",
+                 get_time_snapshot()->date_header, type->type, encoded ? "Content-Encoding: gzip\r\n" : "",
+                 type->compressible ? vary_header : "", encoded ? "" : "Accept-Ranges: bytes\r\n",
+                 (long)file_stat.st_size, etag, last_modified, conn->keep_alive ? "keep-alive" : "close");
+        conn->out_len = strlen(conn->out);
+        conn->file_offset = 0;
+        conn->file_remaining = file_stat.st_size;
+    }
+
+    /* sendfile() sends the body behind the header from file_offset on (see connection_write) */
+    if (conn->use_sendfile) {
+        conn->file_fd = file_fd;
+        return 0;
+    }
+
+    /* Otherwise send the start of the body with the header so small files go out in one segment */
+    if (lseek(file_fd, conn->file_offset, SEEK_SET) == -1) {
+        close(file_fd);
+        conn->file_remaining = 0;
+        conn->range_count = 0;
+        return -1;
+    }
+    conn->file_fd = file_fd;
+    chunk = sizeof(conn->out) - conn->out_len;
+    if ((off_t)chunk > conn->file_remaining) {
+        chunk = conn->file_remaining;
+    }
+    bytes_read = read(file_fd, conn->out + conn->out_len, chunk);
+    if (bytes_read > 0) {
+        conn->out_len += bytes_read;
+        conn->file_offset += bytes_read;
+        conn->file_remaining -= bytes_read;
+    }
+
+    return 0;  /* Success */
+}
+
+/*
+ * Queue a file in the best encoding the client takes. For gzip that is a
+ * sibling .gz as it stands, then (with zlib) the file compressed here and
+ * kept in the cache; otherwise, or when neither works out, the file itself.
+ * Only compressible types are negotiated, and those always say Vary.
+ */
+int serve_file_from_disk(const char *filepath, struct connection *conn) {
+    const struct mime_type *type = mime_type_for(filepath);
+    struct cache_entry *entry;
+    char gz_path[BUFFER_SIZE + 4];
+#ifdef HAVE_ZLIB
+    int fallback = VARIANT_GZIP;
+#else
+    int fallback = VARIANT_IDENTITY;
+#endif
+
+    if (type->compressible && request_accepts_gzip(conn) && snprintf(gz_path, sizeof(gz_path), "%s.gz", filepath) < (int)sizeof(gz_path)) {
+        entry = file_cache_find(gz_path, VARIANT_GZIP_FILE);
+        if (entry == NULL) {
+            entry = file_cache_find(filepath, fallback);
+        }
+        if (entry) {
+            cache_stats->hits++;
+            serve_cache_entry(conn, entry);
+            return 0;
+        }
+        cache_stats->misses++;
+        if (serve_file_variant(gz_path, VARIANT_GZIP_FILE, type, conn) == 0) {
+            return 0;
+        }
+        return serve_file_variant(filepath, fallback, type, conn);
+    }
+
+    entry = file_cache_find(filepath, VARIANT_IDENTITY);
+    if (entry) {
+        cache_stats->hits++;
+        serve_cache_entry(conn, entry);
+        return 0;
+    }
+    cache_stats->misses++;
+    return serve_file_variant(filepath, VARIANT_IDENTITY, type, conn);
+}
+
+/* Queue a complete response; every response carries its length so the connection can be reused */
+void queue_response(struct connection *conn, const char *status, const char *content_type, const char *content) {
+    snprintf(conn->out, sizeof(conn->out), "HTTP/1.1 %s\r\n%sContent-Type: %s\r\nContent-Length: %d\r\nConnection: %s\r\n\r\n%s",
+             status, get_time_snapshot()->date_header, content_type, (int)strlen(content),
+             conn->keep_alive ? "keep-alive" : "close", content);
+    conn->out_len = strlen(conn->out);
+}
+
+/* Split a query string or form body into decoded name=value pairs, in place; the array goes in the arena. -1 if that is full */
+int request_params(struct connection *conn, char *data, size_t length, struct http_param **params) {
+    int max_params = http_count_params(data, length);
+
+    *params = arena_alloc(&conn->arena, max_params * sizeof(**params));
+    if (*params == NULL) {
+        return -1;
+    }
+    return http_parse_params(data, length, *params, max_params);
+}
+
+/* Text made safe to put in a page, in the arena; cut short rather than grow past max bytes. NULL if the arena is full */
+char *html_escape(struct connection *conn, const char *text, size_t length, size_t max) {
+    char *escaped;
+    size_t out = 0;
+    size_t i;
+
+    if (max > length * 6) {
+        max = length * 6;           /* The longest entity */
+    }
+    escaped = arena_alloc(&conn->arena, max + 1);
+    if (escaped == NULL) {
+        return NULL;
+    }
+    for (i = 0; i < length; i++) {
+        const char *entity = NULL;
+        size_t entity_len = 1;
+
+        switch (text[i]) {
+        case '<':
+            entity = "&lt;";
+            break;
+        case '>':
+            entity = "&gt;";
+            break;
+        case '&':
+            entity = "&amp;";
+            break;
+        case '"':
+            entity = "&quot;";
+            break;
+        case '\'':
+            entity = "&#39;";
+            break;
+        }
+        if (entity) {
+            entity_len = strlen(entity);
+        }
+        if (out + entity_len > max) {
+            break;
+        }
+        if (entity) {
+            memcpy(escaped + out, entity, entity_len);
+        } else {
+            escaped[out] = text[i];
+        }
+        out += entity_len;
+    }
+    escaped[out] = '\0';
+    return escaped;
+}
+
+/* The page answering a form post: a greeting for its first non-empty name field. Built in the arena; NULL if that is full */
+const char *handle_form_submission(struct connection *conn, char *data, size_t length) {
+    static const char greeting[] = "<html><body><h1>Hello, %s!</h1></body></html>";
+    struct http_param *params;
+    const char *name;
+    char *response;
+    size_t response_size;
+    int param_count;
+    int i;
+
+    param_count = request_params(conn, data, length, &params);
+    if (param_count == -1) {
+        return NULL;
+    }
+    for (i = 0; i < param_count; i++) {
+        if (strcmp(params[i].name, "name") == 0 && params[i].value_len > 0) {
+            break;
+        }
+    }
+    if (i == param_count) {
+        return "<html><body><h1>Error in submission</h1></body></html>";
+    }
+
+    name = html_escape(conn, params[i].value, params[i].value_len, BUFFER_SIZE);
+    if (name == NULL) {
+        return NULL;
+    }
+    response_size = strlen(name) + sizeof(greeting);
+    response = arena_alloc(&conn->arena, response_size);
+    if (response) {
+        snprintf(response, response_size, greeting, name);
+    }
+    return response;
+}
+
+void handle_submit(struct connection *conn, const char *resource, const char *query_string) {
+    const char *response;
+
+    (void)resource;
+    (void)query_string;
+    if (LOG_ENABLED(LOG_DEBUG)) {
+        log_msg(LOG_DEBUG, "Handling POST request to \"/submit\"");
+    }
+    /* The POST data follows the headers, already de-chunked and terminated */
+    response = handle_form_submission(conn, conn->in + conn->request.body_start, conn->request.body_len);
+    if (response == NULL) {
+        queue_response(conn, "500 Internal Server Error", "text/html", "<html><body><h1>500 Internal Server Error</h1></body></html>");
+        return;
+    }
+    queue_response(conn, "200 OK", "text/html", response);
+}
+
+/* Only the random number is formatted per request; the rest comes from this second's snapshot */
+void handle_dynamic(struct connection *conn, const char *resource, const char *query_string) {
+    static const char status_line[] = "HTTP/1.1 200 OK\r\n";
+    const struct time_snapshot *snapshot = get_time_snapshot();
+    char header[96];
+    char number[4];
+    int random_number = rand() % 100;
+    int number_len = 0;
+
+    (void)resource;
+    (void)query_string;
+
+    if (random_number >= 10) {
+        number[number_len++] = '0' + random_number / 10;
+    }
+    number[number_len++] = '0' + random_number % 10;
+
+    out_start(conn, status_line, sizeof(status_line) - 1);
+    out_append(conn, header, sprintf(header, "Content-Type: text/html\r\nContent-Length: %d\r\nConnection: %s\r\n\r\n",
+                                     (int)(snapshot->dynamic_head_len + number_len + sizeof(dynamic_tail) - 1),
+                                     conn->keep_alive ? "keep-alive" : "close"));
+    out_append(conn, snapshot->dynamic_head, snapshot->dynamic_head_len);
+    out_append(conn, number, number_len);
+    out_append(conn, dynamic_tail, sizeof(dynamic_tail) - 1);
+}
+
+void handle_file(struct connection *conn, const char *resource, const char *query_string) {
+    /* Serve file from disk */
+    char filepath[BUFFER_SIZE];
+
+    (void)query_string;
+    /* Assuming the files are in the current directory; skip the leading '/' */
+    if (snprintf(filepath, sizeof(filepath), "./%s", resource + 1) >= (int)sizeof(filepath) ||
+        serve_file_from_disk(filepath, conn) == -1) {
+        /* If the file wasn't found, send a 404 response */
+        queue_response(conn, "404 Not Found", "text/html", "<html><body><h1>404 Not Found</h1></body></html>");
+    }
+}
+
+/* A constant page asked for with a query string is built per request, in the arena */
+void handle_page_with_query(struct connection *conn, const char *page, char *query_string) {
+    char *content = arena_alloc(&conn->arena, BUFFER_SIZE);
+    struct http_param *params;
+    int param_count;
+    int i;
+
+    /* The query is about to be decoded over; the access log wants it as it came */
+    if (access_log_format != ACCESS_LOG_OFF) {
+        conn->logged_query = arena_strndup(&conn->arena, query_string, conn->request.query.length);
+    }
+    param_count = request_params(conn, query_string, conn->request.query.length, &params);
+    if (content == NULL || param_count == -1) {
+        queue_response(conn, "500 Internal Server Error", "text/html", "<html><body><h1>500 Internal Server Error</h1></body></html>");
+        return;
+    }
+    snprintf(content, BUFFER_SIZE, "%s", page);
+
+    /* Example: Check for a specific parameter in the query string */
+
+    for (i = 0; i < param_count; i++) {
+        if (strcmp(params[i].name, "name") == 0) {
+            size_t content_len = strlen(content);
+            const char *name = html_escape(conn, params[i].value, params[i].value_len, BUFFER_SIZE - 1 - content_len);
+
+            if (name) {
+                snprintf(content + content_len, BUFFER_SIZE - content_len, "<p>Hello, %s!</p>", name);
+            }
+        }
+    }
+
+    queue_response(conn, "200 OK", "text/html", content);
+}
+
+typedef void (*route_handler)(struct connection *conn, const char *resource, const char *query_string);
+
+struct route {
+    const char *method;             /* NULL matches any method */
+    const char *path;               /* Exact path, or a prefix when it ends in '*' */
+    route_handler handler;          /* Builds the response; NULL for a constant page */
+    const char *page;               /* Constant page body */
+    char *response[2];              /* Serialized page response after the status line and Date, indexed by keep-alive */
+    size_t response_len[2];
+    size_t path_len;
+    struct route *next;             /* Next exact route in the same bucket */
+};
+
+void handle_metrics(struct connection *conn, const char *resource, const char *query_string);
+
+static struct route routes[] = {
+    { "POST", "/submit", handle_submit, NULL },
+    { NULL, "/dynamic", handle_dynamic, NULL },
+    { "GET", "/metrics", handle_metrics, NULL },
+    { NULL, "/", NULL, home_page },
+    { NULL, "/about", NULL, about_page },
+    { NULL, "/contact", NULL, contact_page },
+    { NULL, "/*", handle_file, NULL }
+};
+
+#define ROUTE_COUNT (sizeof(routes) / sizeof(routes[0]))
+
+/* Statuses counted separately; the last slot counts everything else */
+static const int metric_statuses[] = { 200, 206, 304, 400, 404, 413, 414, 416, 431, 500, 501, 503 };
+#define STATUS_SLOTS (sizeof(metric_statuses) / sizeof(metric_statuses[0]) + 1)
+
+/*
+ * One worker's counters. The slots live in memory shared by all the
+ * workers, each of which only ever writes its own, so recording is a plain
+ * increment; /metrics adds the slots up when it is asked.
+ */
+struct worker_metrics {
+    unsigned long requests[ROUTE_COUNT + 1][STATUS_SLOTS];   /* By route, the last for requests no route took */
+    struct histogram latency[ROUTE_COUNT + 1];             /* Microseconds from first byte in to last byte out */
+    unsigned long response_bytes;
+    unsigned long connections_accepted;
+    long connections_active;
+    struct cache_counters cache;
+};
+
+static struct worker_metrics *metrics_slots;
+static int metrics_slot_count;
+static struct worker_metrics *metrics;     /* This worker's slot */
+
+/* Set aside a slot per worker before any are forked */
+void metrics_init(int slots) {
+    size_t size = slots * sizeof(struct worker_metrics);
+
+#ifdef MAP_ANONYMOUS
+    metrics_slots = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (metrics_slots == MAP_FAILED) {
+        metrics_slots = NULL;
+    }
+#endif
+    if (metrics_slots == NULL) {
+        /* Each worker will only see its own counters */
+        metrics_slots = calloc(1, size);
+        if (metrics_slots == NULL) {
+            perror("Failed to allocate metrics");
+            exit(EXIT_FAILURE);
+        }
+    }
+    metrics_slot_count = slots;
+}
+
+void metrics_attach(int slot) {
+    metrics = &metrics_slots[slot];
+    cache_stats = &metrics->cache;
+    /* A restarted worker keeps its predecessor's counters, but not its connections */
+    metrics->connections_active = 0;
+}
+
+int status_slot(int status) {
+    unsigned i;
+
+    for (i = 0; i < STATUS_SLOTS - 1; i++) {
+        if (metric_statuses[i] == status) {
+            break;
+        }
+    }
+    return i;
+}
+
+const char *route_label(unsigned route) {
+    return route < ROUTE_COUNT ? routes[route].path : "none";
+}
+
+/* Prometheus text exposition of every worker's counters added together */
+void handle_metrics(struct connection *conn, const char *resource, const char *query_string) {
+    static const char status_line[] = "HTTP/1.1 200 OK\r\n";
+    static struct worker_metrics total;
+    struct metrics_text text;
+    struct cache_entry *entry;
+    char header[128];
+    char labels[64];
+    unsigned route, slot;
+    int i;
+
+    (void)resource;
+    (void)query_string;
+
+    memset(&total, 0, sizeof(total));
+    for (i = 0; i < metrics_slot_count; i++) {
+        const struct worker_metrics *m = &metrics_slots[i];
+
+        for (route = 0; route <= ROUTE_COUNT; route++) {
+            for (slot = 0; slot < STATUS_SLOTS; slot++) {
+                total.requests[route][slot] += m->requests[route][slot];
+            }
+            histogram_merge(&total.latency[route], &m->latency[route]);
+        }
+        total.response_bytes += m->response_bytes;
+        total.connections_accepted += m->connections_accepted;
+        total.connections_active += m->connections_active;
+        total.cache.hits += m->cache.hits;
+        total.cache.misses += m->cache.misses;
+        total.cache.not_modified += m->cache.not_modified;
+        total.cache.invalidations += m->cache.invalidations;
+        total.cache.evictions += m->cache.evictions;
+        total.cache.compressions += m->cache.compressions;
+    }
+
+    memset(&text, 0, sizeof(text));
+    metrics_printf(&text, "# TYPE httpd_requests_total counter\n");
+    for (route = 0; route <= ROUTE_COUNT; route++) {
+        for (slot = 0; slot < STATUS_SLOTS; slot++) {
+            if (total.requests[route][slot] == 0) {
+                continue;
+            }
+            if (slot < STATUS_SLOTS - 1) {
+                metrics_printf(&text, "httpd_requests_total{route=\"%s\",status=\"%d\"} %lu\n",
+                               route_label(route), metric_statuses[slot], total.requests[route][slot]);
+            } else {
+                metrics_printf(&text, "httpd_requests_total{route=\"%s\",status=\"other\"} %lu\n",
+                               route_label(route), total.requests[route][slot]);
+            }
+        }
+    }
+    metrics_printf(&text, "# TYPE httpd_request_duration_seconds summary\n");
+    for (route = 0; route <= ROUTE_COUNT; route++) {
+        if (total.latency[route].count == 0) {
+            continue;
+        }
+        sprintf(labels, "route=\"%.40s\"", route_label(route));
+        metrics_summary(&text, "httpd_request_duration_seconds", labels, &total.latency[route], 1e-6);
+    }
+    metrics_printf(&text, "# TYPE httpd_response_bytes_total counter\nhttpd_response_bytes_total %lu\n", total.response_bytes);
+    metrics_printf(&text, "# TYPE httpd_connections_accepted_total counter\nhttpd_connections_accepted_total %lu\n", total.connections_accepted);
+    metrics_printf(&text, "# TYPE httpd_connections_active gauge\nhttpd_connections_active %ld\n", total.connections_active);
+    metrics_printf(&text, "# TYPE httpd_workers gauge\nhttpd_workers %d\n", metrics_slot_count);
+    metrics_printf(&text, "# TYPE httpd_file_cache_lookups_total counter\n"
+                   "httpd_file_cache_lookups_total{result=\"hit\"} %lu\nhttpd_file_cache_lookups_total{result=\"miss\"} %lu\n",
+                   total.cache.hits, total.cache.misses);
+    metrics_printf(&text, "# TYPE httpd_file_cache_not_modified_total counter\nhttpd_file_cache_not_modified_total %lu\n", total.cache.not_modified);
+    metrics_printf(&text, "# TYPE httpd_file_cache_invalidations_total counter\nhttpd_file_cache_invalidations_total %lu\n", total.cache.invalidations);
+    metrics_printf(&text, "# TYPE httpd_file_cache_evictions_total counter\nhttpd_file_cache_evictions_total %lu\n", total.cache.evictions);
+    metrics_printf(&text, "# TYPE httpd_file_cache_compressions_total counter\nhttpd_file_cache_compressions_total %lu\n", total.cache.compressions);
+
+    /* The text goes out the way a cached file does, and is freed by the same release */
+    entry = text.failed ? NULL : calloc(1, sizeof(*entry));
+    if (entry == NULL) {
+        free(text.data);
+        queue_response(conn, "500 Internal Server Error", "text/html", "<html><body><h1>500 Internal Server Error</h1></body></html>");
+        return;
+    }
+    entry->body = text.data;
+    entry->size = text.length;
+    entry->refs = 1;
+
+    out_start(conn, status_line, sizeof(status_line) - 1);
+    out_append(conn, header, sprintf(header, "Content-Type: text/plain; version=0.0.4\r\nContent-Length: %lu\r\nConnection: %s\r\n\r\n",
+                                     (unsigned long)text.length, conn->keep_alive ? "keep-alive" : "close"));
+    conn->cache_entry = entry;
+    conn->body = entry->body;
+    conn->file_offset = 0;
+    conn->file_remaining = entry->size;
+}
+
+static struct route *route_buckets[ROUTE_BUCKETS];
+static struct route *prefix_routes[ROUTE_COUNT];    /* Longest prefix first */
+static int prefix_route_count = 0;
+
+/* Index the route table and serialize the constant pages */
+void init_routes() {
+    unsigned i;
+
+    for (i = 0; i < ROUTE_COUNT; i++) {
+        struct route *route = &routes[i];
+        int keep_alive;
+
+        route->path_len = strlen(route->path);
+
+        if (route->page) {
+            for (keep_alive = 0; keep_alive < 2; keep_alive++) {
+                size_t size = strlen(route->page) + 128;
+                route->response[keep_alive] = malloc(size);
+                if (route->response[keep_alive] == NULL) {
+                    perror("Failed to allocate route");
+                    exit(EXIT_FAILURE);
+                }
+                snprintf(route->response[keep_alive], size,
+                         "Content-Type: text/html\r\nContent-Length: %d\r\nConnection: %s\r\n\r\n%s",
+                         (int)strlen(route->page), keep_alive ? "keep-alive" : "close", route->page);
+                route->response_len[keep_alive] = strlen(route->response[keep_alive]);
+            }
+        }
+
+        if (route->path[route->path_len - 1] == '*') {
+            int j = prefix_route_count++;
+            route->path_len--;
+            while (j > 0 && prefix_routes[j - 1]->path_len < route->path_len) {
+                prefix_routes[j] = prefix_routes[j - 1];
+                j--;
+            }
+            prefix_routes[j] = route;
+        } else {
+            unsigned long bucket = hash_string(route->path) % ROUTE_BUCKETS;
+            route->next = route_buckets[bucket];
+            route_buckets[bucket] = route;
+        }
+    }
+}
+
+int route_method_matches(const struct route *route, const char *method) {
+    return route->method == NULL || strcmp(route->method, method) == 0;
+}
+
+/* Exact routes first, then the longest matching prefix */
+const struct route *find_route(const char *method, const char *resource) {
+    const struct route *route = route_buckets[hash_string(resource) % ROUTE_BUCKETS];
+    int i;
+
+    for (; route; route = route->next) {
+        if (strcmp(route->path, resource) == 0 && route_method_matches(route, method)) {
+            return route;
+        }
+    }
+    for (i = 0; i < prefix_route_count; i++) {
+        route = prefix_routes[i];
+        if (strncmp(route->path, resource, route->path_len) == 0 && route_method_matches(route, method)) {
+            return route;
+        }
+    }
+    return NULL;
+}
+
+/* Answer a request the parser rejected */
+void queue_error_response(struct connection *conn, int status) {
+    switch (status) {
+    case 413:
+        queue_response(conn, "413 Payload Too Large", "text/html", "<html><body><h1>Request body too large</h1></body></html>");
+        break;
+    case 414:
+        queue_response(conn, "414 URI Too Long", "text/html", "<html><body><h1>Request line too long</h1></body></html>");
+        break;
+    case 431:
+        queue_response(conn, "431 Request Header Fields Too Large", "text/html", "<html><body><h1>Request headers too large</h1></body></html>");
+        break;
+    case 501:
+        queue_response(conn, "501 Not Implemented", "text/html", "<html><body><h1>Transfer encoding not supported</h1></body></html>");
+        break;
+    default:
+        queue_response(conn, "400 Bad Request", "text/html", "<html><body><h1>Bad Request</h1></body></html>");
+        break;
+    }
+}
+
+/* Build the response for a fully received request into conn->out */
+void handle_request(struct connection *conn) {
+    struct http_request *req = &conn->request;
+    char *method = conn->in + req->method.offset;
+    char *resource = conn->in + req->path.offset;
+    char *query_string = conn->in + req->query.offset;
+    size_t body_end = req->body_start + req->body_len;
+    char next;
+    const struct route *route;
+
+    /* The delimiters after the method, path and query have been parsed, so they can become terminators */
+    method[req->method.length] = '\0';
+    resource[req->path.length] = '\0';
+    query_string[req->query.length] = '\0';
+
+    /* Terminate the body without losing the first byte of a pipelined request */
+    next = conn->in[body_end];
+    conn->in[body_end] = '\0';
+
+    if (LOG_ENABLED(LOG_DEBUG)) {
+        log_msg(LOG_DEBUG, "Received request: Method = %s, Resource = %s, Query String = %s", method, resource, query_string);
+    }
+
+    route = find_route(method, resource);
+    conn->route = route ? route - routes : (int)ROUTE_COUNT;
+    if (route == NULL) {
+        queue_response(conn, "404 Not Found", "text/html", "<html><body><h1>404 Not Found</h1></body></html>");
+    } else if (route->handler) {
+        route->handler(conn, resource, query_string);
+    } else if (query_string[0] != '\0') {
+        handle_page_with_query(conn, route->page, query_string);
+    } else {
+        /* Everything but the Date header was built at startup */
+        out_start(conn, "HTTP/1.1 200 OK\r\n", 17);
+        conn->body = route->response[conn->keep_alive];
+        conn->file_offset = 0;
+        conn->file_remaining = route->response_len[conn->keep_alive];
+    }
+
+    conn->in[body_end] = next;
+}
+
+/* Microseconds on a steady clock, for request latency */
+unsigned long clock_us() {
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (unsigned long)tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
+/* Note what is about to be sent, before the file refills conn->out and hides the status line */
+void response_queued(struct connection *conn) {
+    conn->status = atoi(conn->out + sizeof("HTTP/1.1 ") - 1);
+    conn->response_bytes = conn->out_len + conn->file_remaining + (conn->range_count > 1 ? conn->range_bytes : 0);
+}
+
+/* One access log line per response */
+void log_response(struct connection *conn, unsigned long latency_us) {
+    struct http_request *req = &conn->request;
+    struct access_entry entry;
+    char protocol[16];
+
+    if (access_log_format == ACCESS_LOG_OFF) {
+        return;
+    }
+
+    /*
+     * handle_request() left the method, path and query terminated in place.
+     * A rejected request may have got only part way through its request
+     * line; the connection closes after the error, so cut up what there is.
+     */
+    if (req->status && req->method.length) {
+        conn->in[req->method.offset + req->method.length] = '\0';
+    }
+    if (req->status && req->path.length) {
+        conn->in[req->path.offset + req->path.length] = '\0';
+        conn->in[req->query.offset + req->query.length] = '\0';
+    }
+    if (req->path.length) {
+        sprintf(protocol, "HTTP/1.%d", req->minor_version);
+    } else {
+        strcpy(protocol, "-");
+    }
+
+    entry.remote = conn->remote;
+    entry.port = conn->remote_port;
+    entry.method = req->method.length ? conn->in + req->method.offset : "-";
+    entry.target = req->path.length ? conn->in + req->path.offset : "-";
+    entry.query = req->path.length ? (conn->logged_query ? conn->logged_query : conn->in + req->query.offset) : NULL;
+    entry.protocol = protocol;
+    entry.status = conn->status;
+    entry.bytes = conn->response_bytes;
+    entry.latency_us = latency_us;
+    entry.when = now;
+    log_access(&entry);
+}
+
+/* Count a response once it has been written or given up on */
+void response_finished(struct connection *conn) {
+    unsigned long latency_us = clock_us() - conn->started_us;
+
+    metrics->requests[conn->route][status_slot(conn->status)]++;
+    histogram_record(&metrics->latency[conn->route], latency_us);
+    metrics->response_bytes += conn->response_bytes;
+    log_response(conn, latency_us);
+}
+
+int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1) {
+        return -1;
+    }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/* Register or update the events we want for a connection in its current state */
+void event_watch(struct connection *conn, int add) {
+#ifdef USE_EPOLL
+    struct epoll_event ev;
+    if (epoll_fd == -1) {
+        return;                     /* The ring always has a receive armed and sends when there is output */
+    }
+    ev.events = conn->state == CONN_WRITING ? EPOLLOUT : EPOLLIN;
+    if (!add && ev.events == (unsigned)conn->watched) {
+        return;
+    }
+    ev.data.ptr = conn;
+    if (epoll_ctl(epoll_fd, add ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, conn->fd, &ev) == -1) {
+        perror("epoll_ctl failed");
+    }
+    conn->watched = ev.events;
+#else
+    /* poll() rebuilds its interest set from the connection states on every pass */
+    (void)conn;
+    (void)add;
+#endif
+}
+
+#ifdef HAVE_URING
+static struct uring ring;
+static struct uring_buffers recv_buffers;
+static int free_slots[MAX_CONNECTIONS];     /* Registered file indexes not in use */
+static int free_slot_count = 0;
+static char *stream_memory = NULL;
+static int free_streams[URING_STREAM_BUFFERS];
+static int free_stream_count = 0;
+
+/* A submission for the next pass; the ring is only ever short of room when the kernel has stopped taking them */
+struct io_uring_sqe *ring_sqe(int opcode, int fd, unsigned long user_data) {
+    struct io_uring_sqe *sqe = uring_sqe(&ring, opcode, fd, user_data);
+
+    if (sqe == NULL) {
+        perror("io_uring_enter failed");
+        exit(EXIT_FAILURE);
+    }
+    return sqe;
+}
+
+/* A submission on a connection's registered socket, counted until it completes */
+struct io_uring_sqe *connection_sqe(struct connection *conn, int opcode, int tag) {
+    struct io_uring_sqe *sqe = ring_sqe(opcode, conn->file_index, (unsigned long)conn | tag);
+
+    sqe->flags |= IOSQE_FIXED_FILE;
+    conn->uring_ops++;
+    return sqe;
+}
+
+/* Keep a receive armed; each completion carries one of recv_buffers and says which */
+void ring_recv(struct connection *conn) {
+    struct io_uring_sqe *sqe = connection_sqe(conn, IORING_OP_RECV, URING_RECV);
+
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = recv_buffers.group;
+    conn->recv_armed = 1;
+}
+
+void ring_stream_release(struct connection *conn) {
+    if (conn->stream_index != -1) {
+        free_streams[free_stream_count++] = conn->stream_index;
+        conn->stream_index = -1;
+    }
+    conn->stream_len = 0;
+    conn->stream_sent = 0;
+}
+
+/* The last completion for a closed connection is in: close its socket and file and let the memory go */
+void ring_release(struct connection *conn) {
+    struct io_uring_sqe *sqe = ring_sqe(IORING_OP_CLOSE, 0, (unsigned long)conn->file_index << 3 | URING_SLOT);
+
+    sqe->file_index = conn->file_index + 1;
+    if (conn->file_fd != -1) {
+        close(conn->file_fd);
+    }
+    if (conn->cache_entry) {
+        cache_entry_release(conn->cache_entry);
+    }
+    ring_stream_release(conn);
+    free(conn->spill);
+    free(conn);
+}
+
+/* close_connection() for the ring: shut the socket so the pending receive ends, then wait for the rest */
+void ring_close(struct connection *conn) {
+    struct io_uring_sqe *sqe;
+
+    conn->closed = 1;
+    if (conn->uring_ops == 0) {
+        ring_release(conn);
+        return;
+    }
+    sqe = connection_sqe(conn, IORING_OP_SHUTDOWN, URING_DONE);
+    sqe->len = SHUT_RDWR;
+}
+
+/* Bytes the next file read asks for: a stream buffer's worth, or out[]'s without one */
+size_t ring_chunk(const struct connection *conn) {
+    size_t chunk = conn->stream_index != -1 ? URING_STREAM_BUFFER_SIZE : sizeof(conn->out);
+
+    return (off_t)chunk > conn->file_remaining ? (size_t)conn->file_remaining : chunk;
+}
+
+/* Read the next chunk of the file being served and send it once the read is in, as one linked pair */
+void ring_stream(struct connection *conn) {
+    struct io_uring_sqe *sqe;
+    char *buffer = conn->out;
+    size_t chunk;
+
+    if (conn->stream_index == -1 && free_stream_count > 0) {
+        conn->stream_index = free_streams[--free_stream_count];
+    }
+    if (conn->stream_index != -1) {
+        buffer = stream_memory + (size_t)conn->stream_index * URING_STREAM_BUFFER_SIZE;
+    }
+    chunk = ring_chunk(conn);
+
+    sqe = ring_sqe(conn->stream_index != -1 ? IORING_OP_READ_FIXED : IORING_OP_READ, conn->file_fd, (unsigned long)conn | URING_READ);
+    sqe->addr = (unsigned long)buffer;
+    sqe->len = chunk;
+    sqe->off = conn->file_offset;
+    if (conn->stream_index != -1) {
+        sqe->buf_index = conn->stream_index;
+    }
+    /* A short read breaks the link, so the send only goes if the whole chunk arrived */
+    sqe->flags |= IOSQE_IO_LINK;
+    conn->uring_ops++;
+
+    sqe = connection_sqe(conn, IORING_OP_SEND, URING_SEND);
+    sqe->addr = (unsigned long)buffer;
+    sqe->len = chunk;
+    /* Without Nagle, only the last chunk may leave a short segment */
+    if ((off_t)chunk < conn->file_remaining) {
+        sqe->msg_flags = MSG_MORE;
+    }
+}
+
+/* connection_write() for the ring: queue the next piece of the response; 1 while any of it is in flight */
+int ring_write(struct connection *conn) {
+    struct io_uring_sqe *sqe;
+
+    if (conn->uring_sending) {
+        return 1;
+    }
+    while (1) {
+        if (conn->out_sent < conn->out_len) {
+            if (conn->body && conn->file_remaining > 0) {
+                /* Header and in-memory body leave together */
+                conn->iov[0].iov_base = conn->out + conn->out_sent;
+                conn->iov[0].iov_len = conn->out_len - conn->out_sent;
+                conn->iov[1].iov_base = (char *)conn->body + conn->file_offset;
+                conn->iov[1].iov_len = conn->file_remaining;
+                sqe = connection_sqe(conn, IORING_OP_WRITEV, URING_SEND);
+                sqe->addr = (unsigned long)conn->iov;
+                sqe->len = 2;
+            } else {
+                sqe = connection_sqe(conn, IORING_OP_SEND, URING_SEND);
+                sqe->addr = (unsigned long)(conn->out + conn->out_sent);
+                sqe->len = conn->out_len - conn->out_sent;
+                /* Hold a header back until the file can join it in the same segment */
+                if (conn->file_fd != -1 && conn->file_remaining > 0) {
+                    sqe->msg_flags = MSG_MORE;
+                }
+            }
+            break;
+        }
+        if (conn->stream_sent < conn->stream_len) {
+            sqe = connection_sqe(conn, IORING_OP_SEND, URING_SEND);
+            sqe->addr = (unsigned long)(stream_memory + (size_t)conn->stream_index * URING_STREAM_BUFFER_SIZE + conn->stream_sent);
+            sqe->len = conn->stream_len - conn->stream_sent;
+            break;
+        }
+        if (conn->body) {
+            if (conn->file_remaining == 0) {
+                if (range_part_next(conn)) {
+                    continue;
+                }
+                if (conn->cache_entry) {
+                    cache_entry_release(conn->cache_entry);
+                    conn->cache_entry = NULL;
+                }
+                conn->body = NULL;
+                return 0;
+            }
+            sqe = connection_sqe(conn, IORING_OP_SEND, URING_SEND);
+            sqe->addr = (unsigned long)(conn->body + conn->file_offset);
+            sqe->len = conn->file_remaining;
+            break;
+        }
+        if (conn->file_fd == -1) {
+            return 0;
+        }
+        if (conn->file_remaining == 0) {
+            if (range_part_next(conn)) {
+                continue;
+            }
+            close(conn->file_fd);
+            conn->file_fd = -1;
+            ring_stream_release(conn);
+            return 0;
+        }
+        ring_stream(conn);
+        break;
+    }
+    conn->uring_sending = 1;
+    return 1;
+}
+
+/* A send has completed: account for what went, in the order ring_write() queued it */
+void ring_sent(struct connection *conn, int res) {
+    size_t sent = res > 0 ? (size_t)res : 0;
+
+    conn->uring_sending = 0;
+    if (res < 0) {
+        conn->state = CONN_CLOSING;
+        return;
+    }
+    conn->last_active = now;
+    if (conn->out_sent < conn->out_len) {
+        size_t header = conn->out_len - conn->out_sent;
+
+        if (sent <= header) {
+            conn->out_sent += sent;
+            return;
+        }
+        conn->out_sent = conn->out_len;
+        sent -= header;
+    }
+    if (conn->stream_sent < conn->stream_len) {
+        conn->stream_sent += sent;
+    } else {
+        conn->file_offset += sent;
+        conn->file_remaining -= sent;
+    }
+}
+
+/* A file chunk is in: it is what the linked send goes out with */
+void ring_read(struct connection *conn, int res) {
+    if (res < 0 || (size_t)res != ring_chunk(conn)) {
+        /* The file shrank under us; the send is cancelled and its completion closes the connection */
+        conn->state = CONN_CLOSING;
+        return;
+    }
+    if (conn->stream_index != -1) {
+        conn->stream_len = res;
+        conn->stream_sent = 0;
+    } else {
+        conn->out_len = res;
+        conn->out_sent = 0;
+    }
+    conn->file_offset += res;
+    conn->file_remaining -= res;
+}
+
+/* Received bytes go to in[] while it has room and queue behind it after; -1 if there's no memory */
+int ring_take(struct connection *conn, const char *data, size_t length) {
+    if (conn->spill_len == 0) {
+        size_t room = sizeof(conn->in) - 1 - conn->in_len;
+        size_t copy = length < room ? length : room;
+
+        memcpy(conn->in + conn->in_len, data, copy);
+        conn->in_len += copy;
+        conn->in[conn->in_len] = '\0';
+        data += copy;
+        length -= copy;
+    }
+    if (length > 0) {
+        char *spill = realloc(conn->spill, conn->spill_len + length);
+        if (spill == NULL) {
+            return -1;
+        }
+        memcpy(spill + conn->spill_len, data, length);
+        conn->spill = spill;
+        conn->spill_len += length;
+    }
+    return 0;
+}
+
+/* Move bytes held back into the room connection_reset() has made in in[] */
+void ring_unspill(struct connection *conn) {
+    size_t room = sizeof(conn->in) - 1 - conn->in_len;
+    size_t copy = conn->spill_len < room ? conn->spill_len : room;
+
+    memcpy(conn->in + conn->in_len, conn->spill, copy);
+    conn->in_len += copy;
+    conn->in[conn->in_len] = '\0';
+    conn->spill_len -= copy;
+    if (conn->spill_len) {
+        memmove(conn->spill, conn->spill + copy, conn->spill_len);
+    } else {
+        free(conn->spill);
+        conn->spill = NULL;
+    }
+
+    if (conn->recv_paused && conn->spill_len < URING_SPILL_MAX / 2) {
+        conn->recv_paused = 0;
+        if (!conn->recv_armed) {
+            ring_recv(conn);
+        }
+    }
+}
+#endif
+
+void close_connection(struct connection *conn) {
+    struct connection *last;
 
-/* Function to determine the content based on the requested resource*/
-const char* get_content_for_resource(const char *resource) {
-    if (strcmp(resource, "/") == 0) {
-        return "<html><body><h1>Home Page</h1>"
-               "<form action=\"/submit\" method=\"POST\">"
-               "Name: <input type=\"text\" name=\"name\"><br>"
-               "<input type=\"submit\" value=\"Submit\">"
-               "</form></body></html>";
-    } else if (strcmp(resource, "/about") == 0) {
-        return "<html><body><h1>About Page</h1></body></html>";
-    } else if (strcmp(resource, "/contact") == 0) {
-        return "<html><body><h1>Contact Page</h1></body></html>";
-    } else {
-        return NULL;  /* Return NULL to indicate that the resource should be served from a file or dynamically generated */
+#ifdef USE_EPOLL
+    if (epoll_fd != -1) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    }
+#endif
+    arena_reset(&conn->arena);
+    metrics->connections_active--;
+
+    /* Swap the last connection into the freed slot */
+    last = connections[--connection_count];
+    connections[conn->slot] = last;
+    last->slot = conn->slot;
+
+#ifdef HAVE_URING
+    if (use_uring) {
+        /* Queued reads and sends may still name its file or cached body, so the ring frees them once they are in */
+        ring_close(conn);
+        return;
+    }
+#endif
+    if (conn->file_fd != -1) {
+        close(conn->file_fd);
+    }
+    if (conn->cache_entry) {
+        cache_entry_release(conn->cache_entry);
+    }
+    close(conn->fd);
+    free(conn);
+}
+
+/* Copy file bytes to the socket without a trip through user space; same return values as connection_write */
+#ifdef USE_SENDFILE
+int connection_sendfile(struct connection *conn) {
+    while (conn->file_remaining > 0) {
+        ssize_t bytes_sent = sendfile(conn->fd, conn->file_fd, &conn->file_offset, conn->file_remaining);
+        if (bytes_sent > 0) {
+            conn->file_remaining -= bytes_sent;
+            conn->last_active = now;
+            continue;
+        }
+        if (bytes_sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 1;
+        }
+        if (bytes_sent == -1 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_sent == -1 && (errno == EINVAL || errno == ENOSYS)) {
+            /* Not supported for this file; carry on with read()/write() from where we are */
+            conn->use_sendfile = 0;
+            if (lseek(conn->file_fd, conn->file_offset, SEEK_SET) == -1) {
+                conn->state = CONN_CLOSING;
+                return 0;
+            }
+            return 2;
+        }
+        /* The file shrank under us or the peer went away; the promised length can't be met */
+        conn->state = CONN_CLOSING;
+        return 0;
     }
+    return 0;
 }
+#endif
+
+/* Flush pending output; returns 1 while the response is still in flight */
+int connection_write(struct connection *conn) {
+#ifdef HAVE_URING
+    if (use_uring) {
+        return ring_write(conn);
+    }
+#endif
+    while (1) {
+        const char *data;
+        size_t length;
+        int more;
+        int vectored = 0;
+        ssize_t bytes_written;
 
-/* Function to parse query strings */
-void parse_query_string(char *query_string, char params[][2][BUFFER_SIZE], int *param_count) {
-    char *start = query_string;
-    *param_count = 0;
+        if (conn->out_sent < conn->out_len) {
+            data = conn->out + conn->out_sent;
+            length = conn->out_len - conn->out_sent;
+            more = (conn->file_fd != -1 || conn->body) && conn->file_remaining > 0;
+        } else if (conn->body) {
+            if (conn->file_remaining == 0) {
+                if (range_part_next(conn)) {
+                    continue;
+                }
+                if (conn->cache_entry) {
+                    cache_entry_release(conn->cache_entry);
+                    conn->cache_entry = NULL;
+                }
+                conn->body = NULL;
+                return 0;
+            }
+            /* Cached files and static routes go straight from their shared buffer to the socket */
+            data = conn->body + conn->file_offset;
+            length = conn->file_remaining;
+            more = 0;
+        } else if (conn->file_fd == -1) {
+            return 0;
+        } else {
+            ssize_t bytes_read;
+            size_t chunk = sizeof(conn->out);
 
-    while (start && *start) {
-        char *eq = strchr(start, '=');
-        char *amp = strchr(start, '&');
+#ifdef USE_SENDFILE
+            if (conn->use_sendfile) {
+                int pending = connection_sendfile(conn);
+                if (pending == 0 && conn->state == CONN_WRITING && range_part_next(conn)) {
+                    continue;
+                }
+                if (pending != 2) {
+                    if (pending == 0) {
+                        close(conn->file_fd);
+                        conn->file_fd = -1;
+                    }
+                    return pending;
+                }
+            }
+#endif
 
-        if (eq) {
-            int key_len = eq - start;
-            int value_len = amp ? amp - eq - 1 : strlen(eq + 1);
+            if (conn->file_remaining == 0) {
+                if (range_part_next(conn)) {
+                    continue;
+                }
+                close(conn->file_fd);
+                conn->file_fd = -1;
+                return 0;
+            }
 
-            strncpy(params[*param_count][0], start, key_len);
-            params[*param_count][0][key_len] = '\0';
-            strncpy(params[*param_count][1], eq + 1, value_len);
-            params[*param_count][1][value_len] = '\0';
+            /* Refill the output buffer from the file being served */
+            if ((off_t)chunk > conn->file_remaining) {
+                chunk = conn->file_remaining;
+            }
+            bytes_read = read(conn->file_fd, conn->out, chunk);
+            if (bytes_read <= 0) {
+                if (bytes_read == -1) {
+                    perror("Error reading file");
+                }
+                /* The file shrank under us; the promised length can't be met */
+                conn->state = CONN_CLOSING;
+                return 0;
+            }
+            conn->out_len = bytes_read;
+            conn->out_sent = 0;
+            conn->file_offset += bytes_read;
+            conn->file_remaining -= bytes_read;
+            continue;
+        }
 
-            (*param_count)++;
+#ifdef USE_WRITEV
+        if (data == conn->out + conn->out_sent && conn->body && conn->file_remaining > 0) {
+            /* Header and in-memory body leave in one system call */
+            struct iovec iov[2];
+            iov[0].iov_base = (char *)data;
+            iov[0].iov_len = length;
+            iov[1].iov_base = (char *)conn->body + conn->file_offset;
+            iov[1].iov_len = conn->file_remaining;
+            bytes_written = writev(conn->fd, iov, 2);
+            if (bytes_written > (ssize_t)length) {
+                conn->out_sent = conn->out_len;
+                conn->file_offset += bytes_written - length;
+                conn->file_remaining -= bytes_written - length;
+                conn->last_active = now;
+                continue;
+            }
+            vectored = 1;   /* Short of the header; account for it below */
+        }
+#endif
+        if (!vectored) {
+#ifdef MSG_MORE
+            /* Hold a header back until the body can join it in the same segment */
+            bytes_written = send(conn->fd, data, length, more ? MSG_MORE : 0);
+#else
+            bytes_written = write(conn->fd, data, length);
+#endif
+        }
+        if (bytes_written == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 1;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            conn->state = CONN_CLOSING;
+            return 0;
+        }
+        if (conn->out_sent < conn->out_len) {
+            conn->out_sent += bytes_written;
+        } else {
+            conn->file_offset += bytes_written;
+            conn->file_remaining -= bytes_written;
         }
+        conn->last_active = now;
+    }
+}
+
+/* Find a request header by name; returns its value, which is not NUL-terminated */
+const char *find_header(const struct connection *conn, const char *name, size_t *value_len) {
+    return http_find_header(&conn->request, conn->in, name, value_len);
+}
+
+/* HTTP/1.1 connections persist unless the client says otherwise; HTTP/1.0 ones must ask */
+int request_wants_keep_alive(const struct connection *conn) {
+    const char *value;
+    size_t value_len;
+    int keep_alive = conn->request.minor_version >= 1;
 
-        start = amp ? amp + 1 : NULL;
+    value = find_header(conn, "Connection", &value_len);
+    if (value && value_len == 5 && strncasecmp(value, "close", 5) == 0) {
+        keep_alive = 0;
+    } else if (value && value_len == 10 && strncasecmp(value, "keep-alive", 10) == 0) {
+        keep_alive = 1;
     }
+    return keep_alive;
 }
 
-const char* handle_form_submission(const char *data) {
-    static char response[BUFFER_SIZE];
-    char name[BUFFER_SIZE];
+/* Drop the request just answered and make any pipelined bytes behind it the new buffer */
+void connection_reset(struct connection *conn) {
+    size_t consumed = conn->request.consumed;
 
-    /* Simple parsing: find the value for the "name" field */
-    if (sscanf(data, "name=%s", name) == 1) {
-/*         Replace '+' with ' ' in the name (HTTP encoding)
-        char *p;
-        for (*p = name; *p; ++p) {
-            if (*p == '+') *p = ' ';
-        } */
+    memmove(conn->in, conn->in + consumed, conn->in_len - consumed);
+    conn->in_len -= consumed;
+    conn->in[conn->in_len] = '\0';
+    http_request_init(&conn->request, MAX_HEADER_SIZE, MAX_BODY_SIZE);
+    conn->out_len = 0;
+    conn->out_sent = 0;
+    conn->range_count = 0;
+    conn->logged_query = NULL;
+    arena_reset(&conn->arena);
+    conn->state = CONN_READING_HEADERS;
+#ifdef HAVE_URING
+    if (conn->spill_len) {
+        ring_unspill(conn);
+    }
+#endif
 
-        int i;
-        for (i = 0; name[i] != '\0'; i++) {
-        if (name[i] == '+') {
-            name[i] = ' ';
+    /* A pipelined request has been waiting since it was read */
+    if (conn->in_len) {
+        conn->started_us = clock_us();
+    }
+}
+
+/* Move a connection forward as far as it can go without blocking */
+void connection_advance(struct connection *conn) {
+    while (1) {
+        switch (conn->state) {
+        case CONN_READING_HEADERS:
+        case CONN_READING_BODY: {
+            int result = http_parse(&conn->request, conn->in, conn->in_len);
+
+            if (result == HTTP_PARSE_INCOMPLETE && conn->in_len >= sizeof(conn->in) - 1) {
+                /* Whatever is left doesn't fit in the buffer */
+                conn->request.status = conn->request.header_len ? 413 : 431;
+                result = HTTP_PARSE_ERROR;
+            }
+
+            if (result == HTTP_PARSE_ERROR) {
+                conn->keep_alive = 0;
+                queue_error_response(conn, conn->request.status);
+                conn->route = ROUTE_COUNT;
+                response_queued(conn);
+                conn->state = CONN_WRITING;
+                break;
+            }
+
+            if (result == HTTP_PARSE_INCOMPLETE) {
+                if (conn->request.header_len) {
+                    conn->state = CONN_READING_BODY;
+                }
+#ifdef HAVE_URING
+                /* The ring hears of end of file early; like read(), act on it once what came before is used up */
+                conn->eof = conn->eof || conn->fin;
+#endif
+                if (conn->eof) {
+                    conn->state = CONN_CLOSING;
+                    break;
+                }
+                event_watch(conn, 0);
+                return;
+            }
+
+            conn->keep_alive = !conn->eof && conn->requests_served + 1 < KEEPALIVE_MAX_REQUESTS && request_wants_keep_alive(conn);
+            handle_request(conn);
+            response_queued(conn);
+            conn->requests_served++;
+            conn->state = CONN_WRITING;
+            break;
+        }
+        case CONN_WRITING:
+            if (connection_write(conn)) {
+                event_watch(conn, 0);
+                return;
+            }
+            response_finished(conn);
+            if (conn->state != CONN_WRITING) {
+                break;
+            }
+            if (conn->keep_alive) {
+                connection_reset(conn);
+            } else {
+                conn->state = CONN_CLOSING;
+            }
+            break;
+        case CONN_CLOSING:
+        default:
+            close_connection(conn);
+            return;
         }
     }
-        snprintf(response, BUFFER_SIZE, "<html><body><h1>Hello, %s!</h1></body></html>", name);
+}
+
+void connection_read(struct connection *conn) {
+    size_t had = conn->in_len;
+
+    while (conn->in_len < sizeof(conn->in) - 1) {
+        ssize_t valread = read(conn->fd, conn->in + conn->in_len, sizeof(conn->in) - 1 - conn->in_len);
+        if (valread == 0) {
+            /* Requests already buffered are still answered before closing */
+            conn->eof = 1;
+            break;
+        }
+        if (valread == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                conn->state = CONN_CLOSING;
+            }
+            break;
+        }
+        conn->in_len += valread;
+        conn->last_active = now;
+    }
+    conn->in[conn->in_len] = '\0';  /* Null-terminate the request */
+    if (had == 0 && conn->in_len > 0) {
+        conn->started_us = clock_us();
+    }
+    connection_advance(conn);
+}
+
+/* Close connections that have made no progress within the keep-alive timeout */
+void close_idle_connections() {
+    int i;
+
+    for (i = connection_count - 1; i >= 0; i--) {
+        if (now - connections[i]->last_active >= KEEPALIVE_TIMEOUT) {
+            close_connection(connections[i]);
+        }
+    }
+}
+
+/* Start a connection on a socket just accepted; NULL if there is no memory for it */
+struct connection *connection_new(int fd, const struct sockaddr_in *peer) {
+    struct connection *conn = malloc(sizeof(*conn));
+
+    if (conn == NULL) {
+        return NULL;
+    }
+    conn->fd = fd;
+    metrics->connections_accepted++;
+    metrics->connections_active++;
+    if (peer) {
+        inet_ntop(AF_INET, &peer->sin_addr, conn->remote, sizeof(conn->remote));
+        conn->remote_port = ntohs(peer->sin_port);
     } else {
-        snprintf(response, BUFFER_SIZE, "<html><body><h1>Error in submission</h1></body></html>");
+        strcpy(conn->remote, "-");
+        conn->remote_port = 0;
     }
+    conn->started_us = 0;
+    conn->status = 0;
+    conn->route = ROUTE_COUNT;
+    conn->response_bytes = 0;
+    conn->state = CONN_READING_HEADERS;
+    conn->in_len = 0;
+    conn->in[0] = '\0';
+    http_request_init(&conn->request, MAX_HEADER_SIZE, MAX_BODY_SIZE);
+    conn->out_len = 0;
+    conn->out_sent = 0;
+    conn->file_fd = -1;
+    conn->file_offset = 0;
+    conn->file_remaining = 0;
+    conn->body = NULL;
+    conn->cache_entry = NULL;
+    conn->arena.blocks = NULL;
+    conn->arena.used = 0;
+    conn->logged_query = NULL;
+    conn->range_count = 0;
+#ifdef USE_SENDFILE
+    conn->use_sendfile = !use_uring;
+#else
+    conn->use_sendfile = 0;
+#endif
+#ifdef HAVE_URING
+    conn->file_index = -1;
+    conn->uring_ops = 0;
+    conn->uring_sending = 0;
+    conn->closed = 0;
+    conn->recv_armed = 0;
+    conn->recv_paused = 0;
+    conn->fin = 0;
+    conn->spill = NULL;
+    conn->spill_len = 0;
+    conn->stream_index = -1;
+    conn->stream_len = 0;
+    conn->stream_sent = 0;
+#endif
+    conn->watched = 0;
+    conn->keep_alive = 0;
+    conn->eof = 0;
+    conn->requests_served = 0;
+    conn->last_active = now;
+    conn->slot = connection_count;
+    connections[connection_count++] = conn;
+    return conn;
+}
 
-    return response;
+void accept_connections(int server_fd) {
+    while (1) {
+        struct connection *conn;
+        struct sockaddr_in peer;
+        socklen_t peer_len = sizeof(peer);
+        int new_socket = accept(server_fd, (struct sockaddr *)&peer, &peer_len);
+
+        if (new_socket < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("Accept failed");
+            }
+            return;
+        }
+
+        if (connection_count >= MAX_CONNECTIONS || set_nonblocking(new_socket) == -1) {
+            close(new_socket);
+            continue;
+        }
+
+        conn = connection_new(new_socket, &peer);
+        if (conn == NULL) {
+            close(new_socket);
+            continue;
+        }
+        event_watch(conn, 1);
+    }
 }
 
-int serve_file_from_disk(const char *filepath, int client_socket) {
-    struct stat file_stat;
-    char header[BUFFER_SIZE];
-    char file_buffer[BUFFER_SIZE];
-    ssize_t bytes_read;
+#ifdef HAVE_URING
+void ring_accept(int server_fd) {
+    struct io_uring_sqe *sqe = ring_sqe(IORING_OP_ACCEPT, server_fd, URING_ACCEPT);
 
-    int file_fd = open(filepath, O_RDONLY);
-    if (file_fd == -1) {
-        perror("Error opening file");
-        return -1;  /*  File not found or error */
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+}
+
+/* Take on a socket from the multishot accept: register it, close its descriptor and start receiving, linked */
+void ring_accepted(int fd) {
+    struct connection *conn;
+    struct sockaddr_in peer;
+    socklen_t peer_len = sizeof(peer);
+    int have_peer;
+    int one = 1;
+    struct io_uring_sqe *sqe;
+
+    if (connection_count >= MAX_CONNECTIONS || free_slot_count == 0) {
+        close(fd);
+        return;
     }
+    /* Completions of a multishot accept have nowhere to put the address, and only the access log wants it */
+    have_peer = access_log_format != ACCESS_LOG_OFF && getpeername(fd, (struct sockaddr *)&peer, &peer_len) == 0;
+    conn = connection_new(fd, have_peer ? &peer : NULL);
+    if (conn == NULL) {
+        close(fd);
+        return;
+    }
+    conn->file_index = free_slots[--free_slot_count];
+    /* Files go out a chunk per send, and Nagle would hold each chunk's tail for the client's delayed ACK */
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
 
-    if (fstat(file_fd, &file_stat) == -1) {
-        perror("Error getting file size");
-        close(file_fd);
-        return -1;
+    sqe = ring_sqe(IORING_OP_FILES_UPDATE, -1, (unsigned long)conn | URING_REGISTER);
+    sqe->addr = (unsigned long)&conn->fd;
+    sqe->len = 1;
+    sqe->off = conn->file_index;
+    sqe->flags |= IOSQE_IO_LINK;
+    sqe = ring_sqe(IORING_OP_CLOSE, fd, (unsigned long)conn | URING_DONE);
+    sqe->flags |= IOSQE_IO_LINK;
+    conn->uring_ops += 2;
+    ring_recv(conn);
+}
+
+/* connection_read() for the ring: res bytes arrived in a provided buffer, or the receive ended */
+void ring_received(struct connection *conn, int res, unsigned flags) {
+    size_t had = conn->in_len;
+
+    if (res > 0) {
+        unsigned bid = flags >> IORING_CQE_BUFFER_SHIFT;
+
+        if (ring_take(conn, uring_buffer(&recv_buffers, bid), res) == -1) {
+            conn->state = CONN_CLOSING;
+        }
+        uring_buffer_recycle(&recv_buffers, bid);
+        conn->last_active = now;
+    } else if (res == 0) {
+        conn->fin = 1;
+    } else if (res != -ENOBUFS && res != -ECANCELED) {
+        /* Cancelled is a pause, or a registration that failed, and then receiving again fails for good */
+        conn->state = CONN_CLOSING;
     }
 
-    /* Create the HTTP header */
+    if (!(flags & IORING_CQE_F_MORE)) {
+        conn->recv_armed = 0;
+    }
+    if (conn->recv_armed && !conn->recv_paused && conn->spill_len > URING_SPILL_MAX) {
+        /* The client is running ahead; stop taking its bytes so TCP holds it back */
+        struct io_uring_sqe *sqe = ring_sqe(IORING_OP_ASYNC_CANCEL, -1, (unsigned long)conn | URING_DONE);
 
-    snprintf(header, BUFFER_SIZE, "HTTP/1.1 200 OK\nContent-Type: text/plain\nContent-Length: %ld\n\n", file_stat.st_size);
-    write(client_socket, header, strlen(header));
+        sqe->addr = (unsigned long)conn | URING_RECV;
+        conn->uring_ops++;
+        conn->recv_paused = 1;
+    }
+    /* A multishot receive can also stop short of end of file, when every buffer is taken for one */
+    if (!conn->recv_armed && !conn->recv_paused && res != 0 && conn->state != CONN_CLOSING) {
+        ring_recv(conn);
+    }
+    if (had == 0 && conn->in_len > 0) {
+        conn->started_us = clock_us();
+    }
+    /* Pipelined bytes wait in in[] while a response is in flight; its last send moves things on */
+    if (conn->state != CONN_WRITING) {
+        connection_advance(conn);
+    }
+}
 
-    /* Read the file contents in chunks and send to client */
+void ring_complete(int server_fd, const struct io_uring_cqe *cqe) {
+    unsigned long data = (unsigned long)cqe->user_data;
+    int tag = data & URING_TAG_MASK;
+    struct connection *conn = (struct connection *)(data & ~(unsigned long)URING_TAG_MASK);
 
-    while ((bytes_read = read(file_fd, file_buffer, BUFFER_SIZE)) > 0) {
-        write(client_socket, file_buffer, bytes_read);
+    if (tag == URING_ACCEPT) {
+        if (cqe->res >= 0) {
+            ring_accepted(cqe->res);
+        } else if (cqe->res != -EAGAIN && cqe->res != -EINTR) {
+            errno = -cqe->res;
+            perror("Accept failed");
+        }
+        if (!(cqe->flags & IORING_CQE_F_MORE)) {
+            ring_accept(server_fd);
+        }
+        return;
+    }
+    if (tag == URING_SLOT) {
+        free_slots[free_slot_count++] = data >> 3;
+        return;
     }
 
-    if (bytes_read == -1) {
-        perror("Error reading file");
-        close(file_fd);
-        return -1;
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        conn->uring_ops--;
+    }
+    if (conn->closed) {
+        if (tag == URING_RECV && cqe->res > 0) {
+            uring_buffer_recycle(&recv_buffers, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        }
+        if (conn->uring_ops == 0) {
+            ring_release(conn);
+        }
+        return;
     }
 
-    close(file_fd);
-    return 0;  /* Success */
+    switch (tag) {
+    case URING_REGISTER:
+        if (cqe->res < 0) {
+            /* The close and receive linked behind it are cancelled; the receive's completion closes the connection */
+            close(conn->fd);
+        }
+        break;
+    case URING_RECV:
+        ring_received(conn, cqe->res, cqe->flags);
+        break;
+    case URING_SEND:
+        ring_sent(conn, cqe->res);
+        connection_advance(conn);
+        break;
+    case URING_READ:
+        ring_read(conn, cqe->res);
+        break;
+    default:
+        break;
+    }
 }
 
-const char* generate_dynamic_content() {
-    static char dynamic_content[BUFFER_SIZE];
+/*
+ * The event loop on io_uring: one io_uring_enter() per pass both submits
+ * what the last pass queued and waits for completions. Sockets sit in the
+ * registered file table and receive into provided buffers.
+ */
+void run_ring_loop(int server_fd) {
+    time_t last_sweep = 0;
 
-    time_t now = time(NULL);
-    struct tm *t = localtime(&now);
+    ring_accept(server_fd);
+    while (1) {
+        struct io_uring_cqe *cqe;
 
-    int random_number = rand() % 100;
+        if (uring_submit(&ring, 1, 1000) == -1) {
+            perror("io_uring_enter failed");
+            exit(EXIT_FAILURE);
+        }
 
-    snprintf(dynamic_content, BUFFER_SIZE,
-             "<html><body><h1>Dynamic Content</h1>"
-             "<p>Current Date and Time: %02d-%02d-%04d %02d:%02d:%02d</p>"
-             "<p>Random Number: %d</p>"
-             "</body></html>",
-             t->tm_mday, t->tm_mon + 1, t->tm_year + 1900,
-             t->tm_hour, t->tm_min, t->tm_sec,
-             random_number);
+        now = time(NULL);
+        if (now != last_sweep) {
+            close_idle_connections();
+            last_sweep = now;
+        }
+        if (cache_stats_requested) {
+            cache_stats_requested = 0;
+            print_cache_stats();
+        }
 
-    return dynamic_content;
+        while ((cqe = uring_cqe(&ring)) != NULL) {
+            struct io_uring_cqe done = *cqe;
+
+            uring_cqe_seen(&ring);
+            ring_complete(server_fd, &done);
+        }
+    }
 }
 
-int main() {
-    int server_fd, new_socket;
-    struct sockaddr_in address;
-    /* int addrlen = sizeof(address); */
-    char buffer[BUFFER_SIZE];
-    /* HTTP response header */
-    char response[BUFFER_SIZE];
+/* Set up this process's ring; -1 with errno set if the kernel won't */
+int ring_start() {
+    static struct iovec iov[URING_STREAM_BUFFERS];
+    int i;
+
+    if (uring_init(&ring, URING_ENTRIES) == -1) {
+        return -1;
+    }
+    if (uring_register_files(&ring, MAX_CONNECTIONS) == -1 ||
+        uring_buffers_init(&ring, &recv_buffers, 0, URING_RECV_BUFFERS, URING_RECV_BUFFER_SIZE) == -1) {
+        int saved = errno;
+
+        uring_free(&ring);
+        errno = saved;
+        return -1;
+    }
+    for (i = 0; i < MAX_CONNECTIONS; i++) {
+        free_slots[i] = MAX_CONNECTIONS - 1 - i;
+    }
+    free_slot_count = MAX_CONNECTIONS;
+
+    /* Large files are read into pinned buffers if the locked memory limit allows it, else through out[] */
+    stream_memory = malloc((size_t)URING_STREAM_BUFFERS * URING_STREAM_BUFFER_SIZE);
+    if (stream_memory == NULL) {
+        return 0;
+    }
+    for (i = 0; i < URING_STREAM_BUFFERS; i++) {
+        iov[i].iov_base = stream_memory + (size_t)i * URING_STREAM_BUFFER_SIZE;
+        iov[i].iov_len = URING_STREAM_BUFFER_SIZE;
+    }
+    if (uring_register_buffers(&ring, iov, URING_STREAM_BUFFERS) == -1) {
+        log_msg(LOG_DEBUG, "Registering io_uring buffers failed: %s", strerror(errno));
+        free(stream_memory);
+        stream_memory = NULL;
+        return 0;
+    }
+    for (i = 0; i < URING_STREAM_BUFFERS; i++) {
+        free_streams[i] = URING_STREAM_BUFFERS - 1 - i;
+    }
+    free_stream_count = URING_STREAM_BUFFERS;
+    return 0;
+}
+#endif
+
+/* With --io-uring the ring's loop takes over if this process can have one; returns if not */
+void run_ring_loop_if_wanted(int server_fd) {
+    if (!use_uring) {
+        return;
+    }
+#ifdef HAVE_URING
+    if (ring_start() == 0) {
+        run_ring_loop(server_fd);   /* Doesn't return */
+    }
+    log_msg(LOG_WARN, "io_uring unavailable (%s), falling back", strerror(errno));
+#else
+    (void)server_fd;
+    log_msg(LOG_WARN, "Built without io_uring, falling back");
+#endif
+    use_uring = 0;
+}
+
+void run_event_loop(int server_fd) {
+    time_t last_sweep = 0;
+#ifdef USE_EPOLL
+    struct epoll_event events[MAX_EVENTS];
+    struct epoll_event ev;
+
+    run_ring_loop_if_wanted(server_fd);
+    if ((epoll_fd = epoll_create(MAX_EVENTS)) == -1) {
+        perror("epoll_create failed");
+        exit(EXIT_FAILURE);
+    }
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;  /* NULL marks the listening socket */
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_fd, &ev) == -1) {
+        perror("epoll_ctl failed");
+        exit(EXIT_FAILURE);
+    }
+
+    while (1) {
+        int i;
+        int ready = epoll_wait(epoll_fd, events, MAX_EVENTS, 1000);
+        if (ready == -1) {
+            if (errno != EINTR) {
+                perror("epoll_wait failed");
+            }
+            continue;
+        }
+
+        now = time(NULL);
+
+        /* Connections are only ever freed from their own event, so the rest of events[] stays valid; the sweep waits until after */
+        for (i = 0; i < ready; i++) {
+            struct connection *conn = events[i].data.ptr;
+            if (conn == NULL) {
+                accept_connections(server_fd);
+            } else if (conn->state == CONN_WRITING) {
+                connection_advance(conn);
+            } else {
+                connection_read(conn);
+            }
+        }
+
+        if (now != last_sweep) {
+            close_idle_connections();
+            last_sweep = now;
+        }
+        if (cache_stats_requested) {
+            cache_stats_requested = 0;
+            print_cache_stats();
+        }
+    }
+#else
+    static struct pollfd pollfds[MAX_CONNECTIONS + 1];
+    static struct connection *polled[MAX_CONNECTIONS + 1];
+
+    run_ring_loop_if_wanted(server_fd);
+    while (1) {
+        int i, count, ready;
+
+        pollfds[0].fd = server_fd;
+        pollfds[0].events = POLLIN;
+        count = 1;
+        for (i = 0; i < connection_count; i++) {
+            pollfds[count].fd = connections[i]->fd;
+            pollfds[count].events = connections[i]->state == CONN_WRITING ? POLLOUT : POLLIN;
+            polled[count] = connections[i];
+            count++;
+        }
+
+        ready = poll(pollfds, count, 1000);
+        if (ready == -1) {
+            if (errno != EINTR) {
+                perror("poll failed");
+            }
+            continue;
+        }
+
+        now = time(NULL);
+
+        /* Connections are only ever freed from their own entry, so the snapshot stays valid */
+        for (i = 1; i < count; i++) {
+            if (pollfds[i].revents == 0) {
+                continue;
+            }
+            if (polled[i]->state == CONN_WRITING) {
+                connection_advance(polled[i]);
+            } else {
+                connection_read(polled[i]);
+            }
+        }
+        if (pollfds[0].revents & POLLIN) {
+            accept_connections(server_fd);
+        }
 
-    memset(buffer, 0, sizeof(buffer));
+        if (now != last_sweep) {
+            close_idle_connections();
+            last_sweep = now;
+        }
+        if (cache_stats_requested) {
+            cache_stats_requested = 0;
+            print_cache_stats();
+        }
+    }
+#endif
+}
 
-    srand(time(NULL));
+/* Bind a listening socket; with reuse_port each worker gets its own and the kernel spreads connections */
+int create_listener(int backlog, int reuse_port) {
+    int server_fd;
+    int opt = 1;
+    struct sockaddr_in address;
 
-    if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
+    if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
         perror("Socket failed");
         exit(EXIT_FAILURE);
     }
 
+    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+#ifdef SO_REUSEPORT
+    if (reuse_port && setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) == -1) {
+        perror("SO_REUSEPORT failed");
+        close(server_fd);
+        exit(EXIT_FAILURE);
+    }
+#else
+    (void)reuse_port;
+#endif
+
+    memset(&address, 0, sizeof(address));
     address.sin_family = AF_INET;
     address.sin_addr.s_addr = INADDR_ANY;
     address.sin_port = htons(PORT);
@@ -169,118 +2802,209 @@ int main() {
         exit(EXIT_FAILURE);
     }
 
-    if (listen(server_fd, 3) < 0) {
+    if (listen(server_fd, backlog) < 0) {
         perror("Listen failed");
         close(server_fd);
         exit(EXIT_FAILURE);
     }
 
-    printf("Server v2 is listening on port %d\n", PORT);
+    if (set_nonblocking(server_fd) == -1) {
+        perror("Failed to make listening socket non-blocking");
+        close(server_fd);
+        exit(EXIT_FAILURE);
+    }
 
-    while (1) {
-        int valread;
-        char method[16], resource[256], query_string[BUFFER_SIZE];
-        char *query_start;
-        struct sockaddr_in client_address;
-        socklen_t client_len;
+    return server_fd;
+}
 
-        client_len = sizeof(client_address);
-        memset(query_string, 0, sizeof(query_string));
+void pin_to_cpu(int worker) {
+#ifdef __linux__
+    cpu_set_t cpus;
+    long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
 
-        /* if ((new_socket = accept(server_fd, (struct sockaddr *)&client_address, (socklen_t*)&client_len)) < 0) {*/
-        if ((new_socket = accept(server_fd, NULL, NULL)) < 0) {
-            perror("Accept failed");
-            close(server_fd);
-            exit(EXIT_FAILURE);
+    CPU_ZERO(&cpus);
+    CPU_SET(worker % (cpu_count > 0 ? cpu_count : 1), &cpus);
+    if (sched_setaffinity(0, sizeof(cpus), &cpus) == -1) {
+        perror("sched_setaffinity failed");
+    }
+#else
+    (void)worker;
+#endif
+}
+
+/* Fork a worker running its own event loop; shared_fd is -1 when it should open its own listener */
+pid_t start_worker(int worker, int shared_fd, int backlog, int pin_cpus) {
+    pid_t pid = fork();
+    int server_fd;
+
+    if (pid != 0) {
+        if (pid == -1) {
+            perror("fork failed");
         }
+        return pid;
+    }
+
+#ifdef __linux__
+    /* Don't outlive the master */
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+#endif
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGUSR1, request_cache_stats);
+    srand(time(NULL) ^ getpid());
+    log_after_fork();
+    metrics_attach(worker);
+    if (pin_cpus) {
+        pin_to_cpu(worker);
+    }
+
+    server_fd = shared_fd != -1 ? shared_fd : create_listener(backlog, 1);
+    run_event_loop(server_fd);
+    exit(EXIT_SUCCESS);
+}
+
+static volatile sig_atomic_t master_stopping = 0;
+
+void stop_master(int sig) {
+    (void)sig;
+    master_stopping = 1;
+}
+
+/* Keep worker_count workers running, replacing any that die, until told to stop */
+void run_master(int worker_count, int backlog, int pin_cpus) {
+    pid_t workers[MAX_WORKERS];
+    time_t started[MAX_WORKERS];
+    int shared_fd = -1;
+    struct sigaction stop;
+    int i;
+
+#ifndef SO_REUSEPORT
+    /* Without SO_REUSEPORT the workers share one listening socket opened here */
+    shared_fd = create_listener(backlog, 0);
+#endif
 
-        /* Read the incoming request */
-        valread = read(new_socket, buffer, BUFFER_SIZE - 1);
-        buffer[valread] = '\0';  /* Null-terminate the request */
+    /* No SA_RESTART, so a stop request interrupts wait() */
+    memset(&stop, 0, sizeof(stop));
+    stop.sa_handler = stop_master;
+    sigemptyset(&stop.sa_mask);
+    sigaction(SIGTERM, &stop, NULL);
+    sigaction(SIGINT, &stop, NULL);
+    signal(SIGUSR1, SIG_IGN);
 
-        /* Parse the request line (method, resource) */
+    for (i = 0; i < worker_count; i++) {
+        workers[i] = start_worker(i, shared_fd, backlog, pin_cpus);
+        started[i] = time(NULL);
+    }
 
-        sscanf(buffer, "%s %s", method, resource);
+    while (!master_stopping) {
+        int status;
+        pid_t pid = wait(&status);
 
-        /* Separate the resource from the query string, if present */
-        query_start = strchr(resource, '?');
-        if (query_start) {
-            strcpy(query_string, query_start + 1);
-            *query_start = '\0';  /* Terminate resource string before the query string */
+        if (pid == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("wait failed");
+            break;
         }
 
-        printf("Received request: Method = %s, Resource = %s, Query String = %s\n", method, resource, query_string);
+        for (i = 0; i < worker_count; i++) {
+            if (workers[i] == pid) {
+                break;
+            }
+        }
+        if (i == worker_count || master_stopping) {
+            continue;
+        }
 
-        if (strcmp(method, "POST") == 0 && strcmp(resource, "/submit") == 0) {
-            char *body;
-            printf("Handling POST request to \"/submit\"\n");
-            /* Find the start of the POST data (after the headers) */
-            body = strstr(buffer, "\r\n\r\n");
-            if (body) {
-                const char *html_content;
-                int content_length;
-                body += 4;  /* Move past the "\r\n\r\n" */
+        log_msg(LOG_WARN, "Worker %d (pid %d) exited with status %d, restarting", i, (int)pid, status);
+        /* A worker that dies straight away would otherwise be restarted in a tight loop */
+        if (time(NULL) - started[i] < 1) {
+            sleep(1);
+        }
+        workers[i] = start_worker(i, shared_fd, backlog, pin_cpus);
+        started[i] = time(NULL);
+    }
 
-                html_content = handle_form_submission(body);
-                content_length = strlen(html_content);
-                snprintf(response, BUFFER_SIZE, "HTTP/1.1 200 OK\nContent-Type: text/html\nContent-Length: %d\n\n%s", content_length, html_content);
-                write(new_socket, response, strlen(response));
-            } else {
-                const char *error_content = "<html><body><h1>Error in submission</h1></body></html>";
-                int content_length = strlen(error_content);
-                snprintf(response, BUFFER_SIZE, "HTTP/1.1 400 Bad Request\nContent-Type: text/html\nContent-Length: %d\n\n%s", content_length, error_content);
-                write(new_socket, response, strlen(response));
-            }
-        } else if (strcmp(resource, "/dynamic") == 0) {
-            /* Serve dynamically generated content */
-            const char *dynamic_content = generate_dynamic_content();
-            int content_length = strlen(dynamic_content);
-            snprintf(response, BUFFER_SIZE, "HTTP/1.1 200 OK\nContent-Type: text/html\nContent-Length: %d\n\n%s", content_length, dynamic_content);
-            write(new_socket, response, strlen(response));
-        } else {
-            /* Handle GET requests for specific resources or files */
-            const char *html_content = get_content_for_resource(resource);
-
-            if (html_content) {
-                /* Serve predefined HTML content */
-                int content_length = strlen(html_content);
-                snprintf(response, BUFFER_SIZE, "HTTP/1.1 200 OK\nContent-Type: text/html\nContent-Length: %d\n\n%s", content_length, html_content);
-
-                /* Parse and handle query strings for special cases */
-                if (strlen(query_string) > 0) {
-                    char params[10][2][BUFFER_SIZE];
-                    int param_count = 0;
-                    int i;
-                    parse_query_string(query_string, params, &param_count);
-
-                    /* Example: Check for a specific parameter in the query string */
-
-                    for (i = 0; i < param_count; i++) {
-                        if (strcmp(params[i][0], "name") == 0) {
-                            snprintf(response + strlen(response), BUFFER_SIZE - strlen(response), "<p>Hello, %s!</p>", params[i][1]);
-                        }
-                    }
-                }
+    for (i = 0; i < worker_count; i++) {
+        if (workers[i] > 0) {
+            kill(workers[i], SIGTERM);
+        }
+    }
+    while (wait(NULL) > 0 || errno == EINTR) {
+    }
+}
 
-                write(new_socket, response, strlen(response));
-            } else {
-                /* Serve file from disk */
-                char filepath[BUFFER_SIZE];  
-                strcpy(filepath, "./"); /* Assuming the files are in the current directory */
-                strcat(filepath, resource + 1);  /* Skip the leading '/' */
-
-                if (serve_file_from_disk(filepath, new_socket) == -1) {
-                    /* If the file wasn't found, send a 404 response */
-                    const char *not_found_content = "<html><body><h1>404 Not Found</h1></body></html>";
-                    int content_length = strlen(not_found_content);
-                    snprintf(response, BUFFER_SIZE, "HTTP/1.1 404 Not Found\nContent-Type: text/html\nContent-Length: %d\n\n%s", content_length, not_found_content);
-                    write(new_socket, response, strlen(response));
-                }
+void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [--workers N] [--backlog N] [--pin-cpus] [--log-level error|warn|info|debug] [--access-log off|common|json] [--io-uring]\n", program);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    int worker_count = 0;
+    int backlog = SOMAXCONN;
+    int pin_cpus = 0;
+    int level = LOG_INFO;
+    int access_format = ACCESS_LOG_COMMON;
+    int i;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+            worker_count = atoi(argv[++i]);
+            if (worker_count < 1 || worker_count > MAX_WORKERS) {
+                fprintf(stderr, "Workers must be between 1 and %d\n", MAX_WORKERS);
+                exit(EXIT_FAILURE);
             }
+        } else if (strcmp(argv[i], "--backlog") == 0 && i + 1 < argc) {
+            backlog = atoi(argv[++i]);
+            if (backlog < 1) {
+                fprintf(stderr, "Invalid backlog: %s\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i], "--pin-cpus") == 0) {
+            pin_cpus = 1;
+        } else if (strcmp(argv[i], "--io-uring") == 0) {
+            use_uring = 1;
+        } else if (strcmp(argv[i], "--log-level") == 0 && i + 1 < argc) {
+            level = log_parse_level(argv[++i]);
+            if (level < 0) {
+                usage(argv[0]);
+            }
+        } else if (strcmp(argv[i], "--access-log") == 0 && i + 1 < argc) {
+            access_format = log_parse_access_format(argv[++i]);
+            if (access_format < 0) {
+                usage(argv[0]);
+            }
+        } else {
+            usage(argv[0]);
         }
+    }
+
+    log_init(level, access_format);
+    now = time(NULL);
+    srand(now);
+    init_routes();
+    metrics_init(worker_count > 0 ? worker_count : 1);
+
+    /* A peer that disconnects mid-response must not take the whole server down */
+    signal(SIGPIPE, SIG_IGN);
+
+    /* kill -USR1 prints the file cache counters */
+    signal(SIGUSR1, request_cache_stats);
 
-        close(new_socket);
+    if (worker_count > 0) {
+        log_msg(LOG_INFO, "Server v2 is listening on port %d with %d workers", PORT, worker_count);
+        run_master(worker_count, backlog, pin_cpus);
+        return 0;
     }
 
+    log_msg(LOG_INFO, "Server v2 is listening on port %d", PORT);
+    metrics_attach(0);
+
+    if (pin_cpus) {
+        pin_to_cpu(0);
+    }
+    run_event_loop(create_listener(backlog, 0));
+
     return 0;
-}
\ No newline at end of file
+}
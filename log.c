@@ -0,0 +1,365 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#include "log.h"
+
+/* Hand lines to a writer thread rather than writing them from the caller; NO_LOG_THREAD turns it off */
+#if defined(__linux__) && !defined(NO_LOG_THREAD)
+#define USE_LOG_THREAD
+#include <pthread.h>
+#include <signal.h>
+#endif
+
+#define LOG_LINE_MAX 1024           /* Longer lines are cut short */
+#define LOG_RING_SIZE (256 * 1024)  /* Power of two, so positions wrap with a mask */
+#define LOG_FLUSH_TRIES 1000        /* Milliseconds log_flush() waits for the writer */
+
+int log_level = LOG_INFO;
+int access_log_format = ACCESS_LOG_COMMON;
+
+#ifdef USE_LOG_THREAD
+/*
+ * Single-producer, single-consumer ring: the server's own thread appends
+ * whole lines and moves head, the writer thread drains to stdout and moves
+ * tail. Each side only reads the other's counter, so no lock is needed and
+ * a slow stdout never stalls the caller; when the ring is full the line is
+ * dropped and counted instead. With the ring empty the writer sleeps on
+ * log_wake, and the caller only takes the lock to wake it when it finds
+ * log_writer_idle set.
+ */
+static char log_ring[LOG_RING_SIZE];
+static unsigned long log_head;
+static unsigned long log_tail;
+static unsigned long log_dropped;
+static int log_thread_running = 0;
+static int log_writer_idle = 0;
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_wake = PTHREAD_COND_INITIALIZER;
+#endif
+
+/* Per-second cache of the access log timestamps */
+static time_t stamp_second = -1;
+static char clf_stamp[32];
+static char iso_stamp[32];
+
+#ifdef USE_LOG_THREAD
+static int ring_put(const char *line, size_t length) {
+    unsigned long head = log_head;
+    unsigned long tail = __atomic_load_n(&log_tail, __ATOMIC_ACQUIRE);
+    size_t offset = head & (LOG_RING_SIZE - 1);
+    size_t first = LOG_RING_SIZE - offset;
+
+    if (length > LOG_RING_SIZE - (head - tail)) {
+        return -1;
+    }
+    if (first > length) {
+        first = length;
+    }
+    memcpy(log_ring + offset, line, first);
+    memcpy(log_ring, line + first, length - first);
+    __atomic_store_n(&log_head, head + length, __ATOMIC_SEQ_CST);
+
+    /* The writer sets the flag before its last look at head, so one of the two sees the other */
+    if (__atomic_exchange_n(&log_writer_idle, 0, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&log_lock);
+        pthread_cond_signal(&log_wake);
+        pthread_mutex_unlock(&log_lock);
+    }
+    return 0;
+}
+
+/* Sleep until ring_put() has something for the writer */
+static void log_writer_wait(unsigned long tail) {
+    pthread_mutex_lock(&log_lock);
+    __atomic_store_n(&log_writer_idle, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&log_writer_idle, __ATOMIC_SEQ_CST) && __atomic_load_n(&log_head, __ATOMIC_SEQ_CST) == tail) {
+        pthread_cond_wait(&log_wake, &log_lock);
+    }
+    __atomic_store_n(&log_writer_idle, 0, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&log_lock);
+}
+
+void *log_writer(void *arg) {
+    unsigned long tail = __atomic_load_n(&log_tail, __ATOMIC_RELAXED);
+
+    (void)arg;
+    while (1) {
+        unsigned long head = __atomic_load_n(&log_head, __ATOMIC_ACQUIRE);
+        size_t offset = tail & (LOG_RING_SIZE - 1);
+        size_t length = head - tail;
+        ssize_t n;
+
+        if (length == 0) {
+            log_writer_wait(tail);
+            continue;
+        }
+        if (length > LOG_RING_SIZE - offset) {
+            length = LOG_RING_SIZE - offset;
+        }
+        n = write(STDOUT_FILENO, log_ring + offset, length);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            n = length;     /* Nowhere to put it; don't wedge the ring */
+        }
+        tail += n;
+        __atomic_store_n(&log_tail, tail, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+static void log_start_writer() {
+    pthread_t thread;
+    sigset_t all, old;
+
+    /* Signals are the event loop's business, so the writer starts with them all blocked */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    if (pthread_create(&thread, NULL, log_writer, NULL) == 0) {
+        pthread_detach(thread);
+        log_thread_running = 1;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+#endif
+
+static void log_put(const char *line, size_t length) {
+#ifdef USE_LOG_THREAD
+    if (log_thread_running) {
+        if (log_dropped) {
+            char note[64];
+            int note_len = sprintf(note, "log: %lu lines dropped\n", log_dropped);
+            if (ring_put(note, note_len) == 0) {
+                log_dropped = 0;
+            }
+        }
+        if (ring_put(line, length) == -1) {
+            log_dropped++;
+        }
+        return;
+    }
+#endif
+    while (length > 0) {
+        ssize_t n = write(STDOUT_FILENO, line, length);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        line += n;
+        length -= n;
+    }
+}
+
+void log_init(int level, int access_format) {
+    log_level = level;
+    access_log_format = access_format;
+#ifdef USE_LOG_THREAD
+    log_start_writer();
+#endif
+    atexit(log_flush);
+}
+
+/* A forked child gets a copy of the ring but not the thread draining it */
+void log_after_fork() {
+#ifdef USE_LOG_THREAD
+    if (log_thread_running) {
+        log_tail = log_head;
+        log_dropped = 0;
+        /* The old writer may have held the lock at the fork; the copy is never unlocked */
+        pthread_mutex_init(&log_lock, NULL);
+        pthread_cond_init(&log_wake, NULL);
+        log_writer_idle = 0;
+        log_start_writer();
+    }
+#endif
+}
+
+/* Wait, for a while, until everything logged so far has been written */
+void log_flush() {
+#ifdef USE_LOG_THREAD
+    int tries;
+
+    for (tries = 0; log_thread_running && tries < LOG_FLUSH_TRIES; tries++) {
+        struct timespec pause;
+
+        if (__atomic_load_n(&log_tail, __ATOMIC_ACQUIRE) == log_head) {
+            break;
+        }
+        pause.tv_sec = 0;
+        pause.tv_nsec = 1000000;
+        nanosleep(&pause, NULL);
+    }
+#endif
+}
+
+/* Format one line; callers check LOG_ENABLED() first so disabled levels skip the formatting too */
+void log_msg(int level, const char *format, ...) {
+    char line[LOG_LINE_MAX];
+    va_list args;
+    int length;
+
+    if (level > log_level) {
+        return;
+    }
+    va_start(args, format);
+    length = vsnprintf(line, sizeof(line) - 1, format, args);
+    va_end(args);
+    if (length < 0) {
+        return;
+    }
+    if (length > (int)sizeof(line) - 2) {
+        length = sizeof(line) - 2;
+    }
+    line[length++] = '\n';
+    log_put(line, length);
+}
+
+/* Append a string, stopping short of end */
+static char *log_append(char *p, const char *end, const char *s) {
+    while (*s && p < end) {
+        *p++ = *s++;
+    }
+    return p;
+}
+
+static char *log_append_number(char *p, const char *end, unsigned long n) {
+    char digits[24];
+    int i = sizeof(digits);
+
+    digits[--i] = '\0';
+    do {
+        digits[--i] = '0' + n % 10;
+        n /= 10;
+    } while (n);
+    return log_append(p, end, digits + i);
+}
+
+/* Append a string with quotes, backslashes and control characters escaped; JSON wants \u, CLF gets \x */
+static char *log_append_escaped(char *p, const char *end, const char *s, int json) {
+    static const char hex[] = "0123456789abcdef";
+
+    for (; *s && p + 6 < end; s++) {
+        unsigned char c = (unsigned char)*s;
+
+        if (c == '"' || c == '\\') {
+            *p++ = '\\';
+            *p++ = c;
+        } else if (c < 0x20 || c == 0x7f) {
+            p = log_append(p, end, json ? "\\u00" : "\\x");
+            *p++ = hex[c >> 4];
+            *p++ = hex[c & 15];
+        } else {
+            *p++ = c;
+        }
+    }
+    return p;
+}
+
+static void log_stamp(time_t when) {
+    struct tm *tm;
+
+    if (when == stamp_second) {
+        return;
+    }
+    stamp_second = when;
+    tm = gmtime(&when);
+    strftime(clf_stamp, sizeof(clf_stamp), "%d/%b/%Y:%H:%M:%S +0000", tm);
+    strftime(iso_stamp, sizeof(iso_stamp), "%Y-%m-%dT%H:%M:%SZ", tm);
+}
+
+/* Put together by hand: this runs once per request, where printf-style formatting shows up in profiles */
+void log_access(const struct access_entry *entry) {
+    char line[LOG_LINE_MAX];
+    const char *end = line + sizeof(line) - 1;     /* Room for the newline */
+    int json = access_log_format == ACCESS_LOG_JSON;
+    char *p = line;
+
+    if (access_log_format == ACCESS_LOG_OFF) {
+        return;
+    }
+    log_stamp(entry->when);
+
+    if (json) {
+        p = log_append(p, end, "{\"time\":\"");
+        p = log_append(p, end, iso_stamp);
+        p = log_append(p, end, "\",\"remote\":\"");
+        p = log_append(p, end, entry->remote);
+        p = log_append(p, end, "\",\"port\":");
+        p = log_append_number(p, end, entry->port);
+        p = log_append(p, end, ",\"method\":\"");
+        p = log_append_escaped(p, end, entry->method, 1);
+        p = log_append(p, end, "\",\"target\":\"");
+    } else {
+        p = log_append(p, end, entry->remote);
+        p = log_append(p, end, " - - [");
+        p = log_append(p, end, clf_stamp);
+        p = log_append(p, end, "] \"");
+        p = log_append_escaped(p, end, entry->method, 0);
+        p = log_append(p, end, " ");
+    }
+    p = log_append_escaped(p, end, entry->target, json);
+    if (entry->query && entry->query[0]) {
+        p = log_append(p, end, "?");
+        p = log_append_escaped(p, end, entry->query, json);
+    }
+
+    if (json) {
+        p = log_append(p, end, "\",\"protocol\":\"");
+        p = log_append(p, end, entry->protocol);
+        p = log_append(p, end, "\",\"status\":");
+    } else {
+        p = log_append(p, end, " ");
+        p = log_append(p, end, entry->protocol);
+        p = log_append(p, end, "\" ");
+    }
+    if (entry->status < 0) {
+        p = log_append(p, end, json ? "null" : "-");
+    } else {
+        p = log_append_number(p, end, entry->status);
+    }
+    p = log_append(p, end, json ? ",\"bytes\":" : " ");
+    p = log_append_number(p, end, entry->bytes);
+    p = log_append(p, end, json ? ",\"latency_us\":" : " ");
+    p = log_append_number(p, end, entry->latency_us);
+    if (json) {
+        p = log_append(p, end, "}");
+    }
+    *p++ = '\n';
+    log_put(line, p - line);
+}
+
+/* error, warn, info or debug; -1 for anything else */
+int log_parse_level(const char *name) {
+    static const char *names[] = { "error", "warn", "info", "debug" };
+    int i;
+
+    for (i = 0; i <= LOG_DEBUG; i++) {
+        if (strcasecmp(name, names[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* off, common or json; -1 for anything else */
+int log_parse_access_format(const char *name) {
+    if (strcasecmp(name, "off") == 0) {
+        return ACCESS_LOG_OFF;
+    }
+    if (strcasecmp(name, "common") == 0) {
+        return ACCESS_LOG_COMMON;
+    }
+    if (strcasecmp(name, "json") == 0) {
+        return ACCESS_LOG_JSON;
+    }
+    return -1;
+}
@@ -0,0 +1,50 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <time.h>
+
+/* Message levels, most important first */
+#define LOG_ERROR 0
+#define LOG_WARN 1
+#define LOG_INFO 2
+#define LOG_DEBUG 3     /* Per-packet and per-block detail */
+
+/* Levels above this are compiled out; build with -DLOG_MAX_LEVEL=LOG_INFO to drop the per-packet lines */
+#ifndef LOG_MAX_LEVEL
+#define LOG_MAX_LEVEL LOG_DEBUG
+#endif
+
+/* Guard a log_msg() call so disabled levels cost a compare, or nothing when compiled out */
+#define LOG_ENABLED(level) ((level) <= LOG_MAX_LEVEL && (level) <= log_level)
+
+/* Access log formats */
+#define ACCESS_LOG_OFF 0
+#define ACCESS_LOG_COMMON 1     /* Common Log Format with the latency in microseconds appended, like Apache's %D */
+#define ACCESS_LOG_JSON 2       /* One JSON object per line */
+
+/* One finished request or transfer */
+struct access_entry {
+    const char *remote;         /* Client address */
+    int port;
+    const char *method;         /* GET, POST, RRQ, WRQ... */
+    const char *target;         /* Path as requested */
+    const char *query;          /* Appended after a '?' unless NULL or empty */
+    const char *protocol;       /* HTTP/1.1, TFTP */
+    int status;                 /* Response status, or -1 for none */
+    unsigned long bytes;        /* Bytes sent or received */
+    unsigned long latency_us;   /* From the first byte of the request to the last of the response */
+    time_t when;
+};
+
+extern int log_level;
+extern int access_log_format;
+
+void log_init(int level, int access_format);
+void log_after_fork();
+void log_flush();
+void log_msg(int level, const char *format, ...);
+void log_access(const struct access_entry *entry);
+int log_parse_level(const char *name);
+int log_parse_access_format(const char *name);
+
+#endif
@@ -0,0 +1,134 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include "metrics.h"
+
+#define HISTOGRAM_MAX_VALUE 0xFFFFFFFFUL
+
+/* Index of the highest set bit; value is never 0 */
+static int highest_bit(unsigned long value) {
+#ifdef __GNUC__
+    return (int)(sizeof(value) * 8 - 1) - __builtin_clzl(value);
+#else
+    int bit = 0;
+    while (value >>= 1) {
+        bit++;
+    }
+    return bit;
+#endif
+}
+
+void histogram_record(struct histogram *h, unsigned long value) {
+    int index;
+
+    if (value > HISTOGRAM_MAX_VALUE) {
+        value = HISTOGRAM_MAX_VALUE;
+    }
+    h->count++;
+    h->sum += value;
+    if (value < HISTOGRAM_SUB_COUNT) {
+        index = (int)value;
+    } else {
+        int shift = highest_bit(value) - HISTOGRAM_SUB_BITS;
+        index = (shift + 1) * HISTOGRAM_SUB_COUNT + (int)((value >> shift) & (HISTOGRAM_SUB_COUNT - 1));
+    }
+    h->buckets[index]++;
+}
+
+/* Largest value that lands in a bucket */
+static unsigned long bucket_limit(int index) {
+    int shift;
+
+    if (index < HISTOGRAM_SUB_COUNT) {
+        return index;
+    }
+    shift = index / HISTOGRAM_SUB_COUNT - 1;
+    return ((unsigned long)(HISTOGRAM_SUB_COUNT + index % HISTOGRAM_SUB_COUNT + 1) << shift) - 1;
+}
+
+void histogram_merge(struct histogram *into, const struct histogram *from) {
+    int i;
+
+    into->count += from->count;
+    into->sum += from->sum;
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        into->buckets[i] += from->buckets[i];
+    }
+}
+
+/* The value at or below which the given share of recorded values fall, rounded up to its bucket */
+unsigned long histogram_quantile(const struct histogram *h, double quantile) {
+    double exact = quantile * h->count;
+    unsigned long rank = (unsigned long)exact;
+    unsigned long seen = 0;
+    int i;
+
+    /* Nearest rank: the smallest value with at least that share at or below it */
+    if (rank < exact || rank == 0) {
+        rank++;
+    }
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= rank) {
+            return bucket_limit(i);
+        }
+    }
+    return 0;
+}
+
+void metrics_printf(struct metrics_text *text, const char *format, ...) {
+    while (!text->failed) {
+        size_t room = text->size - text->length;
+        size_t size;
+        char *data;
+        va_list args;
+        int length;
+
+        va_start(args, format);
+        length = vsnprintf(text->data ? text->data + text->length : NULL, room, format, args);
+        va_end(args);
+        if (length < 0) {
+            text->failed = 1;
+            return;
+        }
+        if ((size_t)length < room) {
+            text->length += length;
+            return;
+        }
+
+        size = text->size ? text->size : 4096;
+        while (size < text->length + length + 1) {
+            size *= 2;
+        }
+        data = realloc(text->data, size);
+        if (data == NULL) {
+            text->failed = 1;
+            return;
+        }
+        text->data = data;
+        text->size = size;
+    }
+}
+
+/*
+ * A histogram as a Prometheus summary: quantiles worked out here, where the
+ * full-resolution buckets are, plus _sum and _count. scale converts the
+ * recorded unit to the exposed one (microseconds to seconds is 1e-6).
+ */
+void metrics_summary(struct metrics_text *text, const char *name, const char *labels, const struct histogram *h, double scale) {
+    static const char *quantiles[] = { "0.5", "0.9", "0.99", "0.999" };
+    const char *comma = labels[0] ? "," : "";
+    unsigned i;
+
+    for (i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++) {
+        metrics_printf(text, "%s{%s%squantile=\"%s\"} %.9g\n", name, labels, comma, quantiles[i],
+                       h->count ? histogram_quantile(h, atof(quantiles[i])) * scale : 0.0);
+    }
+    if (labels[0]) {
+        metrics_printf(text, "%s_sum{%s} %.9g\n%s_count{%s} %lu\n", name, labels, h->sum * scale, name, labels, h->count);
+    } else {
+        metrics_printf(text, "%s_sum %.9g\n%s_count %lu\n", name, h->sum * scale, name, h->count);
+    }
+}
@@ -0,0 +1,40 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+
+/*
+ * Log-linear histogram in the style of HdrHistogram: values below
+ * HISTOGRAM_SUB_COUNT are counted exactly, larger ones in one of
+ * HISTOGRAM_SUB_COUNT equal slices of their power of two, so a recorded
+ * value is known to within 1 / HISTOGRAM_SUB_COUNT, 12.5% by default.
+ * Recording is a bit scan and an increment.
+ */
+#ifndef HISTOGRAM_SUB_BITS
+#define HISTOGRAM_SUB_BITS 3        /* The load generators build with 7, for 1% */
+#endif
+#define HISTOGRAM_SUB_COUNT (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_MAX_BITS 32       /* Larger values are counted as 2^32 - 1 */
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_COUNT)
+
+struct histogram {
+    unsigned long count;
+    unsigned long sum;
+    unsigned long buckets[HISTOGRAM_BUCKETS];
+};
+
+/* Prometheus text exposition being built; grows as needed */
+struct metrics_text {
+    char *data;
+    size_t length;
+    size_t size;
+    int failed;                     /* Out of memory; the text is incomplete */
+};
+
+void histogram_record(struct histogram *h, unsigned long value);
+void histogram_merge(struct histogram *into, const struct histogram *from);
+unsigned long histogram_quantile(const struct histogram *h, double quantile);
+void metrics_printf(struct metrics_text *text, const char *format, ...);
+void metrics_summary(struct metrics_text *text, const char *name, const char *labels, const struct histogram *h, double scale);
+
+#endif
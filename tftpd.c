@@ -1,3 +1,4 @@
+#define _GNU_SOURCE     /* sendmmsg(), recvmmsg() and fallocate() */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,14 +8,65 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <strings.h>
+#include <time.h>
+#include <sys/time.h>
+#include <signal.h>
+
+#include "log.h"
+#include "metrics.h"
+
+#if defined(__linux__) && !defined(NO_EPOLL)
+#define USE_EPOLL
+#include <sys/epoll.h>
+#else
+#include <poll.h>
+#endif
+
+/*
+ * Batched UDP: a window of DATA goes out in one sendmmsg() (each block a
+ * header plus a slice of the window or image, nothing copied) and queued
+ * ACKs or DATA are drained with one recvmmsg(). Elsewhere every packet is
+ * its own send() and recv().
+ */
+#if defined(__linux__) && !defined(NO_MMSG)
+#define USE_MMSG
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <netinet/udp.h>
+
+/* UDP GSO: equal-sized blocks leave as one large send that the kernel cuts into datagrams */
+#if defined(UDP_SEGMENT) && !defined(NO_GSO)
+#define USE_GSO
+#endif
+#endif
+
+/* WRQ uploads are written behind the transfer by a thread of their own; elsewhere inline */
+#if defined(__linux__) && !defined(NO_WRITER_THREAD)
+#define USE_WRITER
+#include <pthread.h>
+#endif
+
+/*
+ * io_uring (--io-uring): every socket's receives stay armed on one ring,
+ * filling provided buffers, and the pass's sends are queued beside them, so
+ * one io_uring_enter() both sends and waits for all transfers together.
+ */
+#if defined(HAVE_URING) && defined(USE_MMSG)
+#define USE_URING
+#include <poll.h>
+#include "uring.h"
+#endif
 
 #define TFTP_DATA_SIZE 512
-#define TFTP_TIMEOUT 5
+#define TFTP_TIMEOUT 5              /* Longest retransmission timeout, in seconds */
 #define TFTP_OPCODE_RRQ 1
 #define TFTP_OPCODE_WRQ 2
 #define TFTP_OPCODE_DATA 3
 #define TFTP_OPCODE_ACK 4
 #define TFTP_OPCODE_ERROR 5
+#define TFTP_OPCODE_OACK 6
 
 /* TFTP error codes */
 #define TFTP_ERROR_FILE_NOT_FOUND 1
@@ -22,6 +74,21 @@
 #define TFTP_ERROR_DISK_FULL 3
 #define TFTP_ERROR_ILLEGAL_OP 4
 #define TFTP_ERROR_UNKNOWN_ID 5
+#define TFTP_ERROR_OPTION_REFUSED 8
+
+/* RFC 7440 windowsize: blocks sent before waiting for an ACK */
+#define TFTP_MAX_WINDOWSIZE 64
+
+/* RFC 2348 blksize limits; a 65464 byte block still fits one UDP datagram */
+#define TFTP_MIN_BLKSIZE 8
+#define TFTP_MAX_BLKSIZE 65464
+
+/* RFC 2349 timeout limits, in seconds */
+#define TFTP_MIN_TIMEOUT 1
+#define TFTP_MAX_TIMEOUT 255
+
+/* Most a transfer may hold in its send window; windowsize is trimmed to fit large blocks */
+#define TFTP_MAX_WINDOW_BYTES (1024 * 1024)
 
 #define DEFAULT_TFTP_PORT 69
 
@@ -36,40 +103,409 @@
 /* Packet buffer size */
 #define PACKET_SIZE (4 + TFTP_DATA_SIZE)
 
-void handle_rrq(int sock, struct sockaddr_in *client_addr, socklen_t client_len, const char *filename, const char *directory);
-void handle_wrq(int sock, struct sockaddr_in *client_addr, socklen_t client_len, const char *filename, const char *directory);
+#define MAX_TRANSFERS 1024
+#define MAX_EVENTS 64
+#define STATS_INTERVAL_MS 1000      /* How often --stats-file is rewritten */
+
+/* Retransmission timeout, estimated per transfer from measured round trips (RFC 6298 style) */
+#define TFTP_INITIAL_RTO_MS 1000
+#define TFTP_MIN_RTO_MS 20
+#define TFTP_MAX_RETRIES 10         /* Consecutive timeouts before a transfer is abandoned, about 15 s with backoff */
+
+/* Files sent by RRQ are shared by every transfer of them; see image_acquire() */
+#define IMAGE_CACHE_MAX_BYTES (128L * 1024 * 1024)
+#define IMAGE_CACHE_BUCKETS 64
+#define IMAGE_IDLE_MS 10000         /* How long an image outlives its last transfer */
+
+/* Batched I/O limits */
+#define SEND_BATCH TFTP_MAX_WINDOWSIZE  /* Blocks per sendmmsg(), a whole window */
+#define RECV_BATCH 32                   /* Packets per recvmmsg() */
+#define RECV_BATCH_BYTES (256 * 1024)   /* Shared receive buffer; large blocks get fewer slots */
+#define GSO_MAX_BYTES 65000             /* Payload of one segmented send */
+#define GSO_MAX_SEGMENTS 64
+
+#ifdef USE_URING
+#define URING_ENTRIES 256
+#define URING_SMALL_BUFFERS 1024            /* Requests, ACKs and DATA of the default block size */
+#define URING_SMALL_BUFFER_SIZE 1024
+#define URING_LARGE_BUFFERS 64              /* DATA of uploads with a larger blksize */
+#define URING_LARGE_BUFFER_SIZE (4 + TFTP_MAX_BLKSIZE)
+#define URING_PACKETS 256                   /* Transfer packets gathered from one pass before they are handled */
+#define URING_FREE_SENDS 256                /* Spare send records kept */
+
+/* What a completion is for, in the low bits of its user_data; the rest is a transfer or a send record */
+#define URING_REQUEST 0                     /* The well-known port's receive */
+#define URING_RECV 1
+#define URING_SEND 2
+#define URING_DONE 3                        /* Nothing to do but count it */
+#define URING_WRITER 4                      /* The writer thread's pipe is readable */
+#define URING_TAG_MASK 7
+#endif
+
+/* WRQ write-behind: blocks collect in large buffers that are written out whole */
+#ifdef USE_WRITER
+#define SINK_BUFFER_SIZE (256 * 1024)   /* Grown to a whole window if that is larger */
+#define SINK_BUFFERS 3                  /* One filling while up to two are written */
+#define SINK_ALIGN 4096
+#else
+#define SINK_BUFFER_SIZE 4096           /* Written inline as soon as it fills */
+#define SINK_BUFFERS 1
+#endif
+
+/* RFC 2347 options requested after the filename and mode */
+struct tftp_options {
+    int windowsize;         /* 0 when not requested */
+    int blksize;            /* 0 when not requested */
+    int timeout;            /* Seconds, 0 when not requested */
+    int tsize_requested;
+    long tsize;             /* Transfer size: the client's for WRQ, the file's for RRQ */
+};
+
+/*
+ * A file's contents, loaded once and sent by every transfer of it. With
+ * batched UDP the image is an mmap() of the file: only the kernel reads it,
+ * through send iovecs, so pages fault in as the windows go out and a file
+ * truncated under a transfer fails that send with EFAULT rather than
+ * faulting the server. Elsewhere blocks are copied out of the image, so it
+ * is a copy of the file read up front.
+ */
+struct file_image {
+    dev_t dev;                      /* Identity of the file when it was read */
+    ino_t ino;
+    time_t mtime;
+    off_t size;
+    char *data;
+    int refs;                       /* Transfers using the image */
+    int stale;                      /* Changed on disk; freed once the last transfer lets go */
+    unsigned long idle_since;       /* now_ms when refs dropped to 0 */
+    struct file_image *hash_next;
+    struct file_image *idle_prev;   /* Unused images, oldest first */
+    struct file_image *idle_next;
+};
+
+/* A buffer of uploaded data on its way to disk */
+struct sink_buffer {
+    struct sink *sink;
+    char *data;
+    size_t length;                  /* Bytes filled */
+    int busy;                       /* Handed to the writer */
+    int sync;                       /* The file's last buffer: fsync() once it is written */
+    int error;                      /* errno from writing it, 0 on success */
+    struct sink_buffer *next;       /* Writer queue link */
+};
+
+/*
+ * Where a WRQ upload goes: a temporary file beside the destination, renamed
+ * over it only once every block is on disk. The sink outlives its transfer
+ * if the transfer is dropped while buffers are still being written.
+ */
+struct sink {
+    struct transfer *owner;         /* NULL once the transfer is gone */
+    int fd;
+    char temp_path[PATH_MAX + 8];   /* Empty once renamed */
+    size_t buffer_size;
+    struct sink_buffer buffers[SINK_BUFFERS];
+    int filling;                    /* Buffer blocks are copied into, -1 while all are busy */
+    int pending;                    /* Buffers handed to the writer and not yet back */
+    int error;                      /* errno of the first failed write */
+};
+
+/* One DATA packet ready to go: its header and where its payload lies */
+struct data_block {
+    char header[4];
+    const char *data;
+    size_t length;
+};
+
+#ifdef USE_GSO
+/* Room for the UDP_SEGMENT control message of a segmented send */
+union segment_control {
+    char buf[CMSG_SPACE(sizeof(uint16_t))];
+    size_t align;                   /* A cmsghdr's alignment */
+};
+#endif
+
+/* Per-transfer state machine */
+enum transfer_state {
+    TRANSFER_OACK_SENT,     /* RRQ: waiting for the OACK to be acknowledged as block 0 */
+    TRANSFER_SENDING,       /* RRQ: a window is out, waiting for its ACK */
+    TRANSFER_RECEIVING,     /* WRQ: waiting for DATA */
+    TRANSFER_FLUSHING,      /* WRQ: last block in, waiting for the file to reach disk before the final ACK */
+    TRANSFER_DALLYING       /* WRQ: file complete, staying to re-ACK a repeated final block */
+};
+
+/* One RRQ or WRQ in flight, talking to its client from a port of its own (the server's TID) */
+struct transfer {
+    int sock;                       /* Connected to the client, so only its TID gets through */
+    int slot;                       /* Index in transfers[] */
+    int state;
+    int file;                       /* RRQ: open only while the file is being read directly */
+    struct file_image *image;       /* RRQ: shared contents of the file, or NULL to read file */
+    struct sockaddr_in peer;
+    socklen_t peer_len;
+    char path[PATH_MAX];
+    struct tftp_options options;    /* As confirmed in the OACK */
+    int blksize;
+    int windowsize;
+    char *buffer;                   /* RRQ without an image: unacknowledged blocks, slot (block - 1) % windowsize; WRQ without USE_MMSG: one DATA packet */
+    size_t window_len[TFTP_MAX_WINDOWSIZE];
+
+    /* RRQ block numbers are counted without wrapping and truncated to 16 bits on the wire */
+    unsigned long acked;            /* Highest block the client has acknowledged */
+    unsigned long read_up_to;       /* Highest block read from the file into the window */
+    unsigned long last_block;       /* The short block that ends the file, once read */
+
+    struct sink *sink;              /* WRQ: where received blocks go */
+    uint16_t block;                 /* WRQ: last block received */
+    int unacked;                    /* WRQ: in-order blocks received since the last ACK */
+    int ack_held;                   /* WRQ: window complete, ACK waits for buffer space */
+
+    char reply[128];                /* Last OACK or ACK sent, kept for retransmission */
+    size_t reply_len;
+
+    unsigned long deadline;         /* now_ms at which the timer fires */
+    unsigned long sent_at;          /* When the exchange now awaited started */
+    unsigned long sent_at_us;       /* The same, in microseconds, for the RTT histogram */
+    int timing;                     /* sent_at can give an RTT sample (nothing retransmitted since, per Karn) */
+    int retries;                    /* Timeouts since the last progress */
+    long srtt;                      /* Smoothed RTT in ms, 0 until the first sample */
+    long rttvar;
+    long rto;
+#ifdef USE_GSO
+    int gso;                        /* Segmented sends still work on this socket's path */
+#endif
+
+    /* For the stats and access log line when the transfer closes */
+    int opcode;                     /* TFTP_OPCODE_RRQ or TFTP_OPCODE_WRQ */
+    unsigned long started_us;       /* now_us when the request arrived */
+    unsigned long ended_us;         /* WRQ: now_us when the final ACK went out, or 0 */
+    unsigned long size;             /* RRQ: bytes in the file */
+    unsigned long bytes;            /* WRQ: bytes received */
+    int error;                      /* TFTP error code the transfer failed with, or -1 */
+    int complete;
+#ifdef USE_URING
+    int uring_ops;                  /* Submissions and gathered packets still to come; it is freed after the last */
+    int recv_armed;                 /* Its multishot receive is still running */
+    struct uring_buffers *recv_group;   /* Where that receive takes its buffers */
+    int closed;                     /* close_transfer() has run */
+#endif
+};
+
+#ifdef USE_URING
+/* Everything the kernel reads for one queued send, kept until the send completes */
+struct ring_send {
+    struct transfer *t;
+    struct msghdr msg;
+#ifdef USE_GSO
+    union segment_control control;
+#endif
+    struct iovec iov[2 * GSO_MAX_SEGMENTS];
+    char headers[GSO_MAX_SEGMENTS][4];
+    char reply[128];                /* A copy of t->reply, which may change first */
+    int gso;                        /* Segmented; the path refusing it turns GSO off for the transfer */
+    struct ring_send *next;         /* Free list */
+};
+
+/* A datagram a transfer's receive delivered, handled once the pass's completions are all in */
+struct ring_packet {
+    struct transfer *t;
+    struct uring_buffers *group;
+    unsigned bid;
+    size_t length;
+};
+#endif
+
+static struct transfer *transfers[MAX_TRANSFERS];
+static int transfer_count = 0;
+static unsigned long now_ms;        /* Milliseconds on a steady clock, refreshed once per event loop pass */
+static unsigned long now_us;        /* The same moment in microseconds; wraps sooner, so only for intervals */
+#ifdef USE_EPOLL
+static int epoll_fd = -1;           /* Stays -1 while io_uring drives the sockets */
+#endif
+#ifdef USE_GSO
+static int gso_supported = 0;       /* The kernel knows UDP_SEGMENT */
+#endif
+static int use_uring = 0;           /* --io-uring, until the kernel turns it down */
+#ifdef USE_URING
+static struct uring ring;
+static struct uring_buffers small_buffers;
+static struct uring_buffers large_buffers;
+static struct msghdr request_msg;   /* Shape of what the well-known port's receives fill in */
+static struct ring_send *free_sends = NULL;
+static int free_send_count = 0;
+static struct ring_packet ring_packets[URING_PACKETS];
+static int ring_packet_count = 0;
+static int ring_unarmed = 0;        /* A transfer is waiting for its receive */
+#endif
+
+static struct file_image *image_buckets[IMAGE_CACHE_BUCKETS];
+static struct file_image *image_idle_head = NULL;
+static struct file_image *image_idle_tail = NULL;
+static long image_cache_bytes = 0;
+static struct {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+} image_stats;
+static volatile sig_atomic_t image_stats_requested = 0;
+
+/* Counters for --stats-file; only the event loop writes them, so they are plain increments */
+static struct {
+    unsigned long transfers[2][2];  /* [RRQ, WRQ][failed, complete] */
+    unsigned long bytes[2];         /* Payload delivered: acknowledged by RRQ clients, received by WRQ */
+    unsigned long data_sent;        /* DATA packets sent, resends included */
+    unsigned long retransmits;      /* Timeouts that sent something again */
+    unsigned long ignored_acks;     /* Duplicate or out-of-window ACKs */
+    struct histogram rtt;           /* Round trip of each timed exchange, in microseconds */
+    struct histogram duration[2];   /* Whole transfers, in microseconds */
+} stats;
+static const char *stats_path = NULL;
+static unsigned long stats_written_ms = 0;
+
+static mode_t create_mode = 0644;   /* Permissions for uploaded files, after the umask */
+#ifdef USE_WRITER
+static pthread_mutex_t sink_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sink_wakeup = PTHREAD_COND_INITIALIZER;
+static struct sink_buffer *sink_queue_head = NULL;  /* Waiting for the writer, oldest first */
+static struct sink_buffer *sink_queue_tail = NULL;
+static struct sink_buffer *sink_done = NULL;        /* Written, waiting for the event loop */
+static int sink_pipe[2] = { -1, -1 };               /* The writer wakes the event loop through this */
+#endif
+
+void parse_options(const char *packet, ssize_t length, struct tftp_options *options);
+size_t build_oack(char *packet, const struct tftp_options *options);
+unsigned long image_hash(dev_t dev, ino_t ino);
+void image_free(struct file_image *image);
+void image_idle_remove(struct file_image *image);
+void image_unhash(struct file_image *image);
+struct file_image *image_acquire(int file, const struct stat *st);
+void image_release(struct file_image *image);
+void image_cache_sweep();
+void print_image_stats();
+void request_image_stats(int sig);
+struct sink *sink_open(struct transfer *t);
+struct sink *sink_open_failed(struct sink *s);
+void sink_free(struct sink *s);
+void sink_abandon(struct sink *s);
+int sink_write(struct sink_buffer *b);
+void sink_submit(struct sink *s, struct sink_buffer *b, int sync);
+void sink_complete(struct sink_buffer *b);
+void sink_append(struct sink *s, const char *data, size_t length);
+void sink_finish(struct sink *s);
+#ifdef USE_WRITER
+size_t sink_room(const struct sink *s);
+void *sink_writer(void *arg);
+void sink_start_writer();
+void sink_completions();
+#endif
+int wrq_send_ack(struct transfer *t);
+int wrq_sink_progress(struct transfer *t);
+struct transfer *new_transfer(const struct sockaddr_in *client_addr, socklen_t client_len);
+int send_blocks(struct transfer *t, struct data_block *blocks, int count);
+#ifdef USE_GSO
+int send_segmented(struct transfer *t, struct iovec *iov, int count);
+#endif
+void close_transfer(struct transfer *t);
+void transfer_free(struct transfer *t);
+struct transfer *find_transfer(const struct sockaddr_in *client_addr);
+void handle_rrq(const struct sockaddr_in *client_addr, socklen_t client_len, const char *filename, const char *directory, const struct tftp_options *options);
+void handle_wrq(const struct sockaddr_in *client_addr, socklen_t client_len, const char *filename, const char *directory, const struct tftp_options *options);
+int rrq_send_window(struct transfer *t);
+int rrq_receive(struct transfer *t, const char *packet, ssize_t recv_len);
+int wrq_receive(struct transfer *t, const char *packet, ssize_t recv_len);
+#ifdef USE_MMSG
+int ack_covered(const char *packet, size_t length, const char *later, size_t later_length);
+int ack_superseded(struct mmsghdr *msgs, int i, int count);
+#endif
+#ifdef USE_GSO
+void segment_msg(struct msghdr *msg, union segment_control *control, uint16_t segment);
+#endif
+#ifdef USE_URING
+struct io_uring_sqe *ring_sqe(int opcode, int fd, unsigned long user_data);
+struct ring_send *ring_send_new(struct transfer *t);
+void ring_send_queue(struct ring_send *s, int iovlen);
+int ring_send_blocks(struct transfer *t, struct data_block *blocks, int count);
+int ring_send_reply(struct transfer *t);
+void ring_sent(struct ring_send *s, int res);
+void ring_arm(struct transfer *t);
+void ring_arm_requests(int sock);
+#ifdef USE_WRITER
+void ring_arm_writer();
+#endif
+void ring_close_transfer(struct transfer *t);
+void ring_transfer_done(struct transfer *t);
+void ring_request(int sock, const char *directory, int res, unsigned flags);
+void ring_received(struct transfer *t, int res, unsigned flags);
+void ring_handle_packets();
+int ring_start();
+void run_ring_loop(int sock, const char *directory);
+#endif
+void run_ring_loop_if_wanted(int sock, const char *directory);
+void handle_request(int sock, const char *directory);
+void handle_packet(int sock, const char *directory, char *buffer, ssize_t recv_len, struct sockaddr_in *client_addr, socklen_t client_len);
+void transfer_readable(struct transfer *t);
+void clock_update();
+void start_timer(struct transfer *t);
+void rtt_sample(struct transfer *t);
+int send_reply(struct transfer *t, const char *packet, size_t length);
+void transfer_timeout(struct transfer *t);
+long process_timers();
+void run_event_loop(int sock, const char *directory);
+int same_peer(const struct sockaddr_in *a, const struct sockaddr_in *b);
+void log_options(const char *operation, const char *path, const struct tftp_options *options);
 void send_error(int sock, struct sockaddr_in *client_addr, socklen_t client_len, int error_code, const char *error_msg);
-void log_request(const struct sockaddr_in *client_addr, const char *operation, const char *filename);
-void log_error(const char *message, const struct sockaddr_in *client_addr, int error_code, const char *error_msg);
-void log_packet(const char *action, const char *type, const char *filename, uint16_t block, ssize_t length);
+void transfer_error(struct transfer *t, const char *message, int error_code, const char *detail);
+void transfer_finished(struct transfer *t);
+void log_transfer(struct transfer *t, unsigned long bytes, unsigned long duration_us);
+void write_stats_file();
 
 int main(int argc, char *argv[]) {
     int sock;
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t client_len = sizeof(client_addr);
-    char buffer[PACKET_SIZE];
-    ssize_t recv_len;
+    struct sockaddr_in server_addr;
     int port = DEFAULT_TFTP_PORT;
     const char *directory = "."; /* Default directory is current working directory */
+    int level = LOG_INFO;
+    int access_format = ACCESS_LOG_COMMON;
+    int arg;
+
+    /* Options come first; all but --io-uring take a value */
+    for (arg = 1; arg < argc && strncmp(argv[arg], "--", 2) == 0; arg++) {
+        if (strcmp(argv[arg], "--io-uring") == 0) {
+            use_uring = 1;
+        } else if (arg + 1 < argc && strcmp(argv[arg], "--log-level") == 0) {
+            level = log_parse_level(argv[++arg]);
+        } else if (arg + 1 < argc && strcmp(argv[arg], "--access-log") == 0) {
+            access_format = log_parse_access_format(argv[++arg]);
+        } else if (arg + 1 < argc && strcmp(argv[arg], "--stats-file") == 0) {
+            stats_path = argv[++arg];
+        } else {
+            level = -1;
+        }
+        if (level < 0 || access_format < 0) {
+            break;
+        }
+    }
 
     /* Check for command-line arguments */
-    if (argc < 2 || argc > 3) {
-        fprintf(stderr, "Usage: %s <port> [directory]\n", argv[0]);
+    if (level < 0 || access_format < 0 || argc - arg < 1 || argc - arg > 2) {
+        fprintf(stderr, "Usage: %s [--log-level error|warn|info|debug] [--access-log off|common|json] [--stats-file path] [--io-uring] <port> [directory]\n", argv[0]);
         exit(EXIT_FAILURE);
     }
 
     /* Set port from command-line argument */
-    port = atoi(argv[1]);
+    port = atoi(argv[arg]);
     if (port <= 0 || port > 65535) {
-        fprintf(stderr, "Invalid port number: %s. Using default port %d.\n", argv[1], DEFAULT_TFTP_PORT);
+        fprintf(stderr, "Invalid port number: %s. Using default port %d.\n", argv[arg], DEFAULT_TFTP_PORT);
         port = DEFAULT_TFTP_PORT;
     }
 
     /* Set directory from command-line argument if provided */
-    if (argc == 3) {
-        directory = argv[2];
+    if (argc - arg == 2) {
+        directory = argv[arg + 1];
     }
 
+    log_init(level, access_format);
+
     /* Create UDP socket */
     if ((sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
         perror("socket failed");
@@ -87,201 +523,2299 @@ int main(int argc, char *argv[]) {
         exit(EXIT_FAILURE);
     }
 
-    printf("TFTP server listening on port %d, using directory: '%s'...\n", port, directory);
+    log_msg(LOG_INFO, "TFTP server listening on port %d, using directory: '%s'...", port, directory);
 
-    while (1) {
-        uint16_t opcode;
-        char *filename;
-        /* Receive incoming TFTP request */
-        recv_len = recvfrom(sock, buffer, sizeof(buffer), 0, (struct sockaddr *)&client_addr, &client_len);
-        if (recv_len < 0) {
-            perror("recvfrom failed");
+#ifdef USE_GSO
+    /* Kernels without UDP GSO don't know the option; they get plain sendmmsg() */
+    {
+        int segment;
+        socklen_t segment_len = sizeof(segment);
+        gso_supported = getsockopt(sock, IPPROTO_UDP, UDP_SEGMENT, &segment, &segment_len) == 0;
+    }
+#endif
+
+    signal(SIGUSR1, request_image_stats);
+
+    /* Uploads are created 0600 and opened up to what the umask allows */
+    {
+        mode_t mask = umask(0);
+        umask(mask);
+        create_mode = 0666 & ~mask;
+    }
+#ifdef USE_WRITER
+    sink_start_writer();
+#endif
+
+    run_event_loop(sock, directory);
+
+    close(sock);
+    return 0;
+}
+
+/* Walk the option/value pairs that follow the filename and mode (RFC 2347) */
+void parse_options(const char *packet, ssize_t length, struct tftp_options *options) {
+    const char *end = packet + length;
+    const char *field = packet + 2;
+    int index = 0;
+
+    memset(options, 0, sizeof(*options));
+
+    while (field < end) {
+        const char *value;
+        size_t field_len = strlen(field);
+
+        /* Fields 0 and 1 are the filename and mode */
+        if (index++ < 2) {
+            field += field_len + 1;
             continue;
         }
 
-        /* Determine the request type (RRQ or WRQ) */
-        opcode = ntohs(*(uint16_t *)buffer);
-        filename = buffer + 2;
-
-        log_packet("Received", opcode == TFTP_OPCODE_RRQ ? "RRQ" : "WRQ", filename, 0, recv_len);
+        value = field + field_len + 1;
+        if (value >= end) {
+            break;
+        }
 
-        if (opcode == TFTP_OPCODE_RRQ) {
-            log_request(&client_addr, "RRQ", filename);
-            handle_rrq(sock, &client_addr, client_len, filename, directory);
-        } else if (opcode == TFTP_OPCODE_WRQ) {
-            log_request(&client_addr, "WRQ", filename);
-            handle_wrq(sock, &client_addr, client_len, filename, directory);
-        } else {
-            /* Unsupported request type */
-            log_error("Unsupported TFTP operation", &client_addr, TFTP_ERROR_ILLEGAL_OP, "Illegal TFTP operation");
-            send_error(sock, &client_addr, client_len, TFTP_ERROR_ILLEGAL_OP, "Illegal TFTP operation");
+        if (strcasecmp(field, "windowsize") == 0) {
+            long windowsize = atol(value);
+            if (windowsize >= 1 && windowsize <= 65535) {
+                options->windowsize = windowsize > TFTP_MAX_WINDOWSIZE ? TFTP_MAX_WINDOWSIZE : (int)windowsize;
+            }
+        } else if (strcasecmp(field, "blksize") == 0) {
+            /* Larger requests are answered with the largest size we support */
+            long blksize = atol(value);
+            if (blksize >= TFTP_MIN_BLKSIZE) {
+                options->blksize = blksize > TFTP_MAX_BLKSIZE ? TFTP_MAX_BLKSIZE : (int)blksize;
+            }
+        } else if (strcasecmp(field, "timeout") == 0) {
+            /* Out of range timeouts must be refused rather than adjusted */
+            long timeout = atol(value);
+            if (timeout >= TFTP_MIN_TIMEOUT && timeout <= TFTP_MAX_TIMEOUT) {
+                options->timeout = (int)timeout;
+            }
+        } else if (strcasecmp(field, "tsize") == 0) {
+            long tsize = atol(value);
+            if (tsize >= 0) {
+                options->tsize_requested = 1;
+                options->tsize = tsize;
+            }
         }
+        /* Unknown options are left out of the OACK, which tells the client they were refused */
+
+        field = value + strlen(value) + 1;
     }
 
-    close(sock);
-    return 0;
+    if (options->windowsize && options->blksize &&
+        (long)options->windowsize * options->blksize > TFTP_MAX_WINDOW_BYTES) {
+        options->windowsize = TFTP_MAX_WINDOW_BYTES / options->blksize;
+    }
 }
-void handle_rrq(int sock, struct sockaddr_in *client_addr, socklen_t client_len, const char *filename, const char *directory) {
-    char data_packet[PACKET_SIZE];
-    char full_path[PATH_MAX];
-    int file;
 
-    uint16_t block = 0;
-    ssize_t bytes_read;
+/* Build an OACK for the accepted options; returns 0 if there is nothing to acknowledge */
+size_t build_oack(char *packet, const struct tftp_options *options) {
+    size_t length = 2;
 
-    /* Construct the full file path */
-    snprintf(full_path, sizeof(full_path), "%s/%s", directory, filename);
+    packet[0] = 0;
+    packet[1] = TFTP_OPCODE_OACK;
 
-    /* Open file for reading */
-    file = open(full_path, O_RDONLY);
-    if (file < 0) {
-        log_error("File cannot be opened", client_addr, TFTP_ERROR_FILE_NOT_FOUND, strerror(errno));
-        send_error(sock, client_addr, client_len, TFTP_ERROR_FILE_NOT_FOUND, "File not found");
-        return;
+    if (options->blksize) {
+        length += sprintf(packet + length, "blksize") + 1;
+        length += sprintf(packet + length, "%d", options->blksize) + 1;
+    }
+    if (options->tsize_requested) {
+        length += sprintf(packet + length, "tsize") + 1;
+        length += sprintf(packet + length, "%ld", options->tsize) + 1;
+    }
+    if (options->timeout) {
+        length += sprintf(packet + length, "timeout") + 1;
+        length += sprintf(packet + length, "%d", options->timeout) + 1;
     }
+    if (options->windowsize) {
+        length += sprintf(packet + length, "windowsize") + 1;
+        length += sprintf(packet + length, "%d", options->windowsize) + 1;
+    }
+
+    return length > 2 ? length : 0;
+}
+
+int same_peer(const struct sockaddr_in *a, const struct sockaddr_in *b) {
+    return a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port;
+}
 
-    printf("RRQ: Sending file '%s' to client\n", full_path);
+void log_options(const char *operation, const char *path, const struct tftp_options *options) {
+    /* timeout 0 means the retransmission timeout adapts to the measured round trip */
+    log_msg(LOG_INFO, "%s: '%s' blksize %d, windowsize %d, timeout %d, tsize %ld", operation, path,
+           options->blksize ? options->blksize : TFTP_DATA_SIZE,
+           options->windowsize ? options->windowsize : 1,
+           options->timeout,
+           options->tsize_requested ? options->tsize : -1L);
+}
 
-    /* Send data blocks to client */
-    while ((bytes_read = read(file, data_packet + 4, TFTP_DATA_SIZE)) > 0) {
-        char ack_packet[4];
-        socklen_t len;
+unsigned long image_hash(dev_t dev, ino_t ino) {
+    return (unsigned long)ino * 31 + (unsigned long)dev;
+}
 
-        /* Prepare the data packet */
-        data_packet[0] = 0;
-        data_packet[1] = TFTP_OPCODE_DATA;
-        data_packet[2] = (block + 1) >> 8;
-        data_packet[3] = (block + 1) & 0xFF;
+void image_free(struct file_image *image) {
+    image_cache_bytes -= image->size;
+#ifdef USE_MMSG
+    if (image->data) {
+        munmap(image->data, image->size);
+    }
+#else
+    free(image->data);
+#endif
+    free(image);
+}
 
-        /* Send the data packet */
-        if (sendto(sock, data_packet, bytes_read + 4, 0, (struct sockaddr *)client_addr, client_len) < 0) {
-            perror("sendto failed");
-            close(file);
-            return;
+void image_idle_remove(struct file_image *image) {
+    if (image->idle_prev) {
+        image->idle_prev->idle_next = image->idle_next;
+    } else {
+        image_idle_head = image->idle_next;
+    }
+    if (image->idle_next) {
+        image->idle_next->idle_prev = image->idle_prev;
+    } else {
+        image_idle_tail = image->idle_prev;
+    }
+    image->idle_prev = image->idle_next = NULL;
+}
+
+/* Drop an image from the lookup table; it is freed now if idle, otherwise when its last transfer ends */
+void image_unhash(struct file_image *image) {
+    struct file_image **link = &image_buckets[image_hash(image->dev, image->ino) % IMAGE_CACHE_BUCKETS];
+
+    while (*link != image) {
+        link = &(*link)->hash_next;
+    }
+    *link = image->hash_next;
+    image->stale = 1;
+
+    if (image->refs == 0) {
+        image_idle_remove(image);
+        image_free(image);
+    }
+}
+
+/*
+ * The shared image of an open file, reading it in on first use. Returns NULL
+ * when the file won't fit under IMAGE_CACHE_MAX_BYTES even after evicting
+ * idle images, in which case the caller reads the file itself.
+ */
+struct file_image *image_acquire(int file, const struct stat *st) {
+    unsigned long hash = image_hash(st->st_dev, st->st_ino);
+    struct file_image *image = image_buckets[hash % IMAGE_CACHE_BUCKETS];
+
+    while (image && (image->dev != st->st_dev || image->ino != st->st_ino)) {
+        image = image->hash_next;
+    }
+
+    if (image && (image->mtime != st->st_mtime || image->size != st->st_size)) {
+        /* Rewritten in place since it was loaded; transfers already using it keep their image */
+        image_unhash(image);
+        image = NULL;
+    }
+
+    if (image) {
+        if (image->refs++ == 0) {
+            image_idle_remove(image);
         }
+        image_stats.hits++;
+        return image;
+    }
+    image_stats.misses++;
 
-        printf("Sent DATA block %d, Size: %zd bytes\n", block + 1, bytes_read);
-        
-        /* Wait for the ACK from the client */
-        len = client_len;
-        if (recvfrom(sock, ack_packet, sizeof(ack_packet), 0, (struct sockaddr *)client_addr, &len) < 0) {
-            perror("recvfrom failed");
-            close(file);
-            return;
+    if (st->st_size > IMAGE_CACHE_MAX_BYTES) {
+        return NULL;
+    }
+    while (image_cache_bytes + st->st_size > IMAGE_CACHE_MAX_BYTES && image_idle_head) {
+        image_unhash(image_idle_head);
+        image_stats.evictions++;
+    }
+    if (image_cache_bytes + st->st_size > IMAGE_CACHE_MAX_BYTES) {
+        return NULL;
+    }
+
+    image = malloc(sizeof(*image));
+    if (image == NULL) {
+        return NULL;
+    }
+    memset(image, 0, sizeof(*image));
+    image->dev = st->st_dev;
+    image->ino = st->st_ino;
+    image->mtime = st->st_mtime;
+    image->size = st->st_size;
+
+#ifdef USE_MMSG
+    if (image->size > 0) {
+        /* Mapped rather than read, so a cold image never stalls the loop for the whole file */
+        image->data = mmap(NULL, image->size, PROT_READ, MAP_SHARED, file, 0);
+        if (image->data == MAP_FAILED) {
+            free(image);
+            return NULL;
+        }
+        madvise(image->data, image->size, MADV_WILLNEED);
+    }
+#else
+    if (image->size > 0) {
+        off_t loaded = 0;
+        image->data = malloc(image->size);
+        /* pread() leaves the file offset alone, so a failed load leaves the caller reading from the start */
+        while (image->data && loaded < image->size) {
+            ssize_t n = pread(file, image->data + loaded, image->size - loaded, loaded);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                /* Truncated since the fstat(), or unreadable */
+                free(image->data);
+                image->data = NULL;
+                break;
+            }
+            loaded += n;
         }
+        if (image->data == NULL) {
+            free(image);
+            return NULL;
+        }
+    }
+#endif
 
-        /* Check if the received packet is an ACK */
-        if (ntohs(*(uint16_t *)ack_packet) != TFTP_OPCODE_ACK || ntohs(*(uint16_t *)(ack_packet + 2)) != block + 1) {
-            log_error("Invalid ACK received", client_addr, TFTP_ERROR_ILLEGAL_OP, "Illegal TFTP operation");
-            send_error(sock, client_addr, client_len, TFTP_ERROR_ILLEGAL_OP, "Illegal TFTP operation");
-            close(file);
-            return;
+    image->refs = 1;
+    image->hash_next = image_buckets[hash % IMAGE_CACHE_BUCKETS];
+    image_buckets[hash % IMAGE_CACHE_BUCKETS] = image;
+    image_cache_bytes += image->size;
+    return image;
+}
+
+/* A transfer is done with its image; idle images linger briefly for the next client to boot */
+void image_release(struct file_image *image) {
+    if (--image->refs > 0) {
+        return;
+    }
+    if (image->stale) {
+        image_free(image);
+        return;
+    }
+    image->idle_since = now_ms;
+    image->idle_prev = image_idle_tail;
+    image->idle_next = NULL;
+    if (image_idle_tail) {
+        image_idle_tail->idle_next = image;
+    } else {
+        image_idle_head = image;
+    }
+    image_idle_tail = image;
+}
+
+/* Free images no transfer has used for IMAGE_IDLE_MS; the idle list is oldest first */
+void image_cache_sweep() {
+    while (image_idle_head && (long)(now_ms - image_idle_head->idle_since) >= IMAGE_IDLE_MS) {
+        image_unhash(image_idle_head);
+        image_stats.evictions++;
+    }
+}
+
+void print_image_stats() {
+    log_msg(LOG_INFO, "Image cache: %lu hits, %lu misses, %lu evictions, %ld bytes held",
+            image_stats.hits, image_stats.misses, image_stats.evictions, image_cache_bytes);
+}
+
+void request_image_stats(int sig) {
+    (void)sig;
+    image_stats_requested = 1;
+}
+
+/*
+ * Start an upload: a temporary file in the destination's directory, so the
+ * final rename() can't cross filesystems, and its buffers. A tsize from the
+ * client reserves the space up front, which turns a disk that is too full
+ * into an error before any data is sent rather than halfway through.
+ */
+struct sink *sink_open(struct transfer *t) {
+    struct sink *s;
+    int i;
+
+    s = malloc(sizeof(*s));
+    if (s == NULL) {
+        return NULL;
+    }
+    memset(s, 0, sizeof(*s));
+    s->owner = t;
+    s->fd = -1;
+    s->buffer_size = SINK_BUFFER_SIZE;
+#ifdef USE_WRITER
+    {
+        /* A whole window must fit beside the buffers being written, or its ACK would wait forever */
+        size_t window = ((size_t)t->windowsize * t->blksize + SINK_ALIGN - 1) & ~(size_t)(SINK_ALIGN - 1);
+        if (window > s->buffer_size) {
+            s->buffer_size = window;
         }
+    }
+#endif
+
+    snprintf(s->temp_path, sizeof(s->temp_path), "%s.XXXXXX", t->path);
+    s->fd = mkstemp(s->temp_path);
+    if (s->fd < 0) {
+        s->temp_path[0] = '\0';
+        return sink_open_failed(s);
+    }
+    fchmod(s->fd, create_mode);
 
-        block++;
+#ifdef __linux__
+    if (t->options.tsize_requested && t->options.tsize > 0 &&
+        fallocate(s->fd, FALLOC_FL_KEEP_SIZE, 0, t->options.tsize) < 0 &&
+        (errno == ENOSPC || errno == EDQUOT)) {
+        return sink_open_failed(s);
     }
+#endif
 
-    close(file);
-    printf("RRQ: File '%s' send complete\n", full_path);
+    for (i = 0; i < SINK_BUFFERS; i++) {
+        struct sink_buffer *b = &s->buffers[i];
+#ifdef USE_WRITER
+        void *data;
+        if (posix_memalign(&data, SINK_ALIGN, s->buffer_size) != 0) {
+            errno = ENOMEM;
+            return sink_open_failed(s);
+        }
+        b->data = data;
+#else
+        b->data = malloc(s->buffer_size);
+        if (b->data == NULL) {
+            return sink_open_failed(s);
+        }
+#endif
+        b->sink = s;
+    }
+    s->filling = 0;
+    return s;
 }
 
-void handle_wrq(int sock, struct sockaddr_in *client_addr, socklen_t client_len, const char *filename, const char *directory) {
-    char data_packet[PACKET_SIZE];
-    char full_path[PATH_MAX];
-    int file;
-    ssize_t recv_len;
-    uint16_t block;
+/* Undo a half-opened sink, keeping errno for the caller's error report */
+struct sink *sink_open_failed(struct sink *s) {
+    int saved = errno;
 
-    snprintf(full_path, sizeof(full_path), "%s/%s", directory, filename);
+    sink_free(s);
+    errno = saved;
+    return NULL;
+}
 
-    /* Open file for writing */
-    file = open(full_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
-    if (file < 0) {
-        log_error("File cannot be created", client_addr, TFTP_ERROR_ACCESS_VIOLATION, strerror(errno));
-        send_error(sock, client_addr, client_len, TFTP_ERROR_ACCESS_VIOLATION, "Cannot create file");
-        return;
+/* Release a sink with nothing left in flight; a file that was never completed goes too */
+void sink_free(struct sink *s) {
+    int i;
+
+    if (s->fd != -1) {
+        close(s->fd);
+    }
+    if (s->temp_path[0]) {
+        unlink(s->temp_path);
+    }
+    for (i = 0; i < SINK_BUFFERS; i++) {
+        free(s->buffers[i].data);
+    }
+    free(s);
+}
+
+/* The transfer is gone; the sink follows once the writer hands back its last buffer */
+void sink_abandon(struct sink *s) {
+    s->owner = NULL;
+    if (s->pending == 0) {
+        sink_free(s);
     }
+}
 
-    printf("WRQ: Receiving file '%s' from client\n", full_path);
+/* Write one buffer out in full; returns 0 or an errno. Runs on the writer thread where there is one. */
+int sink_write(struct sink_buffer *b) {
+    size_t done = 0;
 
-    /* Send ACK for block 0 */
-    data_packet[0] = 0;
-    data_packet[1] = TFTP_OPCODE_ACK;
-    data_packet[2] = 0;
-    data_packet[3] = 0;
-    if (sendto(sock, data_packet, 4, 0, (struct sockaddr *)client_addr, client_len) < 0) {
-        perror("sendto failed");
-        close(file);
-        return;
+    while (done < b->length) {
+        ssize_t written = write(b->sink->fd, b->data + done, b->length - done);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno;
+        }
+        if (written == 0) {
+            return ENOSPC;
+        }
+        done += written;
+    }
+    if (b->sync && fsync(b->sink->fd) < 0) {
+        return errno;
+    }
+    return 0;
+}
+
+/* Hand a buffer over to be written; buffers of one sink reach the file in the order handed over */
+void sink_submit(struct sink *s, struct sink_buffer *b, int sync) {
+    b->busy = 1;
+    b->sync = sync;
+    s->pending++;
+    if (s->filling == b - s->buffers) {
+        s->filling = -1;
+    }
+#ifdef USE_WRITER
+    b->next = NULL;
+    pthread_mutex_lock(&sink_lock);
+    if (sink_queue_tail) {
+        sink_queue_tail->next = b;
+    } else {
+        sink_queue_head = b;
+    }
+    sink_queue_tail = b;
+    pthread_cond_signal(&sink_wakeup);
+    pthread_mutex_unlock(&sink_lock);
+#else
+    b->error = sink_write(b);
+    sink_complete(b);
+#endif
+}
+
+/* A buffer is back from the writer: note any error and make it available for filling */
+void sink_complete(struct sink_buffer *b) {
+    struct sink *s = b->sink;
+
+    b->busy = 0;
+    b->length = 0;
+    s->pending--;
+    if (b->error && !s->error) {
+        s->error = b->error;
     }
-    printf("Sent ACK for block 0\n");
+    if (s->filling == -1) {
+        s->filling = b - s->buffers;
+    }
+}
 
-    /* Receive data and write to file */
-    block = 0;
-    while ((recv_len = recvfrom(sock, data_packet, sizeof(data_packet), 0, (struct sockaddr *)client_addr, &client_len)) > 0) {
-        uint16_t data_block = ntohs(*(uint16_t *)(data_packet + 2));
-        if (ntohs(*(uint16_t *)data_packet) != TFTP_OPCODE_DATA) {
-            log_error("Not a DATA packet", client_addr, TFTP_ERROR_ILLEGAL_OP, "Illegal TFTP operation");
-            send_error(sock, client_addr, client_len, TFTP_ERROR_ILLEGAL_OP, "Illegal TFTP operation");
-            close(file);
+/*
+ * Copy a block into the buffers. A full buffer is only handed over once
+ * more data needs the space, so there is always one to finish with.
+ */
+void sink_append(struct sink *s, const char *data, size_t length) {
+    while (length > 0) {
+        struct sink_buffer *b;
+        size_t room;
+        int i;
+
+        if (s->filling == -1) {
+            /* Can't happen while ACKs wait for room, but never write over a busy buffer */
+            if (!s->error) {
+                s->error = ENOBUFS;
+            }
             return;
         }
+        b = &s->buffers[s->filling];
+        if (b->length == s->buffer_size) {
+            sink_submit(s, b, 0);
+            for (i = 0; i < SINK_BUFFERS && s->filling == -1; i++) {
+                if (!s->buffers[i].busy) {
+                    s->filling = i;
+                }
+            }
+            continue;
+        }
 
-        if (data_block == block + 1) {
-            char ack_packet[4];
-            /* Write data to file */
-            write(file, data_packet + 4, recv_len - 4);
+        room = s->buffer_size - b->length;
+        if (room > length) {
+            room = length;
+        }
+        memcpy(b->data + b->length, data, room);
+        b->length += room;
+        data += room;
+        length -= room;
+    }
+}
 
-            /* Send ACK for the received block */
-            ack_packet[0] = 0;
-            ack_packet[1] = TFTP_OPCODE_ACK;
-            ack_packet[2] = (block + 1) >> 8;
-            ack_packet[3] = (block + 1) & 0xFF;
+/* The last block is in: write out what is left and fsync() behind it */
+void sink_finish(struct sink *s) {
+    if (s->filling != -1) {
+        sink_submit(s, &s->buffers[s->filling], 1);
+    } else if (!s->error) {
+        s->error = ENOBUFS;
+    }
+}
 
-            if (sendto(sock, ack_packet, 4, 0, (struct sockaddr *)client_addr, client_len) < 0) {
-                perror("sendto failed");
-                close(file);
-                return;
-            }
+#ifdef USE_WRITER
+/* Bytes that can be taken without waiting for the writer */
+size_t sink_room(const struct sink *s) {
+    size_t room = 0;
+    int i;
 
-            printf("Sent ACK for block %d\n", block + 1);
-            block++;
+    for (i = 0; i < SINK_BUFFERS; i++) {
+        if (!s->buffers[i].busy) {
+            room += s->buffer_size - s->buffers[i].length;
         }
+    }
+    return room;
+}
 
-        /* End of transfer (last block < 512 bytes) */
-        if (recv_len < TFTP_DATA_SIZE + 4) {
-            break;
+/* Writes queued buffers in order, then hands them back to the event loop */
+void *sink_writer(void *arg) {
+    (void)arg;
+
+    while (1) {
+        struct sink_buffer *b;
+
+        pthread_mutex_lock(&sink_lock);
+        while (sink_queue_head == NULL) {
+            pthread_cond_wait(&sink_wakeup, &sink_lock);
+        }
+        b = sink_queue_head;
+        sink_queue_head = b->next;
+        if (sink_queue_head == NULL) {
+            sink_queue_tail = NULL;
         }
+        pthread_mutex_unlock(&sink_lock);
+
+        b->error = sink_write(b);
+
+        pthread_mutex_lock(&sink_lock);
+        b->next = sink_done;
+        sink_done = b;
+        pthread_mutex_unlock(&sink_lock);
+
+        /* A full pipe already has the event loop's attention */
+        write(sink_pipe[1], "", 1);
+    }
+    return NULL;
+}
+
+void sink_start_writer() {
+    pthread_t thread;
+    sigset_t all, old;
+
+    if (pipe(sink_pipe) < 0) {
+        perror("pipe failed");
+        exit(EXIT_FAILURE);
     }
+    fcntl(sink_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(sink_pipe[1], F_SETFL, O_NONBLOCK);
 
-    close(file);
-    printf("WRQ: File '%s' upload complete\n", full_path);
+    /* Signals are for the event loop; the writer starts with them all blocked */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    if (pthread_create(&thread, NULL, sink_writer, NULL) != 0) {
+        perror("pthread_create failed");
+        exit(EXIT_FAILURE);
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    pthread_detach(thread);
 }
 
+/* Take back what the writer has finished and move the uploads waiting on it along */
+void sink_completions() {
+    char drain[64];
+    struct sink_buffer *b, *next;
 
-void send_error(int sock, struct sockaddr_in *client_addr, socklen_t client_len, int error_code, const char *error_msg) {
-    char error_packet[516];
-    *(uint16_t *)error_packet = htons(TFTP_OPCODE_ERROR);
-    *(uint16_t *)(error_packet + 2) = htons(error_code);
-    strcpy(error_packet + 4, error_msg);
+    while (read(sink_pipe[0], drain, sizeof(drain)) > 0) {
+    }
 
-    printf("Sending ERROR: Code %d, Message: '%s'\n", error_code, error_msg);
+    pthread_mutex_lock(&sink_lock);
+    b = sink_done;
+    sink_done = NULL;
+    pthread_mutex_unlock(&sink_lock);
 
-    sendto(sock, error_packet, strlen(error_msg) + 5, 0, (struct sockaddr *)client_addr, client_len);
+    /* Later buffers of the same sink keep it pending, so it can't be freed under them */
+    for (; b != NULL; b = next) {
+        struct sink *s = b->sink;
+
+        next = b->next;
+        sink_complete(b);
+        if (s->owner) {
+            wrq_sink_progress(s->owner);
+        } else if (s->pending == 0) {
+            sink_free(s);
+        }
+    }
 }
+#endif
 
-void log_request(const struct sockaddr_in *client_addr, const char *operation, const char *filename) {
-    char client_ip[INET_ADDRSTRLEN];
-    inet_ntop(AF_INET, &client_addr->sin_addr, client_ip, sizeof(client_ip));
-    printf("[%s:%d] %s request for file: '%s'\n", client_ip, ntohs(client_addr->sin_port), operation, filename);
+/* Refresh now_ms and now_us from one reading of the clock */
+void clock_update() {
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    now_ms = (unsigned long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    now_us = (unsigned long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    now_ms = (unsigned long)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+    now_us = (unsigned long)tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
 }
 
-void log_error(const char *message, const struct sockaddr_in *client_addr, int error_code, const char *error_msg) {
-    char client_ip[INET_ADDRSTRLEN];
-    inet_ntop(AF_INET, &client_addr->sin_addr, client_ip, sizeof(client_ip));
-    printf("ERROR: [%s:%d] %s (Code %d: %s)\n", client_ip, ntohs(client_addr->sin_port), message, error_code, error_msg);
+/* Something fresh went out: time it, and retransmit if nothing comes back within the RTO */
+void start_timer(struct transfer *t) {
+    t->sent_at = now_ms;
+    t->sent_at_us = now_us;
+    t->timing = 1;
+    t->deadline = now_ms + t->rto;
 }
 
-void log_packet(const char *action, const char *type, const char *filename, uint16_t block, ssize_t length) {
-    printf("%s: %s for '%s', Block: %d, Length: %zd bytes\n", action, type, filename, block, length);
+/* Progress was made; fold the round trip into the estimate unless a retransmission muddied it */
+void rtt_sample(struct transfer *t) {
+    long rtt = (long)(now_ms - t->sent_at);
+
+    if (t->timing) {
+        histogram_record(&stats.rtt, now_us - t->sent_at_us);
+    }
+    t->retries = 0;
+    if (!t->timing || t->options.timeout) {
+        /* A negotiated timeout is used as given */
+        return;
+    }
+    if (t->srtt == 0) {
+        t->srtt = rtt > 0 ? rtt : 1;
+        t->rttvar = rtt / 2;
+    } else {
+        long delta = rtt > t->srtt ? rtt - t->srtt : t->srtt - rtt;
+        t->rttvar += (delta - t->rttvar) / 4;
+        t->srtt += (rtt - t->srtt) / 8;
+    }
+    t->rto = t->srtt + 4 * t->rttvar;
+    if (t->rto < TFTP_MIN_RTO_MS) {
+        t->rto = TFTP_MIN_RTO_MS;
+    } else if (t->rto > TFTP_TIMEOUT * 1000) {
+        t->rto = TFTP_TIMEOUT * 1000;
+    }
+}
+
+/* Send an OACK or ACK and keep a copy in case it has to go again */
+int send_reply(struct transfer *t, const char *packet, size_t length) {
+    if (packet != t->reply) {
+        memcpy(t->reply, packet, length);
+        t->reply_len = length;
+    }
+#ifdef USE_URING
+    if (use_uring) {
+        return ring_send_reply(t);
+    }
+#endif
+    if (send(t->sock, t->reply, t->reply_len, 0) < 0) {
+        perror("send failed");
+        return -1;
+    }
+    return 0;
+}
+
+/* Set up a transfer with its own socket, bound to a fresh port and connected to the client */
+struct transfer *new_transfer(const struct sockaddr_in *client_addr, socklen_t client_len) {
+    struct transfer *t;
+    struct sockaddr_in local;
+    int sock;
+
+    if (transfer_count >= MAX_TRANSFERS) {
+        return NULL;                /* handle_packet() has already turned the client away */
+    }
+
+    if ((sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+        perror("socket failed");
+        return NULL;
+    }
+    memset(&local, 0, sizeof(local));
+    local.sin_family = AF_INET;
+    local.sin_addr.s_addr = INADDR_ANY;
+    local.sin_port = 0;
+    if (bind(sock, (struct sockaddr *)&local, sizeof(local)) < 0 ||
+        connect(sock, (const struct sockaddr *)client_addr, client_len) < 0) {
+        perror("transfer socket failed");
+        close(sock);
+        return NULL;
+    }
+
+    t = malloc(sizeof(*t));
+    if (t == NULL) {
+        close(sock);
+        return NULL;
+    }
+    memset(t, 0, sizeof(*t));
+    t->sock = sock;
+    t->file = -1;
+    t->peer = *client_addr;
+    t->peer_len = client_len;
+    t->rto = TFTP_INITIAL_RTO_MS;
+    t->started_us = now_us;
+    t->ended_us = 0;
+    t->error = -1;
+#ifdef USE_GSO
+    t->gso = gso_supported;
+#endif
+    t->slot = transfer_count;
+    transfers[transfer_count++] = t;
+
+#ifdef USE_EPOLL
+    if (epoll_fd != -1) {
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = t;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock, &ev) == -1) {
+            perror("epoll_ctl failed");
+        }
+    }
+#endif
+#ifdef USE_URING
+    /* Armed once the request has been handled, when it is known which buffers its packets need */
+    ring_unarmed = use_uring;
+#endif
+    return t;
+}
+
+void close_transfer(struct transfer *t) {
+    struct transfer *last;
+
+    transfer_finished(t);
+#ifdef USE_EPOLL
+    if (epoll_fd != -1) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, t->sock, NULL);
+    }
+#endif
+    if (t->sink) {
+        sink_abandon(t->sink);
+        t->sink = NULL;
+    }
+
+    /* Swap the last transfer into the freed slot */
+    last = transfers[--transfer_count];
+    transfers[t->slot] = last;
+    last->slot = t->slot;
+
+#ifdef USE_URING
+    if (use_uring) {
+        /* Sends in flight may still read its window or image; the ring frees it after them */
+        ring_close_transfer(t);
+        return;
+    }
+#endif
+    transfer_free(t);
+}
+
+/* Let go of what a closed transfer holds */
+void transfer_free(struct transfer *t) {
+    close(t->sock);
+    if (t->file != -1) {
+        close(t->file);
+    }
+    if (t->image) {
+        image_release(t->image);
+    }
+    free(t->buffer);
+    free(t);
+}
+
+/* The transfer already running for this client TID, if any */
+struct transfer *find_transfer(const struct sockaddr_in *client_addr) {
+    int i;
+
+    for (i = 0; i < transfer_count; i++) {
+        if (same_peer(&transfers[i]->peer, client_addr)) {
+            return transfers[i];
+        }
+    }
+    return NULL;
+}
+
+void handle_rrq(const struct sockaddr_in *client_addr, socklen_t client_len, const char *filename, const char *directory, const struct tftp_options *options) {
+    struct transfer *t;
+    char packet[PACKET_SIZE];
+    size_t oack_len;
+    size_t buffer_size;
+    struct stat st;
+
+    t = new_transfer(client_addr, client_len);
+    if (t == NULL) {
+        return;
+    }
+    t->opcode = TFTP_OPCODE_RRQ;
+    t->options = *options;
+    t->windowsize = options->windowsize ? options->windowsize : 1;
+    t->blksize = options->blksize ? options->blksize : TFTP_DATA_SIZE;
+    if (options->timeout) {
+        t->rto = options->timeout * 1000L;
+    }
+
+    /* Construct the full file path */
+    snprintf(t->path, sizeof(t->path), "%s/%s", directory, filename);
+
+    /* Open file for reading */
+    t->file = open(t->path, O_RDONLY);
+    if (t->file < 0) {
+        transfer_error(t, "File cannot be opened", TFTP_ERROR_FILE_NOT_FOUND, strerror(errno));
+        send_error(t->sock, &t->peer, t->peer_len, TFTP_ERROR_FILE_NOT_FOUND, "File not found");
+        close_transfer(t);
+        return;
+    }
+
+    if (fstat(t->file, &st) < 0) {
+        transfer_error(t, "File cannot be opened", TFTP_ERROR_FILE_NOT_FOUND, strerror(errno));
+        send_error(t->sock, &t->peer, t->peer_len, TFTP_ERROR_FILE_NOT_FOUND, "File not found");
+        close_transfer(t);
+        return;
+    }
+
+    t->size = st.st_size;
+
+    /* tsize in an RRQ is always 0; the answer is the size of the file */
+    if (t->options.tsize_requested) {
+        t->options.tsize = (long)st.st_size;
+    }
+
+    /* Clients fetching the same file share one copy of it and need no descriptor of their own */
+    t->image = image_acquire(t->file, &st);
+    if (t->image) {
+        close(t->file);
+        t->file = -1;
+        t->last_block = st.st_size / t->blksize + 1;
+    }
+
+    /* Reading the file needs the whole window kept; an image is its own window */
+    buffer_size = (size_t)t->windowsize * (4 + t->blksize);
+    if (t->image) {
+#ifdef USE_MMSG
+        buffer_size = 0;
+#else
+        buffer_size = 4 + t->blksize;   /* Each block is staged behind its header */
+#endif
+    }
+    if (buffer_size) {
+        t->buffer = malloc(buffer_size);
+        if (t->buffer == NULL) {
+            transfer_error(t, "Out of memory", TFTP_ERROR_DISK_FULL, strerror(errno));
+            send_error(t->sock, &t->peer, t->peer_len, TFTP_ERROR_DISK_FULL, "Out of memory");
+            close_transfer(t);
+            return;
+        }
+    }
+
+    log_options("RRQ: Sending file", t->path, &t->options);
+    if (t->image) {
+        log_msg(LOG_INFO, "RRQ: '%s' from shared image, %d transfers using it", t->path, t->image->refs);
+    }
+
+    /* Negotiated options are confirmed with an OACK, which the client acknowledges as block 0 */
+    oack_len = build_oack(packet, &t->options);
+    if (oack_len) {
+        if (send_reply(t, packet, oack_len) < 0) {
+            close_transfer(t);
+            return;
+        }
+        t->state = TRANSFER_OACK_SENT;
+        start_timer(t);
+        return;
+    }
+
+    t->state = TRANSFER_SENDING;
+    if (rrq_send_window(t) < 0) {
+        close_transfer(t);
+        return;
+    }
+    start_timer(t);
+}
+
+/*
+ * Put a run of DATA packets on the wire in as few system calls as the
+ * platform allows: segmented sends where UDP GSO works, one sendmmsg() for
+ * the rest, or one send() per packet without USE_MMSG.
+ */
+int send_blocks(struct transfer *t, struct data_block *blocks, int count) {
+    int i;
+#ifdef USE_MMSG
+    struct iovec iov[2 * SEND_BATCH];
+    struct mmsghdr msgs[SEND_BATCH];
+    int sent = 0;
+
+#ifdef USE_URING
+    if (use_uring) {
+        return ring_send_blocks(t, blocks, count);
+    }
+#endif
+
+    for (i = 0; i < count; i++) {
+        iov[2 * i].iov_base = blocks[i].header;
+        iov[2 * i].iov_len = sizeof(blocks[i].header);
+        iov[2 * i + 1].iov_base = (char *)blocks[i].data;
+        iov[2 * i + 1].iov_len = blocks[i].length;
+    }
+
+#ifdef USE_GSO
+    while (t->gso && count - sent > 1 && 2 * (4 + t->blksize) <= GSO_MAX_BYTES) {
+        int n = send_segmented(t, iov + 2 * sent, count - sent);
+        if (n < 0) {
+            /* Refused for this path (too large for the MTU, no offload): fall back for good */
+            if (errno != EINVAL && errno != EIO && errno != EOPNOTSUPP && errno != ENOPROTOOPT) {
+                perror("send failed");
+                return -1;
+            }
+            t->gso = 0;
+            break;
+        }
+        sent += n;
+    }
+#endif
+
+    while (sent < count) {
+        int n;
+
+        memset(msgs, 0, (count - sent) * sizeof(msgs[0]));
+        for (i = sent; i < count; i++) {
+            msgs[i - sent].msg_hdr.msg_iov = &iov[2 * i];
+            msgs[i - sent].msg_hdr.msg_iovlen = 2;
+        }
+        n = sendmmsg(t->sock, msgs, count - sent, 0);
+        if (n < 0) {
+            perror("sendmmsg failed");
+            return -1;
+        }
+        sent += n;
+    }
+#else
+    for (i = 0; i < count; i++) {
+        const char *packet;
+
+        if (t->image) {
+            /* The image is shared, so its blocks are staged behind a header of their own */
+            memcpy(t->buffer, blocks[i].header, sizeof(blocks[i].header));
+            memcpy(t->buffer + 4, blocks[i].data, blocks[i].length);
+            packet = t->buffer;
+        } else {
+            /* The window keeps each block behind its header already */
+            packet = blocks[i].data - 4;
+        }
+        if (send(t->sock, packet, 4 + blocks[i].length, 0) < 0) {
+            perror("send failed");
+            return -1;
+        }
+    }
+#endif
+    return 0;
+}
+
+#ifdef USE_GSO
+/*
+ * Send as many of the blocks as fit in one UDP GSO send, each iov pair a
+ * header and its payload; the kernel splits the lot every 4 + blksize bytes.
+ * Only the file's final block can be short, and it always comes last.
+ * Returns the number of blocks sent, or -1 with errno set.
+ */
+int send_segmented(struct transfer *t, struct iovec *iov, int count) {
+    union segment_control control;
+    struct msghdr msg;
+    uint16_t segment = 4 + t->blksize;
+
+    if (count > GSO_MAX_SEGMENTS) {
+        count = GSO_MAX_SEGMENTS;
+    }
+    if (count > GSO_MAX_BYTES / segment) {
+        count = GSO_MAX_BYTES / segment;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2 * count;
+    segment_msg(&msg, &control, segment);
+
+    if (sendmsg(t->sock, &msg, 0) < 0) {
+        return -1;
+    }
+    return count;
+}
+
+/* Ask for the message's payload to be cut into segment-byte datagrams */
+void segment_msg(struct msghdr *msg, union segment_control *control, uint16_t segment) {
+    struct cmsghdr *cmsg;
+
+    memset(control, 0, sizeof(*control));
+    msg->msg_control = control->buf;
+    msg->msg_controllen = sizeof(control->buf);
+    cmsg = CMSG_FIRSTHDR(msg);
+    cmsg->cmsg_level = IPPROTO_UDP;
+    cmsg->cmsg_type = UDP_SEGMENT;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+    memcpy(CMSG_DATA(cmsg), &segment, sizeof(segment));
+}
+#endif
+
+/* Send the whole window; blocks not yet read come from the file, resent ones from memory */
+int rrq_send_window(struct transfer *t) {
+    struct data_block blocks[TFTP_MAX_WINDOWSIZE];
+    int count = 0;
+    int i;
+    unsigned long block;
+    unsigned long window_end = t->acked + t->windowsize;
+
+    if (t->last_block && window_end > t->last_block) {
+        window_end = t->last_block;
+    }
+
+    for (block = t->acked + 1; block <= window_end; block++) {
+        struct data_block *b = &blocks[count++];
+        char *data_packet;
+        size_t *data_len;
+
+        b->header[0] = 0;
+        b->header[1] = TFTP_OPCODE_DATA;
+        b->header[2] = (block >> 8) & 0xFF;
+        b->header[3] = block & 0xFF;
+
+        if (t->image) {
+            off_t offset = (off_t)(block - 1) * t->blksize;
+
+            b->data = t->image->data + offset;
+            b->length = offset < t->image->size ? (size_t)(t->image->size - offset) : 0;
+            if (b->length > (size_t)t->blksize) {
+                b->length = t->blksize;
+            }
+            continue;
+        }
+
+        data_packet = t->buffer + ((block - 1) % t->windowsize) * (4 + t->blksize);
+        data_len = &t->window_len[(block - 1) % t->windowsize];
+        if (block > t->read_up_to) {
+            ssize_t bytes_read = read(t->file, data_packet + 4, t->blksize);
+            if (bytes_read < 0) {
+                transfer_error(t, "File read failed", TFTP_ERROR_ACCESS_VIOLATION, strerror(errno));
+                send_error(t->sock, &t->peer, t->peer_len, TFTP_ERROR_ACCESS_VIOLATION, "Read error");
+                return -1;
+            }
+
+            /* Prepare the data packet */
+            memcpy(data_packet, b->header, sizeof(b->header));
+            *data_len = bytes_read + 4;
+            t->read_up_to = block;
+
+            if (bytes_read < t->blksize) {
+                t->last_block = block;
+                window_end = block;
+            }
+        }
+        b->data = data_packet + 4;
+        b->length = *data_len - 4;
+    }
+
+    if (send_blocks(t, blocks, count) < 0) {
+        return -1;
+    }
+    stats.data_sent += count;
+
+    if (!t->image && LOG_ENABLED(LOG_DEBUG)) {
+        for (i = 0; i < count; i++) {
+            log_msg(LOG_DEBUG, "Sent DATA block %lu, Size: %d bytes", t->acked + 1 + i, (int)blocks[i].length);
+        }
+    }
+    return 0;
+}
+
+/* An ACK (or ERROR) has arrived for a read transfer; returns -1 once the transfer is closed */
+int rrq_receive(struct transfer *t, const char *packet, ssize_t recv_len) {
+    uint16_t opcode, ack_block, ack_delta;
+    unsigned long window_end;
+
+    opcode = recv_len >= 4 ? ntohs(*(uint16_t *)packet) : 0;
+    if (opcode == TFTP_OPCODE_ERROR) {
+        transfer_error(t, "Client aborted transfer", ntohs(*(uint16_t *)(packet + 2)), "Transfer aborted");
+        close_transfer(t);
+        return -1;
+    }
+
+    /* Check if the received packet is an ACK */
+    if (opcode != TFTP_OPCODE_ACK) {
+        transfer_error(t, "Invalid ACK received", TFTP_ERROR_ILLEGAL_OP, "Illegal TFTP operation");
+        send_error(t->sock, &t->peer, t->peer_len, TFTP_ERROR_ILLEGAL_OP, "Illegal TFTP operation");
+        close_transfer(t);
+        return -1;
+    }
+    ack_block = ntohs(*(uint16_t *)(packet + 2));
+
+    if (t->state == TRANSFER_OACK_SENT) {
+        if (ack_block != 0) {
+            return 0;
+        }
+        rtt_sample(t);
+        t->state = TRANSFER_SENDING;
+        if (rrq_send_window(t) < 0) {
+            close_transfer(t);
+            return -1;
+        }
+        start_timer(t);
+        return 0;
+    }
+
+    /*
+     * Only an ACK that moves the window forward gets an answer. Resending on
+     * a duplicate ACK would double every packet from then on (the Sorcerer's
+     * Apprentice bug); lost blocks are resent when the timer fires instead.
+     */
+    window_end = t->acked + t->windowsize;
+    if (t->last_block && window_end > t->last_block) {
+        window_end = t->last_block;
+    }
+    ack_delta = (uint16_t)(ack_block - (uint16_t)t->acked);
+    if (ack_delta == 0 || ack_delta > window_end - t->acked) {
+        stats.ignored_acks++;
+        return 0;
+    }
+    t->acked += ack_delta;
+    rtt_sample(t);
+
+    if (t->last_block && t->acked >= t->last_block) {
+        log_msg(LOG_INFO, "RRQ: File '%s' send complete", t->path);
+        t->complete = 1;
+        close_transfer(t);
+        return -1;
+    }
+
+    /* An ACK short of the window end means the rest was lost; resend from there */
+    if (rrq_send_window(t) < 0) {
+        close_transfer(t);
+        return -1;
+    }
+    start_timer(t);
+    if (t->acked < window_end) {
+        /* Part of the new window is a resend, so its ACK can't be timed */
+        t->timing = 0;
+    }
+    return 0;
+}
+
+void handle_wrq(const struct sockaddr_in *client_addr, socklen_t client_len, const char *filename, const char *directory, const struct tftp_options *options) {
+    struct transfer *t;
+    char packet[PACKET_SIZE];
+    size_t reply_len;
+
+    t = new_transfer(client_addr, client_len);
+    if (t == NULL) {
+        return;
+    }
+    t->opcode = TFTP_OPCODE_WRQ;
+    t->options = *options;
+    t->windowsize = options->windowsize ? options->windowsize : 1;
+    t->blksize = options->blksize ? options->blksize : TFTP_DATA_SIZE;
+    if (options->timeout) {
+        t->rto = options->timeout * 1000L;
+    }
+
+    snprintf(t->path, sizeof(t->path), "%s/%s", directory, filename);
+
+    /* The upload goes to a temporary file; the destination is only replaced once it is complete */
+    t->sink = sink_open(t);
+    if (t->sink == NULL) {
+        if (errno == ENOSPC || errno == EDQUOT || errno == ENOMEM) {
+            transfer_error(t, "File cannot be created", TFTP_ERROR_DISK_FULL, strerror(errno));
+            send_error(t->sock, &t->peer, t->peer_len, TFTP_ERROR_DISK_FULL, "Disk full or allocation exceeded");
+        } else {
+            transfer_error(t, "File cannot be created", TFTP_ERROR_ACCESS_VIOLATION, strerror(errno));
+            send_error(t->sock, &t->peer, t->peer_len, TFTP_ERROR_ACCESS_VIOLATION, "Cannot create file");
+        }
+        close_transfer(t);
+        return;
+    }
+
+    /* A whole window arrives in one burst; a default-sized receive queue drops the tail of a large one */
+    {
+        int rcvbuf = t->windowsize * (4 + t->blksize) * 2;
+        if (rcvbuf > 256 * 1024) {
+            setsockopt(t->sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+        }
+    }
+
+#ifndef USE_MMSG
+    /* Batched receives land in a buffer shared by all transfers; single ones need their own */
+    t->buffer = malloc(4 + t->blksize);
+    if (t->buffer == NULL) {
+        transfer_error(t, "Out of memory", TFTP_ERROR_DISK_FULL, strerror(errno));
+        send_error(t->sock, &t->peer, t->peer_len, TFTP_ERROR_DISK_FULL, "Out of memory");
+        close_transfer(t);
+        return;
+    }
+#endif
+
+    log_options("WRQ: Receiving file", t->path, &t->options);
+
+    /* Answer with an OACK when options were accepted, otherwise ACK block 0 */
+    reply_len = build_oack(packet, &t->options);
+    if (reply_len == 0) {
+        packet[0] = 0;
+        packet[1] = TFTP_OPCODE_ACK;
+        packet[2] = 0;
+        packet[3] = 0;
+        reply_len = 4;
+    }
+    if (send_reply(t, packet, reply_len) < 0) {
+        close_transfer(t);
+        return;
+    }
+    if (LOG_ENABLED(LOG_DEBUG)) {
+        log_msg(LOG_DEBUG, "Sent %s for block 0", reply_len > 4 ? "OACK" : "ACK");
+    }
+    t->state = TRANSFER_RECEIVING;
+    start_timer(t);
+}
+
+/* A DATA packet (or ERROR) has arrived for a write transfer; returns -1 once the transfer is closed */
+int wrq_receive(struct transfer *t, const char *packet, ssize_t recv_len) {
+    uint16_t opcode, data_block;
+
+    opcode = recv_len >= 4 ? ntohs(*(uint16_t *)packet) : 0;
+    if (opcode == TFTP_OPCODE_ERROR) {
+        transfer_error(t, "Client aborted transfer", ntohs(*(uint16_t *)(packet + 2)), "Transfer aborted");
+        close_transfer(t);
+        return -1;
+    }
+    if (opcode != TFTP_OPCODE_DATA) {
+        transfer_error(t, "Not a DATA packet", TFTP_ERROR_ILLEGAL_OP, "Illegal TFTP operation");
+        send_error(t->sock, &t->peer, t->peer_len, TFTP_ERROR_ILLEGAL_OP, "Illegal TFTP operation");
+        close_transfer(t);
+        return -1;
+    }
+
+    data_block = ntohs(*(uint16_t *)(packet + 2));
+    if (t->state == TRANSFER_RECEIVING && data_block == (uint16_t)(t->block + 1)) {
+        /* The first new block after an ACK times the round trip */
+        if (t->unacked == 0) {
+            rtt_sample(t);
+            t->timing = 0;
+        }
+
+        sink_append(t->sink, packet + 4, recv_len - 4);
+        t->bytes += recv_len - 4;
+        t->block++;
+        t->unacked++;
+        t->deadline = now_ms + t->rto;
+
+        /* End of transfer (last block shorter than blksize): the final ACK waits until it is all on disk */
+        if (recv_len < t->blksize + 4) {
+            t->state = TRANSFER_FLUSHING;
+            sink_finish(t->sink);
+            return wrq_sink_progress(t);
+        }
+        if (t->sink->error) {
+            return wrq_sink_progress(t);
+        }
+        if (t->unacked < t->windowsize) {
+            return 0;
+        }
+#ifdef USE_WRITER
+        /* The next window has to fit without waiting for the disk; if not, the ACK waits for it */
+        if (sink_room(t->sink) < (size_t)t->windowsize * t->blksize) {
+            t->ack_held = 1;
+            return 0;
+        }
+#endif
+    } else if (t->state == TRANSFER_FLUSHING || t->ack_held) {
+        /* Nothing is acknowledged until the writer catches up */
+        return 0;
+    } else if (now_ms - t->sent_at < (unsigned long)t->rto / 2) {
+        /*
+         * A repeated or out-of-order block. The first one after our last ACK
+         * gets that ACK again, to rewind the sender or replace a lost ACK;
+         * the rest of the same burst are dropped rather than each answered.
+         */
+        return 0;
+    }
+
+    /* ACK at the end of each window, or to rewind the sender after a gap */
+    if (wrq_send_ack(t) < 0) {
+        close_transfer(t);
+        return -1;
+    }
+    t->unacked = 0;
+    start_timer(t);
+    if (t->state == TRANSFER_DALLYING) {
+        t->deadline = now_ms + TFTP_TIMEOUT * 1000;
+    }
+    return 0;
+}
+
+/* Acknowledge every block up to t->block */
+int wrq_send_ack(struct transfer *t) {
+    char ack_packet[4];
+
+    ack_packet[0] = 0;
+    ack_packet[1] = TFTP_OPCODE_ACK;
+    ack_packet[2] = t->block >> 8;
+    ack_packet[3] = t->block & 0xFF;
+    if (send_reply(t, ack_packet, 4) < 0) {
+        return -1;
+    }
+    if (LOG_ENABLED(LOG_DEBUG)) {
+        log_msg(LOG_DEBUG, "Sent ACK for block %d", t->block);
+    }
+    return 0;
+}
+
+/*
+ * Move an upload on once the sink has caught up: report a failed write,
+ * send an ACK that was waiting for buffer space, or, when the last block
+ * is on disk, rename the file into place and send the final ACK. Returns
+ * -1 once the transfer is closed.
+ */
+int wrq_sink_progress(struct transfer *t) {
+    struct sink *s = t->sink;
+
+    if (s->error) {
+        transfer_error(t, "File write failed", TFTP_ERROR_DISK_FULL, strerror(s->error));
+        send_error(t->sock, &t->peer, t->peer_len, TFTP_ERROR_DISK_FULL, "Disk full or allocation exceeded");
+        close_transfer(t);
+        return -1;
+    }
+
+    if (t->state == TRANSFER_FLUSHING) {
+        if (s->pending) {
+            return 0;
+        }
+        if (rename(s->temp_path, t->path) < 0) {
+            transfer_error(t, "File cannot be renamed", TFTP_ERROR_ACCESS_VIOLATION, strerror(errno));
+            send_error(t->sock, &t->peer, t->peer_len, TFTP_ERROR_ACCESS_VIOLATION, "Cannot create file");
+            close_transfer(t);
+            return -1;
+        }
+        s->temp_path[0] = '\0';
+        sink_free(s);
+        t->sink = NULL;
+
+        if (wrq_send_ack(t) < 0) {
+            close_transfer(t);
+            return -1;
+        }
+        t->unacked = 0;
+        start_timer(t);
+
+        /*
+         * The final ACK may be lost, and the client only sends the block
+         * again once its own retransmission timeout is up: stay as long as
+         * the longest one to answer it.
+         */
+        t->deadline = now_ms + TFTP_TIMEOUT * 1000;
+        t->ended_us = now_us;
+        log_msg(LOG_INFO, "WRQ: File '%s' upload complete", t->path);
+        t->complete = 1;
+        t->state = TRANSFER_DALLYING;
+        return 0;
+    }
+
+#ifdef USE_WRITER
+    if (t->ack_held && sink_room(s) >= (size_t)t->windowsize * t->blksize) {
+        t->ack_held = 0;
+        if (wrq_send_ack(t) < 0) {
+            close_transfer(t);
+            return -1;
+        }
+        t->unacked = 0;
+        start_timer(t);
+    }
+#endif
+    return 0;
+}
+
+/* Nothing arrived in time: resend whatever is awaiting an answer, backing off each time */
+void transfer_timeout(struct transfer *t) {
+    if (t->state == TRANSFER_DALLYING) {
+        close_transfer(t);
+        return;
+    }
+
+    if (++t->retries > TFTP_MAX_RETRIES) {
+        transfer_error(t, "Transfer timed out", 0, t->path);
+        send_error(t->sock, &t->peer, t->peer_len, 0, "Transfer timed out");
+        close_transfer(t);
+        return;
+    }
+
+    if (!t->options.timeout) {
+        t->rto *= 2;
+        if (t->rto > TFTP_TIMEOUT * 1000) {
+            t->rto = TFTP_TIMEOUT * 1000;
+        }
+    }
+
+    if (t->state != TRANSFER_FLUSHING && !t->ack_held) {
+        stats.retransmits++;
+    }
+    if (t->state == TRANSFER_SENDING) {
+        if (rrq_send_window(t) < 0) {
+            close_transfer(t);
+            return;
+        }
+    } else if (t->state == TRANSFER_FLUSHING || t->ack_held) {
+        /* Waiting on the disk, not the client: the ACK goes out once the writer catches up */
+    } else if (t->state == TRANSFER_RECEIVING && t->block != 0) {
+        /* Acknowledge what did arrive, so the sender resends from the first missing block */
+        if (wrq_send_ack(t) < 0) {
+            close_transfer(t);
+            return;
+        }
+    } else if (send_reply(t, t->reply, t->reply_len) < 0) {
+        close_transfer(t);
+        return;
+    }
+    t->unacked = 0;
+    start_timer(t);
+    t->timing = 0;
+}
+
+/* Fire due timers; returns milliseconds until the next one, for the poller's timeout */
+long process_timers() {
+    long next = 1000;
+    int i;
+
+    for (i = transfer_count - 1; i >= 0; i--) {
+        struct transfer *t = transfers[i];
+        long remaining = (long)(t->deadline - now_ms);
+
+        if (remaining <= 0) {
+            transfer_timeout(t);
+            if (i < transfer_count && transfers[i] == t) {
+                remaining = (long)(t->deadline - now_ms);
+            }
+        }
+        if (remaining > 0 && remaining < next) {
+            next = remaining;
+        }
+    }
+    return next;
+}
+
+/* Read one request from the well-known port and start a transfer for it */
+void handle_request(int sock, const char *directory) {
+    struct sockaddr_in client_addr;
+    socklen_t client_len = sizeof(client_addr);
+    char buffer[PACKET_SIZE + 1];
+    ssize_t recv_len;
+
+    /* Receive incoming TFTP request */
+    recv_len = recvfrom(sock, buffer, sizeof(buffer) - 1, 0, (struct sockaddr *)&client_addr, &client_len);
+    if (recv_len < 0) {
+        perror("recvfrom failed");
+        return;
+    }
+    handle_packet(sock, directory, buffer, recv_len, &client_addr, client_len);
+}
+
+/* Start a transfer for a request that arrived on the well-known port; buffer has room for a NUL after it */
+void handle_packet(int sock, const char *directory, char *buffer, ssize_t recv_len, struct sockaddr_in *client_addr, socklen_t client_len) {
+    uint16_t opcode;
+    char *filename;
+    struct tftp_options options;
+    char client_ip[INET_ADDRSTRLEN];
+
+    buffer[recv_len] = '\0';   /* An unterminated final field can't run off the end */
+
+    /* Determine the request type (RRQ or WRQ) */
+    opcode = recv_len >= 2 ? ntohs(*(uint16_t *)buffer) : 0;
+    filename = buffer + 2;
+
+    /* A client repeating its request while the first is being served gets no second transfer */
+    if (find_transfer(client_addr) != NULL) {
+        return;
+    }
+
+    if (LOG_ENABLED(LOG_DEBUG)) {
+        log_msg(LOG_DEBUG, "Received: %s for '%s', Block: 0, Length: %ld bytes",
+                opcode == TFTP_OPCODE_RRQ ? "RRQ" : "WRQ", filename, (long)recv_len);
+    }
+
+    parse_options(buffer, recv_len, &options);
+    inet_ntop(AF_INET, &client_addr->sin_addr, client_ip, sizeof(client_ip));
+
+    if ((opcode == TFTP_OPCODE_RRQ || opcode == TFTP_OPCODE_WRQ) && transfer_count >= MAX_TRANSFERS) {
+        /* Not a TFTP protocol failure, so code 0 with a message, as for a timeout */
+        log_msg(LOG_WARN, "ERROR: [%s:%d] Too many transfers (Code 0: Server busy)", client_ip, ntohs(client_addr->sin_port));
+        send_error(sock, client_addr, client_len, 0, "Server busy");
+    } else if (opcode == TFTP_OPCODE_RRQ) {
+        log_msg(LOG_INFO, "[%s:%d] RRQ request for file: '%s'", client_ip, ntohs(client_addr->sin_port), filename);
+        handle_rrq(client_addr, client_len, filename, directory, &options);
+    } else if (opcode == TFTP_OPCODE_WRQ) {
+        log_msg(LOG_INFO, "[%s:%d] WRQ request for file: '%s'", client_ip, ntohs(client_addr->sin_port), filename);
+        handle_wrq(client_addr, client_len, filename, directory, &options);
+    } else {
+        /* Unsupported request type */
+        log_msg(LOG_WARN, "ERROR: [%s:%d] Unsupported TFTP operation (Code %d: Illegal TFTP operation)",
+                client_ip, ntohs(client_addr->sin_port), TFTP_ERROR_ILLEGAL_OP);
+        send_error(sock, client_addr, client_len, TFTP_ERROR_ILLEGAL_OP, "Illegal TFTP operation");
+    }
+}
+
+#ifdef USE_MMSG
+/* Whether packet is an ACK that a later one matches or passes; ACKs are cumulative */
+int ack_covered(const char *packet, size_t length, const char *later, size_t later_length) {
+    return length >= 4 && ntohs(*(uint16_t *)packet) == TFTP_OPCODE_ACK &&
+           later_length >= 4 && ntohs(*(uint16_t *)later) == TFTP_OPCODE_ACK &&
+           (uint16_t)(ntohs(*(uint16_t *)(later + 2)) - ntohs(*(uint16_t *)(packet + 2))) <= TFTP_MAX_WINDOWSIZE;
+}
+
+/* An ACK is worth acting on only if no later ACK in the batch matches or passes it */
+int ack_superseded(struct mmsghdr *msgs, int i, int count) {
+    int j;
+
+    for (j = i + 1; j < count; j++) {
+        if (ack_covered(msgs[i].msg_hdr.msg_iov->iov_base, msgs[i].msg_len, msgs[j].msg_hdr.msg_iov->iov_base, msgs[j].msg_len)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+#endif
+
+/* Drain what has arrived on a transfer's socket: a batch at a time with USE_MMSG, else one packet */
+void transfer_readable(struct transfer *t) {
+    int writing = t->state == TRANSFER_RECEIVING || t->state == TRANSFER_FLUSHING || t->state == TRANSFER_DALLYING;
+#ifdef USE_MMSG
+    static char batch[RECV_BATCH_BYTES];
+    struct mmsghdr msgs[RECV_BATCH];
+    struct iovec iov[RECV_BATCH];
+    size_t slot_size = writing ? 4 + (size_t)t->blksize : PACKET_SIZE;
+    int slots = RECV_BATCH_BYTES / slot_size;
+    int received, i;
+
+    if (slots > RECV_BATCH) {
+        slots = RECV_BATCH;
+    }
+    memset(msgs, 0, slots * sizeof(msgs[0]));
+    for (i = 0; i < slots; i++) {
+        iov[i].iov_base = batch + i * slot_size;
+        iov[i].iov_len = slot_size;
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    received = recvmmsg(t->sock, msgs, slots, MSG_DONTWAIT, NULL);
+    if (received < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            return;
+        }
+        /* A connected socket reports the client's port going away as ECONNREFUSED */
+        transfer_error(t, "Transfer socket failed", TFTP_ERROR_UNKNOWN_ID, strerror(errno));
+        close_transfer(t);
+        return;
+    }
+
+    for (i = 0; i < received; i++) {
+        int result;
+
+        if (writing) {
+            result = wrq_receive(t, iov[i].iov_base, msgs[i].msg_len);
+        } else if (ack_superseded(msgs, i, received)) {
+            continue;
+        } else {
+            result = rrq_receive(t, iov[i].iov_base, msgs[i].msg_len);
+        }
+        if (result < 0) {
+            return;
+        }
+    }
+#else
+    char packet[PACKET_SIZE];
+    char *buffer = writing ? t->buffer : packet;
+    ssize_t recv_len;
+
+    recv_len = recv(t->sock, buffer, writing ? 4 + t->blksize : sizeof(packet), 0);
+    if (recv_len < 0) {
+        /* A connected socket reports the client's port going away as ECONNREFUSED */
+        transfer_error(t, "Transfer socket failed", TFTP_ERROR_UNKNOWN_ID, strerror(errno));
+        close_transfer(t);
+        return;
+    }
+    if (writing) {
+        wrq_receive(t, buffer, recv_len);
+    } else {
+        rrq_receive(t, buffer, recv_len);
+    }
+#endif
+}
+
+#ifdef USE_URING
+/* A submission for the next pass; the ring is only ever short of room when the kernel has stopped taking them */
+struct io_uring_sqe *ring_sqe(int opcode, int fd, unsigned long user_data) {
+    struct io_uring_sqe *sqe = uring_sqe(&ring, opcode, fd, user_data);
+
+    if (sqe == NULL) {
+        perror("io_uring_enter failed");
+        exit(EXIT_FAILURE);
+    }
+    return sqe;
+}
+
+/* A cleared send record for t, from the free list when there is one */
+struct ring_send *ring_send_new(struct transfer *t) {
+    struct ring_send *s = free_sends;
+
+    if (s) {
+        free_sends = s->next;
+        free_send_count--;
+    } else {
+        s = malloc(sizeof(*s));
+        if (s == NULL) {
+            perror("malloc failed");
+            return NULL;
+        }
+    }
+    memset(&s->msg, 0, sizeof(s->msg));
+    s->t = t;
+    s->gso = 0;
+    return s;
+}
+
+/* Queue the record's first iovlen iovecs as one datagram, or one segmented send */
+void ring_send_queue(struct ring_send *s, int iovlen) {
+    struct io_uring_sqe *sqe = ring_sqe(IORING_OP_SENDMSG, s->t->sock, (unsigned long)s | URING_SEND);
+
+    s->msg.msg_iov = s->iov;
+    s->msg.msg_iovlen = iovlen;
+    sqe->addr = (unsigned long)&s->msg;
+    sqe->len = 1;
+    s->t->uring_ops++;
+}
+
+/* send_blocks() for the ring: the same segmented and single sends, queued to go with the rest of the pass */
+int ring_send_blocks(struct transfer *t, struct data_block *blocks, int count) {
+    struct ring_send *s;
+    int sent = 0;
+    int i;
+
+#ifdef USE_GSO
+    while (t->gso && count - sent > 1 && 2 * (4 + t->blksize) <= GSO_MAX_BYTES) {
+        uint16_t segment = 4 + t->blksize;
+        int n = count - sent;
+
+        if (n > GSO_MAX_SEGMENTS) {
+            n = GSO_MAX_SEGMENTS;
+        }
+        if (n > GSO_MAX_BYTES / segment) {
+            n = GSO_MAX_BYTES / segment;
+        }
+        s = ring_send_new(t);
+        if (s == NULL) {
+            return -1;
+        }
+        for (i = 0; i < n; i++) {
+            memcpy(s->headers[i], blocks[sent + i].header, 4);
+            s->iov[2 * i].iov_base = s->headers[i];
+            s->iov[2 * i].iov_len = 4;
+            s->iov[2 * i + 1].iov_base = (char *)blocks[sent + i].data;
+            s->iov[2 * i + 1].iov_len = blocks[sent + i].length;
+        }
+        segment_msg(&s->msg, &s->control, segment);
+        s->gso = 1;
+        ring_send_queue(s, 2 * n);
+        sent += n;
+    }
+#endif
+
+    for (; sent < count; sent++) {
+        s = ring_send_new(t);
+        if (s == NULL) {
+            return -1;
+        }
+        memcpy(s->headers[0], blocks[sent].header, 4);
+        s->iov[0].iov_base = s->headers[0];
+        s->iov[0].iov_len = 4;
+        s->iov[1].iov_base = (char *)blocks[sent].data;
+        s->iov[1].iov_len = blocks[sent].length;
+        ring_send_queue(s, 2);
+    }
+    return 0;
+}
+
+/* send_reply() for the ring; the reply is copied, as the transfer may replace it before this goes */
+int ring_send_reply(struct transfer *t) {
+    struct ring_send *s = ring_send_new(t);
+
+    if (s == NULL) {
+        return -1;
+    }
+    memcpy(s->reply, t->reply, t->reply_len);
+    s->iov[0].iov_base = s->reply;
+    s->iov[0].iov_len = t->reply_len;
+    ring_send_queue(s, 1);
+    return 0;
+}
+
+/* A send has completed; failures are handled as send_blocks() and send_reply() callers would have */
+void ring_sent(struct ring_send *s, int res) {
+    struct transfer *t = s->t;
+    int gso = s->gso;
+
+    if (free_send_count < URING_FREE_SENDS) {
+        s->next = free_sends;
+        free_sends = s;
+        free_send_count++;
+    } else {
+        free(s);
+    }
+
+    t->uring_ops--;
+    if (t->closed) {
+        ring_transfer_done(t);
+        return;
+    }
+    if (res >= 0) {
+        return;
+    }
+#ifdef USE_GSO
+    if (gso) {
+        if (!t->gso) {
+            return;                 /* The rest of a window already being sent again */
+        }
+        if (res == -EINVAL || res == -EIO || res == -EOPNOTSUPP || res == -ENOPROTOOPT) {
+            /* Refused for this path (too large for the MTU, no offload): resend the window without, for good */
+            t->gso = 0;
+            if (t->state == TRANSFER_SENDING && rrq_send_window(t) < 0) {
+                close_transfer(t);
+            }
+            return;
+        }
+    }
+#else
+    (void)gso;
+#endif
+    errno = -res;
+    perror("send failed");
+    close_transfer(t);
+}
+
+/* Start t's receive, with buffers big enough for what its client sends */
+void ring_arm(struct transfer *t) {
+    struct io_uring_sqe *sqe = ring_sqe(IORING_OP_RECV, t->sock, (unsigned long)t | URING_RECV);
+
+    t->recv_group = &small_buffers;
+    if (t->opcode == TFTP_OPCODE_WRQ && 4 + t->blksize > URING_SMALL_BUFFER_SIZE) {
+        t->recv_group = &large_buffers;
+    }
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = t->recv_group->group;
+    t->recv_armed = 1;
+    t->uring_ops++;
+}
+
+/* Requests carry the client's address, so the well-known port's receive is a recvmsg() */
+void ring_arm_requests(int sock) {
+    struct io_uring_sqe *sqe = ring_sqe(IORING_OP_RECVMSG, sock, URING_REQUEST);
+
+    sqe->addr = (unsigned long)&request_msg;
+    sqe->len = 1;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = small_buffers.group;
+}
+
+#ifdef USE_WRITER
+void ring_arm_writer() {
+    struct io_uring_sqe *sqe = ring_sqe(IORING_OP_POLL_ADD, sink_pipe[0], URING_WRITER);
+
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = POLLIN;
+}
+#endif
+
+/* close_transfer() for the ring: cancel what is pending on the socket and free the transfer once it is all in */
+void ring_close_transfer(struct transfer *t) {
+    struct io_uring_sqe *sqe;
+
+    t->closed = 1;
+    if (t->uring_ops == 0) {
+        transfer_free(t);
+        return;
+    }
+    sqe = ring_sqe(IORING_OP_ASYNC_CANCEL, t->sock, (unsigned long)t | URING_DONE);
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    t->uring_ops++;
+}
+
+/* One of a closed transfer's submissions or packets is finished with */
+void ring_transfer_done(struct transfer *t) {
+    if (t->closed && t->uring_ops == 0) {
+        transfer_free(t);
+    }
+}
+
+/* handle_request() for the ring: the request, its address and the header around them are in one buffer */
+void ring_request(int sock, const char *directory, int res, unsigned flags) {
+    if (res >= 0 && (flags & IORING_CQE_F_BUFFER)) {
+        unsigned bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        const char *data = uring_buffer(&small_buffers, bid);
+        const struct io_uring_recvmsg_out *out = (const struct io_uring_recvmsg_out *)data;
+        struct sockaddr_in client_addr;
+        char buffer[PACKET_SIZE + 1];
+        size_t length = out->payloadlen;
+        size_t room = URING_SMALL_BUFFER_SIZE - sizeof(*out) - request_msg.msg_namelen;
+
+        if (length > room) {
+            length = room;
+        }
+        if (length > PACKET_SIZE) {
+            length = PACKET_SIZE;
+        }
+        memcpy(&client_addr, data + sizeof(*out), sizeof(client_addr));
+        memcpy(buffer, data + sizeof(*out) + request_msg.msg_namelen, length);
+        uring_buffer_recycle(&small_buffers, bid);
+        handle_packet(sock, directory, buffer, length, &client_addr, sizeof(client_addr));
+    } else if (res < 0 && res != -ENOBUFS) {
+        errno = -res;
+        perror("recvmsg failed");
+    }
+    if (!(flags & IORING_CQE_F_MORE)) {
+        ring_arm_requests(sock);
+    }
+}
+
+/* A transfer's receive has delivered a datagram, or stopped */
+void ring_received(struct transfer *t, int res, unsigned flags) {
+    if (!(flags & IORING_CQE_F_MORE)) {
+        t->recv_armed = 0;
+        t->uring_ops--;
+        ring_unarmed = 1;
+    }
+
+    if (res >= 0 && (flags & IORING_CQE_F_BUFFER)) {
+        unsigned bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        struct ring_packet *p;
+
+        /* The packet holds the transfer, as a submission does, until it is handled */
+        t->uring_ops++;
+        if (ring_packet_count == URING_PACKETS) {
+            ring_handle_packets();
+        }
+        if (t->closed) {
+            uring_buffer_recycle(t->recv_group, bid);
+            t->uring_ops--;
+            ring_transfer_done(t);
+            return;
+        }
+        p = &ring_packets[ring_packet_count++];
+        p->t = t;
+        p->group = t->recv_group;
+        p->bid = bid;
+        p->length = res;
+        return;
+    }
+    if (res < 0 && res != -ENOBUFS && res != -ECANCELED && !t->closed) {
+        /* A connected socket reports the client's port going away as ECONNREFUSED */
+        transfer_error(t, "Transfer socket failed", TFTP_ERROR_UNKNOWN_ID, strerror(-res));
+        close_transfer(t);
+        return;
+    }
+    ring_transfer_done(t);
+}
+
+/* Hand the gathered packets to their transfers in arrival order, skipping ACKs a later one covers */
+void ring_handle_packets() {
+    int i, j;
+
+    for (i = 0; i < ring_packet_count; i++) {
+        struct ring_packet *p = &ring_packets[i];
+        struct transfer *t = p->t;
+        const char *packet = uring_buffer(p->group, p->bid);
+        int superseded = 0;
+
+        if (!t->closed && t->opcode == TFTP_OPCODE_WRQ) {
+            wrq_receive(t, packet, p->length);
+        } else if (!t->closed) {
+            for (j = i + 1; j < ring_packet_count && !superseded; j++) {
+                superseded = ring_packets[j].t == t &&
+                             ack_covered(packet, p->length, uring_buffer(ring_packets[j].group, ring_packets[j].bid), ring_packets[j].length);
+            }
+            if (!superseded) {
+                rrq_receive(t, packet, p->length);
+            }
+        }
+        uring_buffer_recycle(p->group, p->bid);
+        t->uring_ops--;
+        ring_transfer_done(t);
+    }
+    ring_packet_count = 0;
+}
+
+/* Set up the ring and its receive buffers; -1 with errno set if the kernel won't */
+int ring_start() {
+    if (uring_init(&ring, URING_ENTRIES) == -1) {
+        return -1;
+    }
+    if (uring_buffers_init(&ring, &small_buffers, 0, URING_SMALL_BUFFERS, URING_SMALL_BUFFER_SIZE) == -1 ||
+        uring_buffers_init(&ring, &large_buffers, 1, URING_LARGE_BUFFERS, URING_LARGE_BUFFER_SIZE) == -1) {
+        int saved = errno;
+
+        uring_buffers_free(&ring, &small_buffers);
+        uring_free(&ring);
+        errno = saved;
+        return -1;
+    }
+    memset(&request_msg, 0, sizeof(request_msg));
+    request_msg.msg_namelen = sizeof(struct sockaddr_in);
+    return 0;
+}
+
+/*
+ * The event loop on io_uring. Each pass arms receives for new transfers,
+ * then one io_uring_enter() submits everything queued since the last and
+ * waits for the next completion or timer.
+ */
+void run_ring_loop(int sock, const char *directory) {
+    long timeout = 1000;
+
+    ring_arm_requests(sock);
+#ifdef USE_WRITER
+    ring_arm_writer();
+#endif
+
+    while (1) {
+        struct io_uring_cqe *cqe;
+        int i;
+#ifdef USE_WRITER
+        int writer_done = 0;
+#endif
+
+        if (ring_unarmed) {
+            ring_unarmed = 0;
+            for (i = 0; i < transfer_count; i++) {
+                if (!transfers[i]->recv_armed) {
+                    ring_arm(transfers[i]);
+                }
+            }
+        }
+        if (uring_submit(&ring, 1, timeout) == -1) {
+            perror("io_uring_enter failed");
+            exit(EXIT_FAILURE);
+        }
+
+        clock_update();
+
+        while ((cqe = uring_cqe(&ring)) != NULL) {
+            struct io_uring_cqe done = *cqe;
+            unsigned long data = (unsigned long)done.user_data;
+            void *ptr = (void *)(data & ~(unsigned long)URING_TAG_MASK);
+
+            uring_cqe_seen(&ring);
+            switch (data & URING_TAG_MASK) {
+            case URING_REQUEST:
+                ring_request(sock, directory, done.res, done.flags);
+                break;
+            case URING_RECV:
+                ring_received(ptr, done.res, done.flags);
+                break;
+            case URING_SEND:
+                ring_sent(ptr, done.res);
+                break;
+#ifdef USE_WRITER
+            case URING_WRITER:
+                writer_done = 1;
+                if (!(done.flags & IORING_CQE_F_MORE)) {
+                    ring_arm_writer();
+                }
+                break;
+#endif
+            default:
+                ((struct transfer *)ptr)->uring_ops--;
+                ring_transfer_done(ptr);
+                break;
+            }
+        }
+        ring_handle_packets();
+#ifdef USE_WRITER
+        if (writer_done) {
+            sink_completions();
+        }
+#endif
+
+        timeout = process_timers();
+        image_cache_sweep();
+        if (image_stats_requested) {
+            image_stats_requested = 0;
+            print_image_stats();
+        }
+        if (stats_path && now_ms - stats_written_ms >= STATS_INTERVAL_MS) {
+            write_stats_file();
+        }
+    }
+}
+#endif
+
+/* With --io-uring the ring's loop takes over if the kernel allows it; returns if not */
+void run_ring_loop_if_wanted(int sock, const char *directory) {
+    if (!use_uring) {
+        return;
+    }
+#ifdef USE_URING
+    if (ring_start() == 0) {
+        run_ring_loop(sock, directory);     /* Doesn't return */
+    }
+    log_msg(LOG_WARN, "io_uring unavailable (%s), falling back", strerror(errno));
+#else
+    (void)sock;
+    (void)directory;
+    log_msg(LOG_WARN, "Built without io_uring, falling back");
+#endif
+    use_uring = 0;
+}
+
+/* Serve requests on the well-known port and every transfer's own socket from one loop */
+void run_event_loop(int sock, const char *directory) {
+    long timeout = 1000;
+#ifdef USE_EPOLL
+    struct epoll_event events[MAX_EVENTS];
+    struct epoll_event ev;
+
+    run_ring_loop_if_wanted(sock, directory);
+    if ((epoll_fd = epoll_create(MAX_EVENTS)) == -1) {
+        perror("epoll_create failed");
+        exit(EXIT_FAILURE);
+    }
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;  /* NULL marks the well-known port */
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock, &ev) == -1) {
+        perror("epoll_ctl failed");
+        exit(EXIT_FAILURE);
+    }
+#ifdef USE_WRITER
+    ev.data.ptr = sink_pipe;  /* And the pipe the writer thread signals through */
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sink_pipe[0], &ev) == -1) {
+        perror("epoll_ctl failed");
+        exit(EXIT_FAILURE);
+    }
+#endif
+
+    while (1) {
+        int i;
+#ifdef USE_WRITER
+        int writer_done = 0;
+#endif
+        int ready = epoll_wait(epoll_fd, events, MAX_EVENTS, (int)timeout);
+        if (ready == -1) {
+            if (errno != EINTR) {
+                perror("epoll_wait failed");
+            }
+            continue;
+        }
+
+        clock_update();
+
+        /*
+         * Each transfer is only ever freed from its own event, so later events
+         * stay valid; finished writes can end any upload, so they come last.
+         */
+        for (i = 0; i < ready; i++) {
+            struct transfer *t = events[i].data.ptr;
+            if (t == NULL) {
+                handle_request(sock, directory);
+#ifdef USE_WRITER
+            } else if (events[i].data.ptr == (void *)sink_pipe) {
+                writer_done = 1;
+#endif
+            } else {
+                transfer_readable(t);
+            }
+        }
+#ifdef USE_WRITER
+        if (writer_done) {
+            sink_completions();
+        }
+#endif
+
+        timeout = process_timers();
+        image_cache_sweep();
+        if (image_stats_requested) {
+            image_stats_requested = 0;
+            print_image_stats();
+        }
+        if (stats_path && now_ms - stats_written_ms >= STATS_INTERVAL_MS) {
+            write_stats_file();
+        }
+    }
+#else
+    static struct pollfd pollfds[MAX_TRANSFERS + 2];
+    static struct transfer *polled[MAX_TRANSFERS + 2];
+
+    run_ring_loop_if_wanted(sock, directory);
+    while (1) {
+        int i, first, count, ready;
+
+        pollfds[0].fd = sock;
+        pollfds[0].events = POLLIN;
+        count = 1;
+#ifdef USE_WRITER
+        pollfds[1].fd = sink_pipe[0];
+        pollfds[1].events = POLLIN;
+        count = 2;
+#endif
+        first = count;
+        for (i = 0; i < transfer_count; i++) {
+            pollfds[count].fd = transfers[i]->sock;
+            pollfds[count].events = POLLIN;
+            polled[count] = transfers[i];
+            count++;
+        }
+
+        ready = poll(pollfds, count, (int)timeout);
+        if (ready == -1) {
+            if (errno != EINTR) {
+                perror("poll failed");
+            }
+            continue;
+        }
+
+        clock_update();
+
+        for (i = first; i < count; i++) {
+            if (pollfds[i].revents != 0) {
+                transfer_readable(polled[i]);
+            }
+        }
+#ifdef USE_WRITER
+        if (pollfds[1].revents & POLLIN) {
+            sink_completions();
+        }
+#endif
+        if (pollfds[0].revents & POLLIN) {
+            handle_request(sock, directory);
+        }
+
+        timeout = process_timers();
+        image_cache_sweep();
+        if (image_stats_requested) {
+            image_stats_requested = 0;
+            print_image_stats();
+        }
+        if (stats_path && now_ms - stats_written_ms >= STATS_INTERVAL_MS) {
+            write_stats_file();
+        }
+    }
+#endif
+}
+
+void send_error(int sock, struct sockaddr_in *client_addr, socklen_t client_len, int error_code, const char *error_msg) {
+    char error_packet[516];
+    *(uint16_t *)error_packet = htons(TFTP_OPCODE_ERROR);
+    *(uint16_t *)(error_packet + 2) = htons(error_code);
+    strcpy(error_packet + 4, error_msg);
+
+    log_msg(LOG_INFO, "Sending ERROR: Code %d, Message: '%s'", error_code, error_msg);
+
+    sendto(sock, error_packet, strlen(error_msg) + 5, 0, (struct sockaddr *)client_addr, client_len);
+}
+
+/* Log why a transfer is failing; the code goes into its access log line */
+void transfer_error(struct transfer *t, const char *message, int error_code, const char *detail) {
+    char client_ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &t->peer.sin_addr, client_ip, sizeof(client_ip));
+    log_msg(LOG_WARN, "ERROR: [%s:%d] %s (Code %d: %s)", client_ip, ntohs(t->peer.sin_port), message, error_code, detail);
+    t->error = error_code;
+}
+
+/* Count a transfer as it closes, then give it its access log line */
+void transfer_finished(struct transfer *t) {
+    int wrq = t->opcode == TFTP_OPCODE_WRQ;
+    unsigned long bytes = t->bytes;
+    /* A finished upload's dally after the final ACK is not part of it */
+    unsigned long duration_us = (t->ended_us ? t->ended_us : now_us) - t->started_us;
+
+    if (!wrq) {
+        /* Bytes the client has acknowledged */
+        bytes = t->acked * t->blksize < t->size ? t->acked * t->blksize : t->size;
+    }
+    stats.transfers[wrq][t->complete]++;
+    stats.bytes[wrq] += bytes;
+    histogram_record(&stats.duration[wrq], duration_us);
+    log_transfer(t, bytes, duration_us);
+}
+
+/* One access log line per transfer: the TFTP error code as its status, "-" if it completed */
+void log_transfer(struct transfer *t, unsigned long bytes, unsigned long duration_us) {
+    struct access_entry entry;
+    char client_ip[INET_ADDRSTRLEN];
+
+    if (access_log_format == ACCESS_LOG_OFF) {
+        return;
+    }
+    inet_ntop(AF_INET, &t->peer.sin_addr, client_ip, sizeof(client_ip));
+    entry.remote = client_ip;
+    entry.port = ntohs(t->peer.sin_port);
+    entry.method = t->opcode == TFTP_OPCODE_RRQ ? "RRQ" : "WRQ";
+    entry.target = t->path;
+    entry.query = NULL;
+    entry.protocol = "TFTP";
+    entry.status = t->complete ? -1 : t->error >= 0 ? t->error : 0;
+    entry.bytes = bytes;
+    entry.latency_us = duration_us;
+    entry.when = time(NULL);
+    log_access(&entry);
+}
+
+/*
+ * Rewrite the stats file in Prometheus text format, through a temporary
+ * file so a reader never sees half of it; node_exporter's textfile
+ * collector can pick it up as it is.
+ */
+void write_stats_file() {
+    static const char *ops[] = { "rrq", "wrq" };
+    static int failing = 0;
+    struct metrics_text text;
+    char temp_path[PATH_MAX + 8];
+    char labels[16];
+    size_t written = 0;
+    int fd;
+    int op;
+
+    stats_written_ms = now_ms;
+    memset(&text, 0, sizeof(text));
+
+    metrics_printf(&text, "# HELP tftpd_transfers_total Transfers finished, by operation and outcome.\n"
+                   "# TYPE tftpd_transfers_total counter\n");
+    for (op = 0; op < 2; op++) {
+        metrics_printf(&text, "tftpd_transfers_total{op=\"%s\",result=\"complete\"} %lu\n", ops[op], stats.transfers[op][1]);
+        metrics_printf(&text, "tftpd_transfers_total{op=\"%s\",result=\"failed\"} %lu\n", ops[op], stats.transfers[op][0]);
+    }
+    metrics_printf(&text, "# HELP tftpd_transfers_in_flight Transfers in progress.\n"
+                   "# TYPE tftpd_transfers_in_flight gauge\ntftpd_transfers_in_flight %d\n", transfer_count);
+    metrics_printf(&text, "# HELP tftpd_bytes_total Payload bytes delivered by finished transfers.\n"
+                   "# TYPE tftpd_bytes_total counter\n");
+    for (op = 0; op < 2; op++) {
+        metrics_printf(&text, "tftpd_bytes_total{op=\"%s\"} %lu\n", ops[op], stats.bytes[op]);
+    }
+    metrics_printf(&text, "# HELP tftpd_data_packets_sent_total DATA packets sent, resends included.\n"
+                   "# TYPE tftpd_data_packets_sent_total counter\ntftpd_data_packets_sent_total %lu\n", stats.data_sent);
+    metrics_printf(&text, "# HELP tftpd_retransmits_total Timeouts that sent a window, ACK or OACK again.\n"
+                   "# TYPE tftpd_retransmits_total counter\ntftpd_retransmits_total %lu\n", stats.retransmits);
+    metrics_printf(&text, "# HELP tftpd_ignored_acks_total Duplicate or out-of-window ACKs.\n"
+                   "# TYPE tftpd_ignored_acks_total counter\ntftpd_ignored_acks_total %lu\n", stats.ignored_acks);
+    metrics_printf(&text, "# HELP tftpd_rtt_seconds Round trip from a window, ACK or OACK to its answer.\n"
+                   "# TYPE tftpd_rtt_seconds summary\n");
+    metrics_summary(&text, "tftpd_rtt_seconds", "", &stats.rtt, 1e-6);
+    metrics_printf(&text, "# HELP tftpd_transfer_duration_seconds From request to close.\n"
+                   "# TYPE tftpd_transfer_duration_seconds summary\n");
+    for (op = 0; op < 2; op++) {
+        sprintf(labels, "op=\"%s\"", ops[op]);
+        metrics_summary(&text, "tftpd_transfer_duration_seconds", labels, &stats.duration[op], 1e-6);
+    }
+    metrics_printf(&text, "# HELP tftpd_image_cache_lookups_total Shared file image lookups, by result.\n"
+                   "# TYPE tftpd_image_cache_lookups_total counter\n"
+                   "tftpd_image_cache_lookups_total{result=\"hit\"} %lu\n"
+                   "tftpd_image_cache_lookups_total{result=\"miss\"} %lu\n", image_stats.hits, image_stats.misses);
+    metrics_printf(&text, "# HELP tftpd_image_cache_evictions_total Images dropped from the cache.\n"
+                   "# TYPE tftpd_image_cache_evictions_total counter\ntftpd_image_cache_evictions_total %lu\n", image_stats.evictions);
+    metrics_printf(&text, "# HELP tftpd_image_cache_bytes File bytes held in shared images.\n"
+                   "# TYPE tftpd_image_cache_bytes gauge\ntftpd_image_cache_bytes %ld\n", image_cache_bytes);
+
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", stats_path);
+    fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    while (fd >= 0 && !text.failed && written < text.length) {
+        ssize_t n = write(fd, text.data + written, text.length - written);
+        if (n < 0) {
+            break;
+        }
+        written += n;
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    free(text.data);
+
+    /* A problem is reported once, not every second */
+    if (fd < 0 || written < text.length || text.failed || rename(temp_path, stats_path) < 0) {
+        if (!failing) {
+            log_msg(LOG_WARN, "Stats file '%s' could not be written: %s", stats_path, strerror(errno));
+        }
+        failing = 1;
+        unlink(temp_path);
+        return;
+    }
+    failing = 0;
 }
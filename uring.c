@@ -0,0 +1,316 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+/* The kernel and the process share the ring indexes; these order the accesses */
+#define LOAD_ACQUIRE(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define STORE_RELEASE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+static int uring_setup(unsigned entries, struct io_uring_params *params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int fd, unsigned submit, unsigned wait, unsigned flags, void *arg, size_t arg_size) {
+    return (int)syscall(__NR_io_uring_enter, fd, submit, wait, flags, arg, arg_size);
+}
+
+static int uring_register(int fd, unsigned opcode, const void *arg, unsigned count) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+/* Set up a ring of entries submissions; -1 with errno set if the kernel can't */
+int uring_init(struct uring *ring, unsigned entries) {
+    struct io_uring_params params;
+    char *sq, *cq;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+    /* Completions are only reaped by the thread that submits; let the kernel skip the cross-thread wakeups */
+    params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_CQSIZE;
+    params.cq_entries = entries * 4;
+    ring->fd = uring_setup(entries, &params);
+    if (ring->fd == -1) {
+        return -1;
+    }
+    /* SINGLE_ISSUER needs 6.0, as multishot receives do; these two are older but checked all the same */
+    if (!(params.features & IORING_FEAT_EXT_ARG) || !(params.features & IORING_FEAT_NODROP)) {
+        close(ring->fd);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    ring->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    ring->cq_map = mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sq_map == MAP_FAILED || ring->cq_map == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        int saved = errno;
+
+        uring_free(ring);
+        errno = saved;
+        return -1;
+    }
+
+    sq = ring->sq_map;
+    cq = ring->cq_map;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return 0;
+}
+
+void uring_free(struct uring *ring) {
+    free(ring->parked);
+    if (ring->sqes && ring->sqes != MAP_FAILED) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_map && ring->cq_map != MAP_FAILED) {
+        munmap(ring->cq_map, ring->cq_map_size);
+    }
+    if (ring->sq_map && ring->sq_map != MAP_FAILED) {
+        munmap(ring->sq_map, ring->sq_map_size);
+    }
+    if (ring->fd != -1) {
+        close(ring->fd);
+    }
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+/* The oldest completion still on the ring itself, or NULL */
+static struct io_uring_cqe *uring_ring_cqe(struct uring *ring) {
+    unsigned head = *ring->cq_head;
+
+    if (head == LOAD_ACQUIRE(ring->cq_tail)) {
+        return NULL;
+    }
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+/* Move the completions waiting on the ring aside, to be seen later; how many, or -1 with no memory */
+static int uring_park(struct uring *ring) {
+    struct io_uring_cqe *cqe;
+    int count = 0;
+
+    if (ring->parked_head == ring->parked_len) {
+        ring->parked_head = ring->parked_len = 0;
+    }
+    while ((cqe = uring_ring_cqe(ring)) != NULL) {
+        if (ring->parked_len == ring->parked_size) {
+            unsigned size = ring->parked_size ? 2 * ring->parked_size : 64;
+            struct io_uring_cqe *parked = realloc(ring->parked, size * sizeof(*parked));
+
+            if (parked == NULL) {
+                return -1;
+            }
+            ring->parked = parked;
+            ring->parked_size = size;
+        }
+        ring->parked[ring->parked_len++] = *cqe;
+        STORE_RELEASE(ring->cq_head, *ring->cq_head + 1);
+        count++;
+    }
+    return count;
+}
+
+/*
+ * A cleared submission for opcode on fd, queued to go in the next
+ * uring_submit(). A full queue is submitted first to make room. The kernel
+ * turns submissions away (EBUSY) while its completions have overflowed, so
+ * then the ring's completions are parked for uring_cqe() and it is tried
+ * again. NULL if the kernel fails, or still has no room with nothing left
+ * to park.
+ */
+struct io_uring_sqe *uring_sqe(struct uring *ring, int opcode, int fd, unsigned long user_data) {
+    struct io_uring_sqe *sqe;
+    unsigned tail = *ring->sq_tail;
+
+    while (tail - LOAD_ACQUIRE(ring->sq_head) >= ring->sq_entries) {
+        if (uring_submit(ring, 0, 0) == -1) {
+            return NULL;
+        }
+        if (tail - LOAD_ACQUIRE(ring->sq_head) < ring->sq_entries) {
+            break;
+        }
+        if (uring_park(ring) <= 0) {
+            errno = EBUSY;
+            return NULL;
+        }
+    }
+    sqe = &ring->sqes[tail & ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = user_data;
+    ring->sq_array[tail & ring->sq_mask] = tail & ring->sq_mask;
+    STORE_RELEASE(ring->sq_tail, tail + 1);
+    ring->sq_pending++;
+    return sqe;
+}
+
+/*
+ * Hand the queued submissions to the kernel and, if wait is non-zero, sleep
+ * until that many completions are in or timeout_ms passes (-1 for no
+ * limit), all in one system call. Returns -1 on errors other than the wait
+ * being cut short.
+ */
+int uring_submit(struct uring *ring, unsigned wait, long timeout_ms) {
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned flags = 0;
+
+    if (wait && (ring->parked_head != ring->parked_len || LOAD_ACQUIRE(ring->cq_tail) != *ring->cq_head)) {
+        wait = 0;                   /* Completions are already waiting */
+    }
+    if (ring->sq_pending == 0 && wait == 0) {
+        return 0;
+    }
+    memset(&arg, 0, sizeof(arg));
+    if (wait) {
+        flags |= IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+        if (timeout_ms >= 0) {
+            ts.tv_sec = timeout_ms / 1000;
+            ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+            arg.ts = (unsigned long)&ts;
+        }
+    }
+    while (1) {
+        int submitted = uring_enter(ring->fd, ring->sq_pending, wait, flags, wait ? &arg : NULL, wait ? sizeof(arg) : 0);
+
+        if (submitted >= 0) {
+            ring->sq_pending -= submitted;
+            return 0;
+        }
+        if (errno == ETIME || errno == EINTR || errno == EBUSY) {
+            /* EBUSY: the completion ring is full; the caller reaps and comes back */
+            return 0;
+        }
+        if (errno == EAGAIN) {
+            continue;
+        }
+        return -1;
+    }
+}
+
+/* The oldest completion not yet seen, parked ones first, or NULL */
+struct io_uring_cqe *uring_cqe(struct uring *ring) {
+    if (ring->parked_head != ring->parked_len) {
+        return &ring->parked[ring->parked_head];
+    }
+    return uring_ring_cqe(ring);
+}
+
+void uring_cqe_seen(struct uring *ring) {
+    if (ring->parked_head != ring->parked_len) {
+        ring->parked_head++;
+        return;
+    }
+    STORE_RELEASE(ring->cq_head, *ring->cq_head + 1);
+}
+
+/* An empty table of count registered files, filled in by IORING_OP_FILES_UPDATE */
+int uring_register_files(struct uring *ring, unsigned count) {
+    int *fds = malloc(count * sizeof(int));
+    unsigned i;
+    int result;
+
+    if (fds == NULL) {
+        return -1;
+    }
+    for (i = 0; i < count; i++) {
+        fds[i] = -1;
+    }
+    result = uring_register(ring->fd, IORING_REGISTER_FILES, fds, count);
+    free(fds);
+    return result < 0 ? -1 : 0;
+}
+
+/* Pin buffers that IORING_OP_READ_FIXED and friends then name by index */
+int uring_register_buffers(struct uring *ring, const struct iovec *iov, unsigned count) {
+    return uring_register(ring->fd, IORING_REGISTER_BUFFERS, iov, count) < 0 ? -1 : 0;
+}
+
+/* Give the kernel count buffers of size bytes as group, for receives with IOSQE_BUFFER_SELECT */
+int uring_buffers_init(struct uring *ring, struct uring_buffers *b, int group, unsigned count, unsigned size) {
+    struct io_uring_buf_reg reg;
+    unsigned i;
+
+    memset(b, 0, sizeof(*b));
+    b->group = group;
+    b->size = size;
+    b->count = count;
+    b->ring_size = count * sizeof(struct io_uring_buf);
+    b->ring = mmap(NULL, b->ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (b->ring == MAP_FAILED) {
+        b->ring = NULL;
+        return -1;
+    }
+    b->base = malloc((size_t)count * size);
+    if (b->base == NULL) {
+        uring_buffers_free(ring, b);
+        return -1;
+    }
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long)b->ring;
+    reg.ring_entries = count;
+    reg.bgid = group;
+    if (uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        int saved = errno;
+
+        free(b->base);
+        b->base = NULL;
+        munmap(b->ring, b->ring_size);
+        b->ring = NULL;
+        errno = saved;
+        return -1;
+    }
+    for (i = 0; i < count; i++) {
+        uring_buffer_recycle(b, i);
+    }
+    return 0;
+}
+
+void uring_buffers_free(struct uring *ring, struct uring_buffers *b) {
+    struct io_uring_buf_reg reg;
+
+    if (b->ring && b->base) {
+        memset(&reg, 0, sizeof(reg));
+        reg.bgid = b->group;
+        uring_register(ring->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+    }
+    if (b->ring) {
+        munmap(b->ring, b->ring_size);
+    }
+    free(b->base);
+    memset(b, 0, sizeof(*b));
+}
+
+char *uring_buffer(const struct uring_buffers *b, unsigned bid) {
+    return b->base + (size_t)bid * b->size;
+}
+
+/* Hand a buffer the kernel filled back to it once its bytes have been used */
+void uring_buffer_recycle(struct uring_buffers *b, unsigned bid) {
+    struct io_uring_buf *buf = &b->ring->bufs[b->tail & (b->count - 1)];
+
+    buf->addr = (unsigned long)uring_buffer(b, bid);
+    buf->len = b->size;
+    buf->bid = bid;
+    b->tail++;
+    STORE_RELEASE(&b->ring->tail, b->tail);
+}
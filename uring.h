@@ -0,0 +1,63 @@
+#ifndef URING_H
+#define URING_H
+
+/*
+ * A small io_uring driver on the bare system calls, so the servers don't
+ * need liburing: the submission and completion rings, provided buffer rings
+ * that multishot receives pick their buffers from, and registered files and
+ * buffers. Linux only; the Makefile builds it in unless URING is empty, and
+ * the servers fall back to epoll when the kernel refuses it.
+ */
+#include <stddef.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+struct uring {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_array;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sq_pending;            /* SQEs handed out and not yet submitted */
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    struct io_uring_cqe *parked;    /* Completions taken off a full ring to make room, handed out first */
+    unsigned parked_head;
+    unsigned parked_len;
+    unsigned parked_size;
+    void *sq_map;
+    size_t sq_map_size;
+    void *cq_map;
+    size_t cq_map_size;
+    size_t sqes_size;
+};
+
+/* Equal-sized receive buffers the kernel picks from; a completion names the one it filled */
+struct uring_buffers {
+    struct io_uring_buf_ring *ring;
+    size_t ring_size;
+    char *base;
+    unsigned size;                  /* Bytes in each buffer */
+    unsigned count;                 /* A power of two */
+    unsigned short tail;
+    int group;
+};
+
+int uring_init(struct uring *ring, unsigned entries);
+void uring_free(struct uring *ring);
+struct io_uring_sqe *uring_sqe(struct uring *ring, int opcode, int fd, unsigned long user_data);
+int uring_submit(struct uring *ring, unsigned wait, long timeout_ms);
+struct io_uring_cqe *uring_cqe(struct uring *ring);
+void uring_cqe_seen(struct uring *ring);
+int uring_register_files(struct uring *ring, unsigned count);
+int uring_register_buffers(struct uring *ring, const struct iovec *iov, unsigned count);
+int uring_buffers_init(struct uring *ring, struct uring_buffers *b, int group, unsigned count, unsigned size);
+void uring_buffers_free(struct uring *ring, struct uring_buffers *b);
+char *uring_buffer(const struct uring_buffers *b, unsigned bid);
+void uring_buffer_recycle(struct uring_buffers *b, unsigned bid);
+
+#endif